@@ -1,8 +1,16 @@
 /**
  * \file
- * Different estimations of spin flip probability.
+ * Different estimations of spin flip probability and adiabaticity.
  */
 
+#ifndef ADIABACITY_H_
+#define ADIABACITY_H_
+
+#include <cmath>
+#include <cstdio>
+
+#include "globals.h"
+
 /**
  * Probability for NO neutron spin flip after Rabi (from Matora paper)
  *
@@ -18,7 +26,7 @@
  *
  * @return Returns probability that neutron undergoes NO spin flip
  */
-long double rabiplus(double Br,double Bz,double dBrdr,double dBrdz,double dBzdr,double dBzdz,double vr_n,double vz_n,double t)
+inline long double rabiplus(double Br,double Bz,double dBrdr,double dBrdz,double dBzdr,double dBzdz,double vr_n,double vz_n,double t)
 {
         long double t3,t5,t6,t9,t11,t12,t13,t14,t16,t17,t22,t23,t27,t33,t34,rabiplus;
         long double gamm = 1.83247188e+8;
@@ -59,7 +67,7 @@ long double rabiplus(double Br,double Bz,double dBrdr,double dBrdz,double dBzdr,
  *
  * @return Returns probability that neutron undergoes spin flip
  */
-long double rabimin(double Br,double Bz,double dBrdr,double dBrdz,double dBzdr,double dBzdz,double vr_n,double vz_n,double t)
+inline long double rabimin(double Br,double Bz,double dBrdr,double dBrdz,double dBzdr,double dBzdz,double vr_n,double vz_n,double t)
 {
         long double t3,t6,t8,t11,t13,t14,t15,t16,t19,t20,t22,t23,t27,t31,t33,rabimin;
         long double gamm = 1.83247188e+8;
@@ -110,7 +118,7 @@ long double rabimin(double Br,double Bz,double dBrdr,double dBrdz,double dBzdr,d
  *
  * @return Returns probability that neutron undergoes spin flip
  */
-long double vladimirsky(long double Bx,long double By, long double Bz,long double dBxdx, long double dBxdy, long double dBxdz, long double dBydx, long double dBydy, long double dBydz, long double dBzdx, long double dBzdy, long double dBzdz, long double Bws, long double vx, long double vy, long double vz){
+inline long double vladimirsky(long double Bx,long double By, long double Bz,long double dBxdx, long double dBxdy, long double dBxdz, long double dBydx, long double dBydy, long double dBydz, long double dBzdx, long double dBzdy, long double dBzdz, long double Bws, long double vx, long double vy, long double vz){
 	long double vabs, dBdt_par, dBdt_perp, dBdt_x, dBdt_y, dBdt_z, dBdt_square, W;
 
     dBdt_x = dBxdx*vx + dBxdy*vy + dBxdz*vz;
@@ -157,7 +165,7 @@ long double vladimirsky(long double Bx,long double By, long double Bz,long doubl
  *
  * @return Returns adiabacity criterion dBdt*hbar/2/mu/B^2
  */
-long double thumbrule(long double Bx, long double By, long double Bz,long double dBxdx, long double dBxdy, long double dBxdz, long double dBydx, long double dBydy, long double dBydz, long double dBzdx, long double dBzdy, long double dBzdz, long double Bws, long double vx, long double vy, long double vz){
+inline long double thumbrule(long double Bx, long double By, long double Bz,long double dBxdx, long double dBxdy, long double dBxdz, long double dBydx, long double dBydy, long double dBydz, long double dBzdx, long double dBzdy, long double dBzdz, long double Bws, long double vx, long double vy, long double vz){
 
 	long double dBdt, dBdt_x, dBdt_y, dBdt_z;
 
@@ -173,3 +181,70 @@ long double thumbrule(long double Bx, long double By, long double Bz,long double
     else return 1e31;
 }
 
+
+/**
+ * Calculate adiabaticity parameter of spin precession |dB/dt|/|gamma|/B^2 (should be <<1 for adiabatic spin transport)
+ *
+ * Same as thumbrule(), but for arbitrary gyromagnetic ratio. This is the rate of change of the magnetic field seen by the moving particle
+ * relative to the Larmor frequency. It includes changes of the field magnitude, so it is an upper limit for the rate at which the field direction rotates.
+ *
+ * @param dBxdx Derivative of x component with respect to x
+ * @param dBxdy Derivative of x component with respect to y
+ * @param dBxdz Derivative of x component with respect to z
+ * @param dBydx Derivative of y component with respect to x
+ * @param dBydy Derivative of y component with respect to y
+ * @param dBydz Derivative of y component with respect to z
+ * @param dBzdx Derivative of z component with respect to x
+ * @param dBzdy Derivative of z component with respect to y
+ * @param dBzdz Derivative of z component with respect to z
+ * @param Bws Absolute magnetic field
+ * @param vx Velocity of particle in x direction
+ * @param vy Velocity of particle in y direction
+ * @param vz Velocity of particle in z direction
+ * @param gamma Gyromagnetic ratio of particle
+ *
+ * @return Returns adiabaticity parameter |dB/dt|/|gamma|/B^2
+ */
+inline long double spinadiabaticity(long double dBxdx, long double dBxdy, long double dBxdz, long double dBydx, long double dBydy, long double dBydz, long double dBzdx, long double dBzdy, long double dBzdz, long double Bws, long double vx, long double vy, long double vz, long double gamma){
+	long double dBdt_x = dBxdx*vx + dBxdy*vy + dBxdz*vz;
+	long double dBdt_y = dBydx*vx + dBydy*vy + dBydz*vz;
+	long double dBdt_z = dBzdx*vx + dBzdy*vy + dBzdz*vz;
+	long double dBdt = sqrt(dBdt_x*dBdt_x + dBdt_y*dBdt_y + dBdt_z*dBdt_z);
+
+	if (Bws != 0 && gamma != 0) return dBdt/std::abs(gamma)/Bws/Bws;
+	else return 1e31;
+}
+
+
+/**
+ * Calculate adiabaticity parameter of gyration of a charged particle, p*|grad B|/q/B^2 (should be <<1 for guiding-centre approximation)
+ *
+ * This is the relative change of the magnetic field over the distance the particle travels during 1/(2 pi) of a gyration,
+ * using the Frobenius norm of the field gradient, so it includes changes in field magnitude and direction (field-line curvature).
+ *
+ * @param dBxdx Derivative of x component with respect to x
+ * @param dBxdy Derivative of x component with respect to y
+ * @param dBxdz Derivative of x component with respect to z
+ * @param dBydx Derivative of y component with respect to x
+ * @param dBydy Derivative of y component with respect to y
+ * @param dBydz Derivative of y component with respect to z
+ * @param dBzdx Derivative of z component with respect to x
+ * @param dBzdy Derivative of z component with respect to y
+ * @param dBzdz Derivative of z component with respect to z
+ * @param Bws Absolute magnetic field
+ * @param px Momentum of particle in x direction
+ * @param py Momentum of particle in y direction
+ * @param pz Momentum of particle in z direction
+ * @param q Charge of particle
+ *
+ * @return Returns adiabaticity parameter p*|grad B|/q/B^2
+ */
+inline long double gyroadiabaticity(long double dBxdx, long double dBxdy, long double dBxdz, long double dBydx, long double dBydy, long double dBydz, long double dBzdx, long double dBzdy, long double dBzdz, long double Bws, long double px, long double py, long double pz, long double q){
+	long double dB = sqrt(dBxdx*dBxdx + dBxdy*dBxdy + dBxdz*dBxdz + dBydx*dBydx + dBydy*dBydy + dBydz*dBydz + dBzdx*dBzdx + dBzdy*dBzdy + dBzdz*dBzdz);
+	long double p = sqrt(px*px + py*py + pz*pz);
+
+	if (Bws != 0 && q != 0) return p*dB/std::abs(q)/Bws/Bws;
+	else return 1e31;
+}
+
+#endif // ADIABACITY_H_
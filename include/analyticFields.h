@@ -71,6 +71,16 @@ public:
 	 **/
 	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override {};
 
+	/**
+	 * Return bounding box of region where the field is "on"
+	 *
+	 * @param lower Returns lower corner of bounding box
+	 * @param upper Returns upper corner of bounding box
+	 *
+	 * @return Returns true
+	 **/
+	bool Bounds(double lower[3], double upper[3]) const override;
+
 private:
 	int withinBounds(const double x, const double y, const double z) const;
 
@@ -131,6 +141,16 @@ public:
 	 **/
 	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override {};
 
+	/**
+	 * Return bounding box of region where the field is "on"
+	 *
+	 * @param lower Returns lower corner of bounding box
+	 * @param upper Returns upper corner of bounding box
+	 *
+	 * @return Returns true
+	 **/
+	bool Bounds(double lower[3], double upper[3]) const override;
+
 private:
 	int withinBounds(const double x, const double y, const double z) const;
 
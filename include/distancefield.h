@@ -0,0 +1,98 @@
+/**
+ * \file
+ * Precomputed distance field used to skip collision tests far away from any surface.
+ */
+
+#ifndef DISTANCEFIELD_H_
+#define DISTANCEFIELD_H_
+
+#include <cstdint>
+#include <functional>
+
+#include <boost/filesystem.hpp>
+
+#include "voxelgrid.h"
+
+/**
+ * Coarse voxel grid storing the distance from each voxel center to the closest surface.
+ *
+ * The distance is rounded down when it is stored, so each voxel center is surrounded by a ball that is guaranteed to contain no surface.
+ * A line segment with both end points inside this ball cannot intersect any surface.
+ */
+class TDistanceField{
+private:
+	TVoxelGrid<float> grid; ///< distance of voxel center to closest surface [m]
+
+	/**
+	 * Calculate distances for all voxels, distributing the grid slices over several threads
+	 *
+	 * @param distance Function returning the distance of a point to the closest surface, has to be safe to call from several threads
+	 */
+	void Build(const std::function<double(const double p[3])> &distance);
+
+	/**
+	 * Read grid from cache file, if it was built for identical meshes and voxel size
+	 *
+	 * @param filename Cache file
+	 * @param fingerprint Fingerprint of geometry
+	 *
+	 * @return Returns true if grid was successfully read
+	 */
+	bool Read(const boost::filesystem::path &filename, const uint64_t fingerprint);
+
+	/**
+	 * Write grid to cache file.
+	 *
+	 * The file is written under a temporary name first and then renamed, so jobs running in parallel never read incomplete cache files.
+	 *
+	 * @param filename Cache file
+	 * @param fingerprint Fingerprint of geometry
+	 */
+	void Write(const boost::filesystem::path &filename, const uint64_t fingerprint) const;
+
+public:
+	/**
+	 * Create empty distance field, segments will never be considered free
+	 */
+	TDistanceField(){ };
+
+	/**
+	 * Create distance field covering the bounding box of the geometry
+	 *
+	 * @param lower Lower corner of bounding box
+	 * @param upper Upper corner of bounding box
+	 * @param voxelsize Edge length of voxels [m]
+	 * @param distance Function returning the distance of a point to the closest surface, has to be safe to call from several threads
+	 * @param fingerprint Hash value identifying the geometry, see TTriangleMesh::Fingerprint
+	 * @param cachefile If not empty, load distance field from this file, or build it and write it to this file if it does not match the geometry
+	 */
+	TDistanceField(const double lower[3], const double upper[3], const double voxelsize, const std::function<double(const double p[3])> &distance,
+					const uint64_t fingerprint, const boost::filesystem::path &cachefile);
+
+	/**
+	 * Check if distance field was built
+	 */
+	bool empty() const{ return grid.empty(); };
+
+	/**
+	 * Check if line segment lies completely in the free ball around the center of the voxel containing its start point
+	 *
+	 * @param p1 Start point of segment
+	 * @param p2 End point of segment
+	 *
+	 * @return Returns true if segment cannot intersect any surface
+	 */
+	bool IsFree(const double p1[3], const double p2[3]) const{
+		size_t i;
+		if (!grid.Index(p1, i))
+			return false;
+		double r2 = grid[i];
+		r2 *= r2;
+		double c[3];
+		grid.Center(i, c);
+		return	(p1[0] - c[0])*(p1[0] - c[0]) + (p1[1] - c[1])*(p1[1] - c[1]) + (p1[2] - c[2])*(p1[2] - c[2]) < r2 &&
+				(p2[0] - c[0])*(p2[0] - c[0]) + (p2[1] - c[1])*(p2[1] - c[1]) + (p2[2] - c[2])*(p2[2] - c[2]) < r2;
+	};
+};
+
+#endif // DISTANCEFIELD_H_
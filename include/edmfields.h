@@ -85,6 +85,16 @@ public:
 	 * @param Ei Electric field components
 	 **/
 	void EField(const double x, const double y, const double z, const double t, double &V, double Ei[3]) const override {};
+
+	/**
+	 * Return bounding box of region where the field permeates
+	 *
+	 * @param lower Returns lower corner of bounding box
+	 * @param upper Returns upper corner of bounding box
+	 *
+	 * @return Returns false if BoundaryWidth is zero, since the field is not limited then
+	 **/
+	bool Bounds(double lower[3], double upper[3]) const override;
 	
 private:
 	/**
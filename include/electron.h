@@ -52,7 +52,7 @@ protected:
 	 * For parameter doc see TParticle::OnHit
 	 */
 	void OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
-			const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
+			const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const;
 
 
 	/**
@@ -62,7 +62,7 @@ protected:
 	 * For parameter doc see TParticle::OnStep
 	 */
 	void OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
-			const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
+			const solid &currentsolid, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const;
 
 
 	/**
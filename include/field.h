@@ -76,6 +76,19 @@ public:
 	virtual void EField (const double x, const double y, const double z, const double t,
             double &V, double Ei[3]) const = 0;
 
+	/**
+	 * Return bounding box of region in which the field is not zero.
+	 *
+	 * Field calculation methods that are limited to a finite region should override this,
+	 * so particles can be propagated analytically outside of it.
+	 *
+	 * @param lower Returns lower corner of bounding box
+	 * @param upper Returns upper corner of bounding box
+	 *
+	 * @return Returns false if field is unbounded
+	 */
+	virtual bool Bounds(double lower[3], double upper[3]) const{ return false; };
+
 	/**
 	 * Generic constructor, should be called by every derived class.
 	 *
@@ -108,6 +108,16 @@ class TabField: public TField{
 		 */
 		void EField(const double x, const double y, const double z, const double t,
 				double &V, double Ei[3]) const override;
+
+		/**
+		 * Return bounding box of tabulated region
+		 *
+		 * @param lower Returns lower corner of bounding box
+		 * @param upper Returns upper corner of bounding box
+		 *
+		 * @return Returns true
+		 */
+		bool Bounds(double lower[3], double upper[3]) const override;
 };
 
 std::unique_ptr<TabField> ReadOperaField2(const std::string &params);
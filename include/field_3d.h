@@ -155,6 +155,16 @@ private:
 		 */
 		void EField(const double x, const double y, const double z, const double t,
 				double &V, double Ei[3]) const override;
+
+		/**
+		 * Return bounding box of tabulated region, including boundary in which field is smoothly reduced to 0
+		 *
+		 * @param lower Returns lower corner of bounding box
+		 * @param upper Returns upper corner of bounding box
+		 *
+		 * @return Returns true
+		 */
+		bool Bounds(double lower[3], double upper[3]) const override;
 };
 
 /**
@@ -7,17 +7,61 @@
 #define FIELDS_H_
 
 #include <vector>
+#include <array>
 
 #include "field.h"
 #include "config.h"
 #include "globals.h"
 
+static const unsigned FIELD_CACHE_SIZE = 16; ///< number of evaluation points remembered by a TFieldCache, has to cover the stages of an integration step plus one rejected step
+
+/**
+ * Remembers the fields at the most recently evaluated points.
+ *
+ * The integrator, the energy bookkeeping, and the spin tracking all evaluate the fields at the end points of each step.
+ * Passing the same cache to all of them makes sure that each point is only evaluated once.
+ * Points are only recognized if position and time are bit-identical.
+ * If the gradient was calculated at a point, the cached field may differ in the last digit from an evaluation without gradient, since some maps use different interpolation routines.
+ * A cache must only be used together with a single TFieldManager.
+ */
+class TFieldCache{
+	friend struct TFieldManager;
+private:
+	struct TCachedFields{
+		double x, y, z, t; ///< evaluation point
+		double B[3]; ///< magnetic field
+		double dBidxj[3][3]; ///< spatial derivatives of magnetic field
+		double V; ///< electric potential
+		double E[3]; ///< electric field
+		bool Bvalid; ///< true if B has been calculated
+		bool dBvalid; ///< true if dBidxj has been calculated
+		bool Evalid; ///< true if V and E have been calculated
+	};
+	std::array<TCachedFields, FIELD_CACHE_SIZE> entries; ///< ring buffer of evaluation points
+	unsigned next; ///< entry that will be overwritten by the next new evaluation point
+
+	/**
+	 * Find entry for evaluation point, or overwrite the oldest entry with an empty one for this point
+	 */
+	TCachedFields& Lookup(const double x, const double y, const double z, const double t);
+public:
+	/**
+	 * Create empty cache
+	 */
+	TFieldCache(): next(0){
+		for (auto &e: entries)
+			e.Bvalid = e.dBvalid = e.Evalid = false;
+	};
+};
+
 /**
  * Contains list of all fields (2D/3D-maps, conductors, ...).
  */
 struct TFieldManager{
 private:
     std::vector<std::unique_ptr<TField> > fields; ///< list of fields
+	std::vector<std::array<double, 6> > bounds; ///< lower and upper corners of the bounding boxes of all fields
+	bool bounded; ///< false if any field is unbounded
 		
 public:
 	TFieldManager(const TFieldManager &f) = delete; ///< TFieldManager is not copyable
@@ -42,8 +86,9 @@ public:
 	 * @param t Time
 	 * @param B Returns magnetic x, y, and z components of magnetic field
 	 * @param dBidxj Returns spatial derivatives of each magnetic-field component (optional)
+	 * @param cache Return fields stored in this cache if point has been evaluated before, store them otherwise (optional)
 	 */
-	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3] = nullptr) const;
+	void BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3] = nullptr, TFieldCache *cache = nullptr) const;
 
 
 	/**
@@ -57,10 +102,36 @@ public:
 	 * @param t Time
 	 * @param V Return electric potential (!=0 only if a map with potential was loaded)
 	 * @param Ei Returns electric field vector
-	 * @param dEidxj Returns spatial derivatives of electric field components (optional)
+	 * @param cache Return fields stored in this cache if point has been evaluated before, store them otherwise (optional)
 	 */
 	void EField(const double x, const double y, const double z, const double t,
-			double &V, double Ei[3]) const;
+			double &V, double Ei[3], TFieldCache *cache = nullptr) const;
+
+	/**
+	 * Calculate magnetic and electric fields at several points at once.
+	 *
+	 * Loops over the fields in the outer loop, so the data of each field is only loaded once for all points.
+	 *
+	 * @param n Number of points
+	 * @param p Position and time (x, y, z, t) of each point
+	 * @param B Returns magnetic field at each point
+	 * @param dBidxj Returns spatial derivatives of magnetic field at each point
+	 * @param V Returns electric potential at each point, electric fields are only calculated if V and Ei are not null
+	 * @param Ei Returns electric field at each point
+	 * @param caches Store fields of each point in this cache, if not null (optional)
+	 */
+	void Fields(const unsigned n, const double p[][4], double B[][3], double dBidxj[][3][3], double V[], double Ei[][3], TFieldCache *const caches[] = nullptr) const;
+
+
+	/**
+	 * Check if a box is free of any field, using the bounding boxes of all fields, see TField::Bounds
+	 *
+	 * @param lower Lower corner of box
+	 * @param upper Upper corner of box
+	 *
+	 * @return Returns true if no field reaches into the box, always false if any field is unbounded
+	 */
+	bool FieldFree(const double lower[3], const double upper[3]) const;
 };
 
 #endif // FIELDS_H_
@@ -9,8 +9,12 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <algorithm>
 
 #include "trianglemesh.h"
+#include "primitives.h"
+#include "distancefield.h"
 #include "config.h"
 
 #include <boost/format.hpp>
@@ -51,7 +55,7 @@ struct solid{
 	 *
 	 * @return Returns true if this solid's ID is larger than the other one's
 	 */
-	bool operator< (const solid s) const { return ID > s.ID; };
+	bool operator< (const solid &s) const { return ID > s.ID; };
 
 	bool is_ignored(const double t) const{
 	    return std::any_of(ignoretimes.begin(), ignoretimes.end(),
@@ -66,6 +70,26 @@ std::istream& operator>>(std::istream &str, solid &model);
 std::ostream& operator<<(std::ostream &str, const solid &sld);
 
 
+/**
+ * Collisions of a trajectory segment with all surfaces, filled by TGeometry::GetCollisions.
+ *
+ * Collisions are sorted along the segment and paired with a flag indicating if they should be ignored.
+ * The list keeps its memory when it is refilled, so a particle can use the same list for all its collision tests without allocating memory.
+ */
+class TCollisionList{
+	friend struct TGeometry;
+private:
+	std::vector<TCollision> found; ///< collisions returned by mesh and primitives
+	std::vector<std::pair<TCollision, bool> > colls; ///< sorted collisions, paired with bool indicator if it should be ignored
+public:
+	typedef std::vector<std::pair<TCollision, bool> >::const_iterator const_iterator; ///< iterator over collisions
+
+	const_iterator begin() const{ return colls.begin(); }; ///< first collision along segment
+	const_iterator end() const{ return colls.end(); }; ///< end of collision list
+	bool empty() const{ return colls.empty(); }; ///< true if segment did not collide with any surface
+};
+
+
 /**
  * Class to include experiment geometry.
  *
@@ -74,6 +98,21 @@ std::ostream& operator<<(std::ostream &str, const solid &sld);
 struct TGeometry{
 	private:
 		std::vector<solid> solids; ///< solids list
+		std::vector<const solid*> solidsbyID; ///< pointers to solids indexed by their ID, nullptr for unused IDs
+		std::vector<std::unique_ptr<TPrimitive> > primitives; ///< analytic solids defined in geometry configuration instead of STL files
+		TDistanceField distancefield; ///< optional distance field used to skip collision tests far from any surface
+		std::vector<double> windowstarts; ///< sorted start and end times of all ignore times, the set of ignored solids is constant between two consecutive entries
+		std::vector<std::vector<bool> > ignoredsolids; ///< for each time window, flags indexed by solid ID marking solids ignored during this window, empty if no solid is ignored
+
+		/**
+		 * Test if point is inside a single solid
+		 *
+		 * @param p Point
+		 * @param ID ID of solid
+		 *
+		 * @return Returns true if point is inside the mesh or primitive with this ID
+		 */
+		bool InSolid(const double p[3], const unsigned ID) const;
 	public:
 		TTriangleMesh mesh; ///< kd-tree structure containing triangle meshes from STL-files
 		solid defaultsolid; ///< "vacuum", this solid's properties are used when the particle is not inside any other solid
@@ -85,35 +124,106 @@ struct TGeometry{
 		 */
 		TGeometry(TConfig &geometryin);
 
+		TGeometry(const TGeometry &g) = delete; ///< TGeometry is not copyable, particles keep pointers to its solids
+		TGeometry& operator=(const TGeometry &g) = delete; ///< TGeometry is not copyable, particles keep pointers to its solids
+
 
 		/**
 		 * Check if segment is intersecting with geometry bounding box.
 		 *
+		 * The bounding box encloses all meshes and bounded primitives, unbounded primitives (planes) are not included.
+		 *
 		 * @param y1 Position vector of segment start
 		 * @param y2 Position vector of segment end
 		 *
 		 * @return Returns true if segment is intersecting bounding box
 		 */
 		bool CheckSegment(const double y1[3], const double y2[3]) const{
-			return mesh.InBoundingBox(CSegment(CPoint(y1[0], y1[1], y1[2]), CPoint(y2[0], y2[1], y2[2])));
+			return mesh.InBoundingBox(CSegment(CPoint(y1[0], y1[1], y1[2]), CPoint(y2[0], y2[1], y2[2]))) ||
+					std::any_of(primitives.begin(), primitives.end(), [y1, y2](const std::unique_ptr<TPrimitive> &p){ return p->InBoundingBox(y1, y2); });
+		};
+
+
+		/**
+		 * Check if segment is far enough from all surfaces that it cannot collide with any of them.
+		 *
+		 * Always returns false if no distance field was built.
+		 *
+		 * @param y1 Position vector of segment start
+		 * @param y2 Position vector of segment end
+		 *
+		 * @return Returns true if segment is guaranteed not to intersect any surface
+		 */
+		bool InFreeSpace(const double y1[3], const double y2[3]) const{
+			return !distancefield.empty() && distancefield.IsFree(y1, y2);
 		};
-		
+
+
+		/**
+		 * Return index of time window containing time t.
+		 *
+		 * Window 0 ends at the earliest ignore time, window i starts at windowstarts[i-1].
+		 *
+		 * @param t Time
+		 *
+		 * @return Returns index of time window
+		 */
+		unsigned GetTimeWindow(const double t) const{
+			return std::upper_bound(windowstarts.begin(), windowstarts.end(), t) - windowstarts.begin();
+		};
+
+
+		/**
+		 * Check if solid is ignored at time t, using the precomputed time windows
+		 *
+		 * @param sld Solid
+		 * @param t Time
+		 *
+		 * @return Returns true if t lies between any pair of the solid's ignore times
+		 */
+		bool IsIgnored(const solid &sld, const double t) const{
+			const std::vector<bool> &ignored = ignoredsolids[GetTimeWindow(t)];
+			return sld.ID < ignored.size() && ignored[sld.ID];
+		};
+
+
+		/**
+		 * Update list of solids that can be skipped in collision tests for a trajectory step between times t1 and t2.
+		 *
+		 * A solid can be skipped if it is ignored during the whole step and the particle is not inside of it.
+		 * Collisions with such a solid would not change the particle's trajectory, only its list of current solids.
+		 * Hence, solids which were skipped in the previous step but have to be tested in this step
+		 * are added to the list of current solids as ignored, if the particle is inside of them.
+		 *
+		 * @param t1 Start time of step
+		 * @param t2 End time of step
+		 * @param p Position of particle at start of step
+		 * @param currentsolids List of solids the particle is inside of, paired with information if they were ignored when the particle entered them
+		 * @param inactive Flags indexed by solid ID marking solids skipped in the previous step, replaced by flags for this step. Empty if no solid is skipped.
+		 * @param newinactive Scratch list used to build the new flags, swapped with inactive, so repeated calls do not allocate memory
+		 */
+		void UpdateInactiveSolids(const double t1, const double t2, const double p[3], std::vector<std::pair<const solid*, bool> > &currentsolids, std::vector<bool> &inactive,
+								std::vector<bool> &newinactive) const;
+
 
 		/**
 		 * Checks if line segment p1->p2 collides with a surface.
 		 *
-		 * Calls KDTree::Collision to check for collisions and removes all collisions
+		 * Calls TTriangleMesh::Collision and TPrimitive::Collisions to check for collisions and marks all collisions
 		 * which should be ignored (given by ignore times in geometry configuration file).
 		 *
 		 * @param x1 Start time of line segment
 		 * @param p1 Start point of line segment
 		 * @param x2 End time of line segment
 		 * @param p2 End point of line segment
-		 * @param colls List of collisions, paired with bool indicator it it should be ignored
+		 * @param colls Returns list of collisions, paired with bool indicator it it should be ignored
+		 * @param cache Optional triangle cache of the particle, see TTriangleMesh::Collision
+		 * @param inactive Optional flags indexed by solid ID marking solids that are not tested, see UpdateInactiveSolids
 		 *
 		 * @return Returns true if line segment collides with a surface
 		 */
-		bool GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], std::multimap<TCollision, bool> &colls) const;
+		bool GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], TCollisionList &colls,
+							TTriangleCache *cache = nullptr, const std::vector<bool> *inactive = nullptr) const;
 		
 			
 		/**
@@ -122,9 +232,9 @@ struct TGeometry{
 		 * @param t Time
 		 * @param p Point to test
 		 *
-		 * @return Map of solids in which the point is inside paired with information if it was ignored or not
+		 * @return List of pointers to solids in which the point is inside paired with information if it was ignored or not
 		 */
-		std::vector<std::pair<solid, bool> > GetSolids(const double t, const double p[3]) const;
+		std::vector<std::pair<const solid*, bool> > GetSolids(const double t, const double p[3]) const;
 
 
 		/**
@@ -135,7 +245,7 @@ struct TGeometry{
 		 *
 		 * @return Returns solid with highest priority, that was not ignored at time t
 		 */
-		solid GetSolid(const double t, const double p[3]) const;
+		const solid& GetSolid(const double t, const double p[3]) const;
 
 
 		/**
@@ -145,7 +255,11 @@ struct TGeometry{
 		 * 
 		 * @return Returns solid with given ID
 		 */
-		 solid GetSolid(const unsigned ID) const;
+		const solid& GetSolid(const unsigned ID) const{
+			if (ID >= solidsbyID.size() || solidsbyID[ID] == nullptr)
+				throw std::runtime_error((boost::format("Could not find solid with ID %s") % ID).str());
+			return *solidsbyID[ID];
+		};
 };
 
 #endif /*GEOMETRY_H_*/
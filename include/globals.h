@@ -18,7 +18,8 @@ enum stopID {	ID_UNKNOWN = 0, ///< standard flag for particles
 				ID_CGAL_ERROR = -6, ///< flag for particles which produced an error during geometry collision checks
 				ID_GEOMETRY_ERROR = -7, ///< flag for particles which produced an error while tracking material boundaries along the trajectory
 				ID_ABSORBED_IN_MATERIAL = 1, ///< flag for particles that were absorbed inside a material
-				ID_ABSORBED_ON_SURFACE = 2 ///< flag for particles that were absorbed on a material surface
+				ID_ABSORBED_ON_SURFACE = 2, ///< flag for particles that were absorbed on a material surface
+				ID_ROULETTE = 3 ///< flag for particles that were stopped by Russian roulette because of their low statistical weight
 };
 
 enum simType {	PARTICLE = 1, ///< set simtype in configuration to this value to simulate particles
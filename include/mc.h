@@ -7,6 +7,8 @@
 #define MC_H_
 
 #include <random>
+#include <vector>
+#include <numeric>
 
 typedef std::mt19937_64 TMCGenerator; ///< typedef to default random-number generator
 
@@ -189,6 +191,79 @@ struct inversetransform_sqrt{
  */
 template<typename T> using sqrt_distribution = inversetransform_sampler<T, inversetransform_sqrt<T> >;
 
+
+/**
+ * Generate random integers i with probability proportional to given weights w_i using Walker's alias method.
+ *
+ * Building the table takes O(n) time, afterwards each number is generated in O(1), independent of the number of weights.
+ * Satisfies the concept RandomNumberDistribution of STL, except that the weights are not accessible after construction.
+ */
+template<typename IntType = int>
+class alias_distribution{
+public:
+	typedef IntType result_type; ///< type returned by operator()
+private:
+	std::vector<double> _prob; ///< probability to return i instead of its alias, if i was chosen uniformly
+	std::vector<result_type> _alias; ///< alternative return value for each i
+public:
+	alias_distribution(){ } ///< empty constructor, always returns 0
+
+	/**
+	 * Construct distribution from range of weights
+	 *
+	 * @param first Iterator pointing to first weight
+	 * @param last Iterator pointing past last weight
+	 */
+	template<class InputIt> alias_distribution(InputIt first, InputIt last){
+		std::vector<double> w(first, last);
+		size_t n = w.size();
+		double sum = std::accumulate(w.begin(), w.end(), 0.);
+		if (n == 0 || !(sum > 0))
+			return;
+		_prob.resize(n);
+		_alias.resize(n);
+		std::vector<size_t> small, large;
+		for (size_t i = 0; i < n; ++i){
+			w[i] *= n/sum; // scale weights such that their mean is 1
+			if (w[i] < 1)
+				small.push_back(i);
+			else
+				large.push_back(i);
+		}
+		while (!small.empty() && !large.empty()){ // fill up each small bin with part of a large bin
+			size_t s = small.back(), l = large.back();
+			small.pop_back();
+			_prob[s] = w[s];
+			_alias[s] = static_cast<result_type>(l);
+			w[l] -= 1 - w[s];
+			if (w[l] < 1){
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		for (size_t i: large){ _prob[i] = 1; _alias[i] = static_cast<result_type>(i); }
+		for (size_t i: small){ _prob[i] = 1; _alias[i] = static_cast<result_type>(i); } // only left over due to rounding errors
+	}
+
+	void reset(){ } ///< distribution has no internal state
+
+	/**
+	 * Return random integer between 0 and n-1 with probability proportional to weights
+	 */
+	template<class Random> result_type operator()(Random &r) const{
+		if (_prob.empty())
+			return 0;
+		std::uniform_int_distribution<size_t> bin(0, _prob.size() - 1);
+		std::uniform_real_distribution<double> unidist(0, 1);
+		size_t i = bin(r);
+		return unidist(r) < _prob[i] ? static_cast<result_type>(i) : _alias[i];
+	}
+	result_type min() const { return 0; } ///< return min random value
+	result_type max() const { return _prob.empty() ? 0 : static_cast<result_type>(_prob.size() - 1); } ///< return max random value
+	bool operator==(const alias_distribution<IntType> &rhs) const { return _prob == rhs._prob && _alias == rhs._alias; } ///< equality operator (compares tables)
+	bool operator!=(const alias_distribution<IntType> &rhs) const { return !(operator==(rhs)); } ///< inequality operator (compares tables)
+};
+
 } // end namespace std
 
 /**
@@ -8,7 +8,11 @@
 #ifndef INCLUDE_MICROROUGHNESS_H_
 #define INCLUDE_MICROROUGHNESS_H_
 
+#include <vector>
+#include <boost/filesystem.hpp>
+
 #include "geometry.h"
+#include "mc.h"
 
 namespace MR{
 	/**
@@ -64,6 +68,189 @@ namespace MR{
 	 * @return Returns maximal value of MicroRoughness model distribution in range (theta = 0..pi/2, phi = 0..2pi)
 	 */
 	double MRDistMax(const bool transmit, const double v[3], const double normal[3], const solid &leaving, const solid &entering);
+
+	/**
+	 * Sample polar and azimuthal angle of the scattered velocity vector from MicroRoughness model distribution.
+	 *
+	 * Uses tabulated distributions if they were enabled with SetTableOptions, else rejection sampling with MRDistMax and MRDist.
+	 *
+	 * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+	 * @param v velocity right before surface hit
+	 * @param normal Normal vector of hit surface
+	 * @param leaving Solid, which the neutron would leave if it were transmitted
+	 * @param entering Solid, which the neutron would enter if it were transmitted
+	 * @param mc Random-number generator
+	 * @param theta Returns polar angle of scattered velocity vector (0 < theta < pi/2)
+	 * @param phi Returns azimuthal angle of scattered velocity vector (0 < phi < 2*pi)
+	 */
+	void MRSample(const bool transmit, const double v[3], const double normal[3], const solid &leaving, const solid &entering, TMCGenerator &mc, double &theta, double &phi);
+
+	/**
+	 * Let MRProb and MRSample use tabulated distributions instead of integrating and maximizing MRDist on every surface hit.
+	 *
+	 * Tables are built for each combination of roughness, correlation length, and potential step when they are needed for the first time.
+	 *
+	 * @param tolerance Relative accuracy of tabulated probabilities and distributions, tables are disabled if zero
+	 * @param cachedir Directory in which tables are stored and from which they are read if they were built before. Tables are not cached if empty.
+	 */
+	void SetTableOptions(const double tolerance, const boost::filesystem::path &cachedir);
+
+	/**
+	 * Tabulated MicroRoughness distribution for one combination of roughness, correlation length, potential step, and reflection or transmission.
+	 *
+	 * MRDist factorizes into a part depending on incident energy and angle, which is cheap to calculate exactly, and the angular kernel |So|^2*F(mu).
+	 * The kernel only depends on the wave number k of the scattered wave (incident wave number ki for reflection, transmitted wave number kt for transmission)
+	 * and on sin(theta_i). Its phi-integral is tabulated on a grid of k and sin(theta_i), together with its cumulative distribution in the outgoing polar angle theta.
+	 * k ranges up to 1/(2b), beyond which the model is not valid.
+	 *
+	 * The total probability is interpolated bilinearly. Theta is sampled by choosing one of the surrounding grid nodes with the interpolation weights
+	 * and inverting its cumulative distribution, which is exact for the piecewise-linear kernel used to integrate it. For a given theta,
+	 * the kernel is a von-Mises distribution in phi, which is sampled exactly.
+	 *
+	 * The grids are refined until the theta-integration and the cumulative distribution interpolated halfway between grid nodes
+	 * are accurate to the requested tolerance, relative to the largest tabulated total probability.
+	 */
+	class TMRTable{
+	private:
+		bool transmit; ///< True if this table describes transmission, false for reflection
+		double b; ///< RMS roughness of surface
+		double w; ///< correlation length of surface roughness
+		double Estep; ///< potential step between entered and left material
+		double kc2; ///< squared critical wave number of potential step, negative if potential decreases
+		double kmin; ///< smallest tabulated wave number of scattered wave
+		double kmax; ///< largest tabulated wave number of scattered wave
+		double ksplit; ///< wave number at which the kernel has a branch point at normal incidence, kmin if there is none
+		bool branch; ///< true if kernel has a branch point at ksplit, grid nodes above ksplit are spaced quadratically then
+		unsigned nk; ///< number of grid intervals in wave number
+		unsigned nsplit; ///< index of grid node at ksplit
+		unsigned ns; ///< number of grid intervals in sin(theta_i)
+		unsigned ntheta; ///< number of grid intervals in outgoing theta
+		std::vector<double> dtheta; ///< spacing of outgoing-theta grid at each node
+		std::vector<double> pdf; ///< phi-integrated kernel at each node and outgoing theta
+		std::vector<double> cdf; ///< integral of pdf from 0 to each outgoing theta
+
+		/**
+		 * Return wave number at node of wave-number grid
+		 *
+		 * @param i Index of node
+		 */
+		double GridPoint(const unsigned i) const;
+
+		/**
+		 * Return largest outgoing theta at which the kernel does not vanish
+		 *
+		 * For transmission into a lower potential, the transmitted wave is evanescent above this angle.
+		 *
+		 * @param k Wave number of scattered wave
+		 */
+		double ThetaMax(const double k) const;
+
+		/**
+		 * Calculate phi-integrated kernel and its cumulative distribution for one incident state.
+		 *
+		 * The theta grid ends at ThetaMax, so the cutoff of the kernel coincides with the last grid point.
+		 * Distributions of neighbouring grid nodes are interpolated in theta/ThetaMax, which keeps the cutoff sharp.
+		 *
+		 * @param k Wave number of scattered wave
+		 * @param sintheta_i Sine of incident angle
+		 * @param h Returns spacing of outgoing-theta grid
+		 * @param f Returns phi-integrated kernel at ntheta + 1 outgoing theta
+		 * @param F Returns cumulative distribution at ntheta + 1 outgoing theta
+		 */
+		void Kernel(const double k, const double sintheta_i, double &h, double f[], double F[]) const;
+
+		/**
+		 * Evaluate cumulative distribution of grid node
+		 *
+		 * @param n Index of node
+		 * @param x Outgoing theta divided by ThetaMax, 0..1
+		 */
+		double CDF(const unsigned n, const double x) const;
+
+		/**
+		 * Fill grid of given size
+		 */
+		void Build(const unsigned ank, const unsigned ans, const unsigned antheta);
+
+		/**
+		 * Estimate relative error of theta-integration by comparing with integration using every other grid point
+		 */
+		double IntegrationError() const;
+
+		/**
+		 * Estimate relative interpolation error by comparing exact cumulative distributions halfway between grid nodes with interpolation
+		 *
+		 * @param errk Returns error halfway between nodes in wave-number direction
+		 * @param errs Returns error halfway between nodes in sin(theta_i) direction
+		 */
+		void InterpolationError(double &errk, double &errs) const;
+
+		/**
+		 * Find grid cell containing incident state
+		 *
+		 * @param k Wave number of scattered wave
+		 * @param sintheta_i Sine of incident angle
+		 * @param nodes Returns indices of the four corners of the cell
+		 * @param weights Returns bilinear interpolation weights of the four corners
+		 */
+		void Cell(const double k, const double sintheta_i, unsigned nodes[4], double weights[4]) const;
+
+		/**
+		 * Read table from cache file, if it was built with identical parameters
+		 *
+		 * @param filename Cache file
+		 * @param tolerance Relative tolerance of table
+		 *
+		 * @return Returns true if table was successfully read
+		 */
+		bool Read(const boost::filesystem::path &filename, const double tolerance);
+
+		/**
+		 * Write table to cache file.
+		 *
+		 * The file is written under a temporary name first and then renamed, so jobs running in parallel never read incomplete tables.
+		 *
+		 * @param filename Cache file
+		 * @param tolerance Relative tolerance of table
+		 */
+		void Write(const boost::filesystem::path &filename, const double tolerance) const;
+
+	public:
+		/**
+		 * Constructor, read table from cache directory or build it
+		 *
+		 * @param atransmit True for transmission, false for reflection
+		 * @param ab RMS roughness of surface
+		 * @param aw Correlation length of surface roughness
+		 * @param aEstep Potential step between entered and left material [eV]
+		 * @param tolerance Relative accuracy of tabulated probability and distributions
+		 * @param cachedir Directory in which table is cached, table is not cached if empty
+		 */
+		TMRTable(const bool atransmit, const double ab, const double aw, const double aEstep, const double tolerance, const boost::filesystem::path &cachedir);
+
+		/**
+		 * Return total scattering probability
+		 *
+		 * @param ki Incident wave number
+		 * @param kt Transmitted wave number, ignored for reflection
+		 * @param costheta_i Cosine of incident angle
+		 *
+		 * @return Returns total probability of reflection/transmission
+		 */
+		double Prob(const double ki, const double kt, const double costheta_i) const;
+
+		/**
+		 * Sample outgoing angles
+		 *
+		 * @param ki Incident wave number
+		 * @param kt Transmitted wave number, ignored for reflection
+		 * @param costheta_i Cosine of incident angle
+		 * @param mc Random-number generator
+		 * @param theta Returns polar angle of scattered velocity vector
+		 * @param phi Returns azimuthal angle of scattered velocity vector
+		 */
+		void Sample(const double ki, const double kt, const double costheta_i, TMCGenerator &mc, double &theta, double &phi) const;
+	};
 };
 
 
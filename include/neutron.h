@@ -81,7 +81,7 @@ protected:
 	 * For parameter doc see TParticle::OnHit
 	 */
 	void OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
-			const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
+			const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const;
 
 
 	/**
@@ -138,13 +138,26 @@ protected:
 	void ReflectLambert(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 			const double normal[3], const solid &leaving, const solid &entering, TMCGenerator &mc) const;
 
+	/**
+	 * Draw velocity cosine-distributed around an axis, restricted to the hemisphere around n.
+	 *
+	 * The truncated distribution is sampled directly with three random numbers, without rejection.
+	 *
+	 * @param axis Axis of cosine distribution (surface normal for Lambert model, specular velocity for modified Lambert model), has to point into hemisphere around n
+	 * @param n Unit vector defining hemisphere into which the velocity points
+	 * @param vabs Absolute value of velocity
+	 * @param mc Random-number generator
+	 * @param v Returns velocity
+	 */
+	void LambertScatter(const double axis[3], const double n[3], const double vabs, TMCGenerator &mc, double v[3]) const;
+
 	/**
 	 * Checks for absorption in solids using Fermi-potential formalism and does some additional calculations for neutrons
 	 *
 	 * For parameter doc see TParticle::OnStep
 	 */
 	void OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
-			const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const;
+			const solid &currentsolid, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const;
 
 
 	/**
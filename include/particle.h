@@ -8,18 +8,22 @@
 
 #include <fstream>
 #include <vector>
+#include <array>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <functional>
 
 #include <boost/numeric/odeint.hpp>
-#include "interpolation.h"
 
 #include "geometry.h"
 #include "mc.h"
 #include "fields.h"
+#include "stepper.h"
+#include "precessionspline.h"
+#include "spinstepper.h"
 
 static const double MAX_TRACK_DEVIATION = 0.001; ///< max deviation of actual trajectory from straight line between start and end points of a step used for geometry-intersection test. If deviation is larger, the step will be split
-static const int STATE_VARIABLES = 9; ///< number of variables in trajectory integration (position, velocity, proper time, polarization, path length)
-static const int SPIN_STATE_VARIABLES = 5; ///< number of variables in spin integration (spin vector, time, total phase)
 
 /**
  * Basic particle class (virtual).
@@ -31,11 +35,11 @@ static const int SPIN_STATE_VARIABLES = 5; ///< number of variables in spin inte
 struct TParticle{
 protected:
 	typedef double value_type; ///< data type used for trajectory integration
-	typedef std::vector<value_type> state_type; ///< type representing current particle state (position, velocity, proper time, and polarization) or spin state (x,y,z component)
-	typedef boost::numeric::odeint::runge_kutta_dopri5<state_type, value_type> stepper_type; ///< basic integration stepper (5th-order Runge-Kutta)
-	typedef boost::numeric::odeint::controlled_runge_kutta<stepper_type> controlled_stepper_type; ///< integration step length controller
-	typedef boost::numeric::odeint::dense_output_runge_kutta<controlled_stepper_type> dense_stepper_type; ///< integration step interpolator
-//	typedef boost::numeric::odeint::bulirsch_stoer_dense_out<state_type, value_type> dense_stepper_type2; ///< alternative stepper type (Bulirsch-Stoer)
+	typedef std::array<value_type, STATE_VARIABLES> state_type; ///< type representing current particle state (position, velocity, proper time, polarization, and path length), fixed size to avoid heap allocations in the integrator
+	typedef std::array<value_type, SPIN_STATE_VARIABLES> spin_state_type; ///< type representing current spin state (spin vector, time, and total phase)
+	typedef TStepper dense_stepper_type; ///< integration stepper with step interpolation, scheme can be chosen per particle type
+	typedef boost::numeric::odeint::runge_kutta_dopri5<spin_state_type, value_type> spin_stepper_type; ///< basic spin integration stepper (5th-order Runge-Kutta)
+	typedef boost::numeric::odeint::dense_output_runge_kutta<boost::numeric::odeint::controlled_runge_kutta<spin_stepper_type> > dense_spin_stepper_type; ///< spin integration step interpolator
 
 	/**
 	 * Enum containing all types of log files.
@@ -51,10 +55,10 @@ protected:
 
 private:
 	std::string name; ///< particle name (has to be initialized in all derived classes!)
-	const long double q; ///< charge [C] (has to be initialized in all derived classes!)
-	const long double m; ///< mass [eV/c^2] (has to be initialized in all derived classes!)
-	const long double mu; ///< magnetic moment [J/T] (has to be initialized in all derived classes!)
-	const long double gamma; ///< gyromagnetic ratio [rad/(s T)] (has to be initialized in all derived classes!)
+	const double q; ///< charge [C] (has to be initialized in all derived classes!)
+	const double m; ///< mass [eV/c^2] (has to be initialized in all derived classes!)
+	const double mu; ///< magnetic moment [J/T] (has to be initialized in all derived classes!)
+	const double gamma; ///< gyromagnetic ratio [rad/(s T)] (has to be initialized in all derived classes!)
 	int particlenumber; ///< particle number
 	stopID ID; ///< particle fate (defined in globals.h)
 	
@@ -62,20 +66,64 @@ private:
 	value_type tend; ///< stop time
 	state_type ystart; ///< state vector before integration (position, velocity, proper time, polarization, and path length)
 	state_type yend; ///< state vector after integration (position, velocity, proper time, polarization, and path length)
-	state_type spinstart; ///< spin vector before integration
-	state_type spinend; ///< spin vector after integration
-	solid solidstart; ///< solid in which the particle started
-	solid solidend; ///< solid in which particle stopped
+	spin_state_type spinstart; ///< spin vector before integration
+	spin_state_type spinend; ///< spin vector after integration
+	const solid *solidstart; ///< solid in which the particle started
+	const solid *solidend; ///< solid in which particle stopped
 
 	double Hmax; ///< max total energy
 	int Nhit; ///< number of material boundary hits
 	int Nspinflip; ///< number of spin flips
 	long double noflipprob; ///< total probability of NO spinflip calculated by spin tracking
+	double Tspin; ///< total time during which the BMT equation was integrated
 	int Nstep; ///< number of integration steps
+	double weight; ///< statistical weight, reduced by absorption probabilities if implicit absorption is enabled
 
 	std::vector<TParticle*> secondaries; ///< list of secondary particles
 
-	std::vector<std::pair<solid, bool> > currentsolids; ///< solids in which particle is currently inside
+	std::vector<std::pair<const solid*, bool> > currentsolids; ///< solids in which particle is currently inside, paired with information if they were ignored when they were entered
+
+	TTriangleCache trianglecache; ///< triangles close to the recent trajectory, speeds up consecutive collision tests
+	mutable TFieldCache fieldcache; ///< fields at the most recent evaluation points, shared by integrator, energy bookkeeping, and spin tracking so each step end point is evaluated only once
+	std::vector<bool> inactivesolids; ///< flags indexed by solid ID marking solids skipped in collision tests during the current step, see TGeometry::UpdateInactiveSolids
+	std::vector<bool> newinactivesolids; ///< scratch list for TGeometry::UpdateInactiveSolids, swapped with inactivesolids on each step so updating the flags does not allocate memory
+	TCollisionList collisions; ///< scratch list for collision tests, reused for all steps so wall hits do not allocate memory
+	std::vector<std::pair<const solid*, bool> > newsolids; ///< scratch list of solids surrounding the particle after a wall hit, swapped with currentsolids in TParticle::DoHit
+
+	/**
+	 * State of a running trajectory integration, kept between the steps so the particle can be advanced step by step (see TParticle::IntegrateBatch)
+	 */
+	struct TIntegration{
+		double tmax; ///< max. absolute time at which integration will be stopped
+		double tau; ///< proper time at which particle decays
+		double maxtraj; ///< max. trajectory length
+		bool implicitabsorption; ///< reduce statistical weight instead of stopping particle on absorption?
+		double rouletteweight; ///< particles whose statistical weight drops below this value play Russian roulette
+		double roulettesurvivalweight; ///< statistical weight of particles that survive Russian roulette
+		value_type x; ///< time at end of last step
+		state_type y; ///< state at end of last step
+		bool resetintegration; ///< true if the trajectory was changed during the last step and the stepper has to be restarted
+		dense_stepper_type *stepper; ///< trajectory stepper
+		bool snapshotlog; ///< should snapshots be logged to file?
+		std::istringstream snapshots; ///< list of snapshot times
+		float nextsnapshot; ///< time of next snapshot
+		bool tracklog; ///< should track be logged to file?
+		double trackloginterval; ///< min. distance between track-log points
+		value_type lastsave; ///< time of last track-log point
+		bool hitlog; ///< should hits be logged to file?
+		bool flipspin; ///< should spin be flipped according to spin-flip probability?
+		bool spininterpolatefields; ///< interpolate precession axis during spin tracking?
+		bool magnus; ///< use TMagnusSpinStepper for spin tracking?
+		TRotatingSpinFrame spinframe; ///< reference frame in which spin is integrated
+		double maxspinadiabaticity; ///< adiabaticity below which spin tracking is switched off
+		bool spinnonadiabatic; ///< true if spin tracking is currently switched on by the adiabaticity criterion
+		double SpinBmax; ///< spin is tracked only in fields below this value
+		std::vector<double> SpinTimes; ///< time intervals during which spin is tracked
+		double spinloginterval; ///< min. time between spin-log points
+		double nextspinlog; ///< time of next spin-log point
+		spin_state_type spin; ///< current spin state
+	};
+	std::unique_ptr<TIntegration> integration; ///< state of running trajectory integration, empty if particle is not being integrated
 
 public:
 	/**
@@ -160,28 +208,28 @@ public:
 	 *
 	 * @return Initial spin vector of particle
 	 */
-	state_type GetInitialSpin() const { return spinstart; };
+	spin_state_type GetInitialSpin() const { return spinstart; };
 
 	/**
 	 * Return final spin vector of particle
 	 *
 	 * @return Final spin vector of particle
 	 */
-	state_type GetFinalSpin() const { return spinend; };
+	spin_state_type GetFinalSpin() const { return spinend; };
 
 	/**
 	 * Return solid in which particle was created
 	 *
 	 * @return Solid in which particle was created
 	 */
-	solid GetInitialSolid() const { return solidstart; };
+	const solid& GetInitialSolid() const { return *solidstart; };
 
 	/**
 	 * Return solid in which particle was stopped
 	 *
 	 * @return Solid in which particle stopped
 	 */
-	solid GetFinalSolid() const { return solidend; };
+	const solid& GetFinalSolid() const { return *solidend; };
 
 	/**
 	 * Return maximal total energy on trajectory of particle
@@ -211,6 +259,13 @@ public:
 	 */
 	double GetNoSpinFlipProbability() const { return noflipprob; };
 
+	/**
+	 * Return time during which spin was tracked by integration of BMT equation
+	 *
+	 * @return Spin-tracking time [s]
+	 */
+	double GetSpinTrackingTime() const { return Tspin; };
+
 	/**
 	 * Return number of steps taken by integrator
 	 *
@@ -218,6 +273,13 @@ public:
 	 */
 	int GetNumberOfSteps() const { return Nstep; };
 
+	/**
+	 * Return statistical weight of particle
+	 *
+	 * @return Statistical weight, 1 unless implicit absorption is enabled
+	 */
+	double GetWeight() const { return weight; };
+
 	/**
 	 * Return vector containing all secondary particles
 	 *
@@ -276,7 +338,7 @@ public:
 	 * @param geometry Experiment geometry
 	 * @param afield TFieldManager containing all electromagnetic fields
 	 */
-	TParticle(const char *aname, const  double qq, const long double mm, const long double mumu, const long double agamma, const int number,
+	TParticle(const char *aname, const double qq, const double mm, const double mumu, const double agamma, const int number,
 			const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
 			TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield);
 
@@ -305,8 +367,67 @@ public:
 	 */
 	void Integrate(double tmax, std::map<std::string, std::string> &particleconf, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
 
+	/**
+	 * Integrate trajectories of many particles in lockstep.
+	 *
+	 * Keeps up to batchsize particles in the lanes of a TBatchStepper, so the equations of motion of all lanes are evaluated together in each stage
+	 * and the fields are calculated for all lanes at once with TFieldManager::Fields.
+	 * Each particle is treated like in TParticle::Integrate; whenever a particle stops, finish is called and its lane is refilled with the next particle.
+	 * Requires the dopri5 stepper without ballistic propagation or guiding-centre approximation.
+	 * Random numbers are drawn in a different order than when integrating the particles one after another, so results are only statistically equivalent.
+	 *
+	 * @param batchsize Number of particles integrated in lockstep
+	 * @param tmax Max. absolute time at which integration will be stopped
+	 * @param conf Option map containing particle specific options
+	 * @param mc Random-number generator
+	 * @param geom Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 * @param next Function returning next particle to integrate, or null if there are no more particles
+	 * @param finish Function called with each particle after its integration has stopped
+	 */
+	static void IntegrateBatch(const unsigned batchsize, const double tmax, TConfig &conf, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field,
+			const std::function<TParticle*()> &next, const std::function<void(TParticle*)> &finish);
+
 private:
 
+	/**
+	 * Set up integration of particle trajectory, reads particle options and initializes stepper
+	 *
+	 * @param tmax Max. absolute time at which integration will be stopped
+	 * @param particleconf Option map containing particle specific options from particle.in
+	 * @param mc Random-number generator
+	 * @param geom Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 * @param stepper Trajectory stepper, has to stay alive until TParticle::StopIntegration is called
+	 */
+	void StartIntegration(double tmax, std::map<std::string, std::string> &particleconf, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field, dense_stepper_type &stepper);
+
+	/**
+	 * Restart stepper if trajectory was changed during the last step, has to be called before each step
+	 */
+	void PrepareStep();
+
+	/**
+	 * Process the step the stepper just took.
+	 *
+	 * Splits step to check for interaction with solids, prints snapshots and track into files, integrates spin, and checks if particle stopped.
+	 *
+	 * @param stepped False if the stepper failed, particle is stopped with ID_ODEINT_ERROR
+	 * @param mc Random-number generator
+	 * @param geom Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 */
+	void FinishStep(const bool stepped, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+
+	/**
+	 * Store final state, print it to end log and let particle decay if it reached its lifetime
+	 *
+	 * @param mc Random-number generator
+	 * @param geom Geometry of the simulation
+	 * @param field TFieldManager containing all electromagnetic fields
+	 */
+	void StopIntegration(TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field);
+
 	/**
 	 * Return first non-ignored solid in TParticle::currentsolids list
 	 */
@@ -318,12 +439,59 @@ private:
 	 *
 	 * Equations of motion (fully relativistic).
 	 * Including gravitation, Lorentz-force and magnetic interaction with magnetic moment.
+	 * Specialized at compile time for particles with or without charge and magnetic moment, so only the required fields are evaluated.
 	 *
+	 * @tparam charged Particle has an electric charge (TParticle::q != 0)
+	 * @tparam magnetic Particle has a magnetic moment (TParticle::mu != 0)
 	 * @param y	State vector (position, velocity, proper time, and polarization)
 	 * @param dydx Returns derivatives of y with respect to x
 	 * @param x Time
+	 * @param field Fields acting on the particle
+	 */
+	template<bool charged, bool magnetic> void derivs(const state_type &y, state_type &dydx, const value_type x, const TFieldManager *field) const;
+
+	typedef void (TParticle::*derivs_type)(const state_type &y, state_type &dydx, const value_type x, const TFieldManager *field) const; ///< pointer to one of the specializations of TParticle::derivs
+
+	/**
+	 * Select specialization of TParticle::derivs matching charge and magnetic moment of this particle
+	 */
+	derivs_type SelectDerivs() const;
+
+	/**
+	 * Magnetic field and all other forces acting on the particle, used by TBorisStepper and TGuidingCentreStepper
+	 *
+	 * @param y State vector (position, velocity, proper time, and polarization)
+	 * @param x Time
+	 * @param field Fields acting on the particle
+	 * @param B Returns magnetic field
+	 * @param dBidxj Returns spatial derivatives of magnetic field components, if not null
+	 * @param F Returns sum of electric, gravitational, and magnetic-moment forces
+	 */
+	void StepperForce(const state_type &y, const value_type x, const TFieldManager *field, double B[3], double dBidxj[3][3], double F[3]) const;
+
+	/**
+	 * Read stepper type and error tolerances from particle options
+	 *
+	 * @param particleconf Option map containing particle specific options from particle.in
+	 * @param type Returns stepper type
+	 * @param abserr Returns absolute error tolerance
+	 * @param relerr Returns relative error tolerance
+	 * @param maxadiabaticity Returns adiabaticity limit of guiding-centre approximation
+	 * @param ballistic Returns true if particle should be propagated analytically in field-free regions
+	 */
+	void StepperOptions(std::map<std::string, std::string> &particleconf, std::string &type, double &abserr, double &relerr, double &maxadiabaticity, bool &ballistic) const;
+
+	/**
+	 * Create trajectory stepper
+	 *
+	 * Reads stepper type and error tolerances from particle options
+	 *
+	 * @param particleconf Option map containing particle specific options from particle.in
+	 * @param field Fields acting on the particle
+	 *
+	 * @return Returns stepper
 	 */
-	void derivs(const state_type &y, state_type &dydx, const value_type x, const TFieldManager *field) const;
+	std::unique_ptr<dense_stepper_type> CreateStepper(std::map<std::string, std::string> &particleconf, const TFieldManager &field) const;
 
 
 	/**
@@ -341,6 +509,14 @@ private:
 	 */
 	void EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const;
 
+	/**
+	 * Equations of motion, specialized for particles with or without charge and magnetic moment.
+	 *
+	 * @tparam charged If false, Lorentz force is skipped and B and E are not accessed for it
+	 * @tparam magnetic If false, force on magnetic moment is skipped and dBidxj is not accessed
+	 */
+	template<bool charged, bool magnetic> void EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const;
+
 
 	/**
 	 * Check if particle hit a material boundary
@@ -417,6 +593,10 @@ private:
 	 *
 	 * Integrates general BMT equation over one time step.
 	 * If the conditions given by times and Bmax are not fulfilled, the spin vector will simply be rotated along the magnetic field, keeping the spin projection onto the magnetic field constant.
+	 * If maxadiabaticity is larger than zero, the BMT equation is only integrated where the spin motion is non-adiabatic:
+	 * integration is switched on when the adiabaticity parameter (see spinadiabaticity() in adiabacity.h) at the end of a step exceeds maxadiabaticity,
+	 * and switched off when it drops below half of maxadiabaticity. In between, the spin is transported adiabatically along the magnetic field,
+	 * keeping the spin projection onto the field and adding the dynamic precession phase to the transverse component.
 	 *
 	 * @param spin Spin vector, returns new spin vector after step
 	 * @param stepper Trajectory integrator containing last step
@@ -424,15 +604,21 @@ private:
 	 * @param y2 Particle state vector at end of step (position, velocity, proper time, and polarisation)
 	 * @param times Absolute time intervals in between spin integration should be carried out [s]
 	 * @param interpolatefields If this is set to true, the magnetic and electric fields will be interpolated between the trajectory-step points. This will speed up spin tracking in high, static fields, but might break spin tracking in small, quickly varying fields (e.g. spin-flip pulses)
+	 * @param magnus If this is set to true, the spin is integrated with TMagnusSpinStepper instead of a Runge-Kutta stepper
+	 * @param frame Reference frame in which the spin is integrated, spin is stored and logged in lab frame
+	 * @param maxadiabaticity Spin integration will only be carried out, if the adiabaticity parameter exceeds this value (0: always integrate)
+	 * @param nonadiabatic Spin integration state of adiabaticity switch, updated after each step
 	 * @param Bmax Spin integration will only be carried out, if magnetic field is below this value [T]
 	 * @param flipspin If set to true, polarisation in y2 will be randomly set when magnetic field rises above Bmax, weighted by spin projection onto the magnetic field
 	 * @param spinloginterval Min. distance [s] between spin-trajectory prints
 	 * @param nextspinlog Time at which the next spin-trajectory point should be written to file
+	 * @param spintime Duration of step is added to this, if spin was integrated
 	 *
 	 * @return Return probability of spin flip
 	 */
-	double IntegrateSpin(state_type &spin, const dense_stepper_type &stepper, const double x2, state_type &y2, const std::vector<double> &times, const TFieldManager &field,
-						const bool interpolatefields, const double Bmax, TMCGenerator &mc, const bool flipspin, const double spinloginterval, double &nextspinlog) const;
+	double IntegrateSpin(spin_state_type &spin, const dense_stepper_type &stepper, const double x2, state_type &y2, const std::vector<double> &times, const TFieldManager &field,
+						const bool interpolatefields, const bool magnus, const TRotatingSpinFrame &frame,
+						const double maxadiabaticity, bool &nonadiabatic, const double Bmax, TMCGenerator &mc, const bool flipspin, const double spinloginterval, double &nextspinlog, double &spintime) const;
 
 	/**
 	 * Calculate spin precession axis.
@@ -461,19 +647,48 @@ private:
 	 */
 	void SpinPrecessionAxis(const double t, const double B[3], const double E[3], const state_type &dydt, double &Omegax, double &Omegay, double &Omegaz) const;
 
+	/**
+	 * Calculate spin precession axis, either directly or from pre-calculated spline
+	 *
+	 * @param t Time
+	 * @param stepper Trajectory integrator used to calculate position and velocity at time t
+	 * @param field Fields
+	 * @param omega Spline used to interpolate spin-precession axis (if nullptr, precession axis is calculated directly)
+	 * @param Omega Returns precession axis in lab frame
+	 */
+	void SpinPrecessionAxis(const double t, const dense_stepper_type *stepper, const TFieldManager *field, const TPrecessionSpline *omega, double Omega[3]) const;
+
+	/**
+	 * Sample spin precession axis at equidistant points along the last trajectory step and build a spline through them.
+	 *
+	 * The fields at all sample points are calculated with a single call to TFieldManager::Fields.
+	 *
+	 * @param x1 Start of trajectory step
+	 * @param x2 End of trajectory step
+	 * @param stepper Trajectory integrator used to calculate position and velocity between x1 and x2
+	 * @param field Fields
+	 * @param omega Returns spline of precession axis
+	 */
+	void SpinPrecessionSpline(const value_type x1, const value_type x2, const dense_stepper_type &stepper, const TFieldManager &field, TPrecessionSpline &omega) const;
+
 	/**
 	 * Equations of motion of spin vector.
 	 *
-	 * Calculates spin-precession axis either directly or from pre-calculated splines
+	 * Calculates spin-precession axis either directly or from pre-calculated splines.
+	 * Spin vector and derivative are given in the reference frame, total phase is always integrated in lab frame.
 	 *
 	 * @param y Current spin vector
 	 * @param dydx Calculated time derivative of spin vector
 	 * @param x Current time
 	 * @param stepper Trajectory integrator used to calculate spin-precession axis
-	 * @param omega Vector of three splines used to interpolate spin-precession axis (can be empty)
+	 * @param field Fields used to calculate spin-precession axis
+	 * @param omega Spline used to interpolate spin-precession axis (if nullptr, precession axis is calculated directly)
+	 * @param frame Reference frame in which spin is integrated
+	 *
+	 * All arguments are passed as pointers, so binding them into the functor handed to the spin integrator copies nothing else.
 	 */
-	void SpinDerivs(const state_type &y, state_type &dydx, const value_type x,
-			const dense_stepper_type &stepper, const TFieldManager *field, const std::vector<alglib::spline1dinterpolant> &omega_int) const;
+	void SpinDerivs(const spin_state_type &y, spin_state_type &dydx, const value_type x,
+			const dense_stepper_type *stepper, const TFieldManager *field, const TPrecessionSpline *omega, const TRotatingSpinFrame *frame) const;
 
 protected:
 	/**
@@ -502,11 +717,12 @@ protected:
 	 * @param entering Solid that the particle is entering
 	 * @param mc Random-number generator
 	 * @param ID If particle is stopped, set this to the appropriate stopID
+	 * @param weight Statistical weight of particle, multiply it by the survival probability instead of stopping the particle on absorption. Null if absorption should be decided randomly
 	 * @param secondaries Add any secondary particles produced in this interaction
 	 */
 	virtual void OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 						const double normal[3], const solid &leaving, const solid &entering,
-						TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const = 0;
+						TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const = 0;
 
 
 	/**
@@ -523,10 +739,11 @@ protected:
 	 * @param currentsolid Solid through which the particle is moving
 	 * @param mc Random-number generator
 	 * @param ID If particle is stopped, set this to the appropriate stopID
+	 * @param weight Statistical weight of particle, multiply it by the survival probability instead of stopping the particle on absorption. Null if absorption should be decided randomly
 	 * @param secondaries Add any secondary particles produced in this interaction
 	 */
 	virtual void OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
-			const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const = 0;
+			const solid &currentsolid, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const = 0;
 
 
 	/**
@@ -566,7 +783,7 @@ protected:
 	 * @param field TFieldManager containing all electromagnetic fields
 	 * @param logType Select either endlog or snapshotlog
 	 */
-	virtual void Print(const value_type x, const state_type &y, const state_type &spin, const TGeometry &geom, const TFieldManager &field, const LogStream logType) const;
+	virtual void Print(const value_type x, const state_type &y, const spin_state_type &spin, const TGeometry &geom, const TFieldManager &field, const LogStream logType) const;
 
 
 	/**
@@ -580,7 +797,7 @@ protected:
 	 * @param sld Solid in which the particle is currently.
 	 * @param field TFieldManager containing all electromagnetic fields
 	 */
-	virtual void PrintTrack(const value_type x, const state_type &y, const state_type &spin, const solid &sld, const TFieldManager &field) const;
+	virtual void PrintTrack(const value_type x, const state_type &y, const spin_state_type &spin, const solid &sld, const TFieldManager &field) const;
 
 
 	/**
@@ -608,8 +825,8 @@ protected:
 	 * @param stepper Trajectory integrator used to calculate spin-precession axis at time t
 	 * @param field TFieldManager containing all electromagnetic fields
 	 */
-	// virtual void PrintSpin(const value_type x, const state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const;
-	virtual void PrintSpin(const value_type x, const state_type &y, const state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const;
+	// virtual void PrintSpin(const value_type x, const spin_state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const;
+	virtual void PrintSpin(const value_type x, const state_type &y, const spin_state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const;
 
 	/**
 	 * Calculate potential energy of particle
@@ -0,0 +1,46 @@
+/**
+ * \file
+ * Interpolation of the spin-precession axis along a trajectory step.
+ */
+
+#ifndef PRECESSIONSPLINE_H_
+#define PRECESSIONSPLINE_H_
+
+#include <array>
+
+static const int PRECESSION_SPLINE_INTERVALS = 10; ///< number of intervals into which a trajectory step is divided to interpolate the spin-precession axis
+
+/**
+ * Cubic spline through the three components of the spin-precession axis, sampled at equidistant points along a trajectory step.
+ *
+ * Uses parabolically terminated end conditions, like alglib::spline1dbuildcubic with default boundary conditions.
+ * All data is stored in fixed-size arrays, so building and evaluating the spline does not allocate memory.
+ */
+class TPrecessionSpline{
+public:
+	static const int NODES = PRECESSION_SPLINE_INTERVALS + 1; ///< number of sample points
+private:
+	double x0; ///< time of first sample point
+	double h; ///< time between sample points
+	std::array<std::array<double, 3>, NODES> omega; ///< sampled precession axis
+	std::array<std::array<double, 3>, NODES> d2omega; ///< second time derivatives of precession axis at sample points
+public:
+	/**
+	 * Build spline
+	 *
+	 * @param x1 Time of first sample point
+	 * @param x2 Time of last sample point
+	 * @param samples Precession axis at NODES equidistant points between x1 and x2
+	 */
+	void Build(const double x1, const double x2, const double samples[NODES][3]);
+
+	/**
+	 * Evaluate spline
+	 *
+	 * @param x Time, should be between first and last sample point
+	 * @param Omega Returns interpolated precession axis
+	 */
+	void Evaluate(const double x, double Omega[3]) const;
+};
+
+#endif // PRECESSIONSPLINE_H_
@@ -0,0 +1,240 @@
+/**
+ * \file
+ * Analytic solids (boxes, cylinders, tubes, cones, spheres, half-spaces) that can be used instead of STL meshes.
+ */
+
+#ifndef PRIMITIVES_H_
+#define PRIMITIVES_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "trianglemesh.h"
+
+/**
+ * Base class of analytic solids.
+ *
+ * Primitives provide exact segment intersections, exact surface normals and exact inside tests.
+ * Surface normals always point out of the solid.
+ */
+class TPrimitive{
+protected:
+	unsigned ID; ///< ID of solid
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aID ID of solid
+	 */
+	TPrimitive(const unsigned aID): ID(aID){ };
+
+	virtual ~TPrimitive(){ };
+
+	/**
+	 * Return ID of solid
+	 */
+	unsigned GetID() const{ return ID; };
+
+	/**
+	 * Test line segment p1->p2 for intersections with the surface
+	 *
+	 * @param p1 Start point of segment
+	 * @param p2 End point of segment
+	 * @param colls Collisions are appended to this list
+	 */
+	virtual void Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const = 0;
+
+	/**
+	 * Test if point is inside the solid
+	 *
+	 * @param p Point
+	 *
+	 * @return Returns true if point is inside the solid
+	 */
+	virtual bool Contains(const double p[3]) const = 0;
+
+	/**
+	 * Return distance of point to the surface
+	 *
+	 * @param p Point
+	 *
+	 * @return Returns distance [m]
+	 */
+	virtual double Distance(const double p[3]) const = 0;
+
+	/**
+	 * Return bounding box of solid
+	 *
+	 * @param lower Returns lower corner of bounding box
+	 * @param upper Returns upper corner of bounding box
+	 *
+	 * @return Returns false if solid is unbounded
+	 */
+	virtual bool Bounds(double lower[3], double upper[3]) const = 0;
+
+	/**
+	 * Check if segment intersects the bounding box of the solid, always false for unbounded solids
+	 *
+	 * Unbounded solids (planes) do not extend the simulation bounds, which are only given by the meshes and bounded primitives.
+	 *
+	 * @param p1 Start point of segment
+	 * @param p2 End point of segment
+	 */
+	bool InBoundingBox(const double p1[3], const double p2[3]) const;
+};
+
+
+/**
+ * Axis-aligned box
+ */
+class TBoxPrimitive: public TPrimitive{
+private:
+	double lower[3]; ///< lower corner
+	double upper[3]; ///< upper corner
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aID ID of solid
+	 * @param alower Lower corner
+	 * @param aupper Upper corner
+	 */
+	TBoxPrimitive(const unsigned aID, const double alower[3], const double aupper[3]);
+
+	void Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const override;
+	bool Contains(const double p[3]) const override;
+	double Distance(const double p[3]) const override;
+	bool Bounds(double alower[3], double aupper[3]) const override;
+};
+
+
+/**
+ * Solid of revolution between two planes perpendicular to its axis, with inner and outer radius changing linearly along the axis.
+ *
+ * Covers cylinders (inner radius zero), tubes (constant inner and outer radius) and cones (inner radius zero, outer radius changing).
+ */
+class TRevolvedPrimitive: public TPrimitive{
+private:
+	double origin[3]; ///< center of first end face
+	double axis[3]; ///< unit vector pointing from first to second end face
+	double length; ///< distance between end faces
+	double rin[2]; ///< inner radius at first and second end face
+	double rout[2]; ///< outer radius at first and second end face
+
+	/**
+	 * Calculate axial and radial coordinate of point
+	 *
+	 * @param p Point
+	 * @param h Returns distance of point from first end face along axis
+	 * @param rho Returns distance of point from axis
+	 */
+	void Cylindrical(const double p[3], double &h, double &rho) const;
+
+	/**
+	 * Append intersections of segment with the lateral surface with radius r0 + (r1 - r0)*h/length
+	 *
+	 * @param p1 Start point of segment
+	 * @param p2 End point of segment
+	 * @param r0 Radius at first end face
+	 * @param r1 Radius at second end face
+	 * @param outer True if surface is the outer surface, else its normal points towards the axis
+	 * @param colls Collisions are appended to this list
+	 */
+	void LateralCollisions(const double p1[3], const double p2[3], const double r0, const double r1, const bool outer, std::vector<TCollision> &colls) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aID ID of solid
+	 * @param p1 Center of first end face
+	 * @param p2 Center of second end face
+	 * @param rin1 Inner radius at first end face
+	 * @param rout1 Outer radius at first end face
+	 * @param rin2 Inner radius at second end face
+	 * @param rout2 Outer radius at second end face
+	 */
+	TRevolvedPrimitive(const unsigned aID, const double p1[3], const double p2[3], const double rin1, const double rout1, const double rin2, const double rout2);
+
+	void Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const override;
+	bool Contains(const double p[3]) const override;
+	double Distance(const double p[3]) const override;
+	bool Bounds(double lower[3], double upper[3]) const override;
+};
+
+
+/**
+ * Sphere
+ */
+class TSpherePrimitive: public TPrimitive{
+private:
+	double center[3]; ///< center of sphere
+	double radius; ///< radius of sphere
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aID ID of solid
+	 * @param acenter Center of sphere
+	 * @param aradius Radius of sphere
+	 */
+	TSpherePrimitive(const unsigned aID, const double acenter[3], const double aradius);
+
+	void Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const override;
+	bool Contains(const double p[3]) const override;
+	double Distance(const double p[3]) const override;
+	bool Bounds(double lower[3], double upper[3]) const override;
+};
+
+
+/**
+ * Half-space behind a plane
+ */
+class TPlanePrimitive: public TPrimitive{
+private:
+	double point[3]; ///< point on plane
+	double normal[3]; ///< unit normal of plane, pointing out of the solid
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aID ID of solid
+	 * @param apoint Point on plane
+	 * @param anormal Normal of plane, pointing out of the solid
+	 */
+	TPlanePrimitive(const unsigned aID, const double apoint[3], const double anormal[3]);
+
+	void Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const override;
+	bool Contains(const double p[3]) const override;
+	double Distance(const double p[3]) const override;
+	bool Bounds(double lower[3], double upper[3]) const override;
+};
+
+
+/**
+ * Check if a solid definition describes a primitive instead of a mesh file, i.e. starts with a primitive type followed by a colon
+ *
+ * @param definition Solid definition from geometry configuration
+ */
+bool IsPrimitive(const std::string &definition);
+
+
+/**
+ * Create primitive from definition in geometry configuration.
+ *
+ * Definitions consist of the primitive type and a comma-separated list of parameters [m]:
+ * box:xmin,ymin,zmin,xmax,ymax,zmax
+ * cylinder:x1,y1,z1,x2,y2,z2,r
+ * tube:x1,y1,z1,x2,y2,z2,rinner,router
+ * cone:x1,y1,z1,x2,y2,z2,r1,r2
+ * sphere:x,y,z,r
+ * plane:x,y,z,nx,ny,nz
+ *
+ * @param definition Primitive definition
+ * @param ID ID of solid
+ *
+ * @return Returns primitive
+ */
+std::unique_ptr<TPrimitive> CreatePrimitive(const std::string &definition, const unsigned ID);
+
+#endif // PRIMITIVES_H_
@@ -85,11 +85,38 @@ public:
  * It keeps a list of STL triangles on which initial coordinates are generated
  */
 class TSurfaceSource: public TParticleSource{
+private:
+	/**
+	 * Triangle of the geometry lying (partially) inside the source volume
+	 */
+	struct TSourceTriangle{
+		CKernel::Triangle_3 triangle; ///< triangle
+		CVector normal; ///< unit normal of triangle
+		bool straddling; ///< true if triangle crosses boundary of source volume, points on it have to be checked with InSourceVolume
+	};
+	std::vector<TSourceTriangle> triangles; ///< triangles on which particles can be created, filled on first call of CreateParticle
+	std::alias_distribution<size_t> triangle_sampler; ///< picks triangle from list weighted by its area
+
+	/**
+	 * Collect triangles of geometry lying inside the source volume and build area-weighted sampler
+	 *
+	 * @param geometry Geometry whose surfaces are sampled
+	 */
+	void FindSourceTriangles(const TGeometry &geometry);
+
 protected:
 	double Enormal; ///< Boost given to particles starting from this surface
 
 	virtual CCuboid GetSourceVolumeBoundingBox() const = 0;
 
+	/**
+	 * Check if triangle might cross the boundary of the source volume.
+	 *
+	 * Triangles that do not cross the boundary are completely inside or outside of the source volume.
+	 * The default implementation conservatively returns true.
+	 */
+	virtual bool TriangleIntersectsBoundary(const CKernel::Triangle_3 &triangle) const{ return true; };
+
 	/**
 	 * Check if point is inside the source volume.
 	 *
@@ -302,6 +329,7 @@ public:
 		boost::filesystem::path STLfile;
 		std::istringstream(sourceconf["STLfile"]) >> STLfile;
 		sourcevol.ReadFile(boost::filesystem::absolute(STLfile, configpath.parent_path()).native(), 0);
+		sourcevol.BuildVolumeSampler();
 	}
 };
 
@@ -321,6 +349,9 @@ private:
 	    return sourcevol.InSolid(p[0], p[1], p[2]);
 	}
 
+	bool TriangleIntersectsBoundary(const CKernel::Triangle_3 &triangle) const final{
+		return sourcevol.Intersects(triangle);
+	}
     CCuboid GetSourceVolumeBoundingBox() const final{
         return sourcevol.GetBoundingBox();
     }
@@ -0,0 +1,266 @@
+/**
+ * \file
+ * Geometric integration scheme and rotating reference frame for spin precession.
+ */
+
+#ifndef SPINSTEPPER_H_
+#define SPINSTEPPER_H_
+
+#include <array>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+static const int SPIN_STATE_VARIABLES = 5; ///< number of variables in spin integration (spin vector, time, total phase)
+
+/**
+ * Calculate cross product a x b
+ */
+inline void CrossProduct(const double a[3], const double b[3], double axb[3]){
+	axb[0] = a[1]*b[2] - a[2]*b[1];
+	axb[1] = a[2]*b[0] - a[0]*b[2];
+	axb[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+/**
+ * Rotate vector around an axis
+ *
+ * @param theta Rotation vector, v is rotated by angle |theta| around theta
+ * @param v Vector, returns rotated vector
+ */
+inline void RotateAroundVector(const double theta[3], double v[3]){
+	double phi = std::sqrt(theta[0]*theta[0] + theta[1]*theta[1] + theta[2]*theta[2]);
+	if (phi == 0)
+		return;
+	double k[3] = {theta[0]/phi, theta[1]/phi, theta[2]/phi}, kxv[3];
+	CrossProduct(k, v, kxv);
+	double kv = k[0]*v[0] + k[1]*v[1] + k[2]*v[2];
+	double cosphi = std::cos(phi), sinphi = std::sin(phi);
+	for (int i = 0; i < 3; ++i)
+		v[i] = v[i]*cosphi + kxv[i]*sinphi + k[i]*kv*(1 - cosphi); // Rodrigues' rotation formula
+}
+
+
+/**
+ * Reference frame rotating with constant angular velocity OmegaRef around the origin, used to integrate spin precession in the interaction picture.
+ *
+ * At time t the frame is rotated by the angle |OmegaRef|*t around OmegaRef with respect to the lab frame.
+ * A spin precessing around the axis Omega in the lab frame precesses around R(t)^-1*Omega - OmegaRef in the rotating frame,
+ * so if OmegaRef is close to the dominant precession axis (e.g. the Larmor precession in B0), the spin integrator only has to resolve
+ * the detuning, RF pulses, and field inhomogeneities.
+ */
+class TRotatingSpinFrame{
+private:
+	double OmegaRef[3]; ///< angular velocity of rotating frame
+	bool rotating; ///< true if OmegaRef is not zero
+
+	/**
+	 * Rotate vector from lab frame into rotating frame (sign = -1) or back (sign = 1) at time t
+	 */
+	void Rotate(const double t, const double sign, double v[3]) const{
+		if (!rotating)
+			return;
+		double theta[3] = {sign*OmegaRef[0]*t, sign*OmegaRef[1]*t, sign*OmegaRef[2]*t};
+		RotateAroundVector(theta, v);
+	};
+public:
+	/**
+	 * Constructor, creates lab frame
+	 */
+	TRotatingSpinFrame(): OmegaRef{0, 0, 0}, rotating(false){ };
+
+	/**
+	 * Constructor
+	 *
+	 * @param frequency Angular frequency of rotating frame [rad/s]
+	 * @param axis Rotation axis of rotating frame, does not have to be normalized
+	 */
+	TRotatingSpinFrame(const double frequency, const double axis[3]){
+		double n = std::sqrt(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+		if (n == 0)
+			throw std::runtime_error("Rotation axis of rotating spin frame has zero length!");
+		for (int i = 0; i < 3; ++i)
+			OmegaRef[i] = frequency*axis[i]/n;
+		rotating = frequency != 0;
+	};
+
+	/**
+	 * Transform spin vector from lab frame into rotating frame
+	 *
+	 * @param t Time
+	 * @param S Spin vector in lab frame, returns spin vector in rotating frame
+	 */
+	void FromLab(const double t, double S[3]) const{ Rotate(t, -1, S); };
+
+	/**
+	 * Transform spin vector from rotating frame into lab frame
+	 *
+	 * @param t Time
+	 * @param S Spin vector in rotating frame, returns spin vector in lab frame
+	 */
+	void ToLab(const double t, double S[3]) const{ Rotate(t, 1, S); };
+
+	bool IsRotating() const{ return rotating; }; ///< false if this is the lab frame
+
+	/**
+	 * Transform spin-precession axis from lab frame into rotating frame
+	 *
+	 * @param t Time
+	 * @param Omega Precession axis in lab frame, returns precession axis in rotating frame
+	 */
+	void PrecessionAxis(const double t, double Omega[3]) const{
+		if (!rotating)
+			return;
+		Rotate(t, -1, Omega);
+		for (int i = 0; i < 3; ++i)
+			Omega[i] -= OmegaRef[i];
+	};
+
+	/**
+	 * Calculate precession frequency in lab frame
+	 *
+	 * @param Omega Precession axis in rotating frame
+	 *
+	 * @return Absolute value of precession axis in lab frame
+	 */
+	double LabFrequency(const double Omega[3]) const{
+		double Omegalab[3] = {Omega[0] + OmegaRef[0], Omega[1] + OmegaRef[1], Omega[2] + OmegaRef[2]}; // rotation does not change length of precession axis
+		return std::sqrt(Omegalab[0]*Omegalab[0] + Omegalab[1]*Omegalab[1] + Omegalab[2]*Omegalab[2]);
+	};
+};
+
+/**
+ * Adaptive fourth-order Magnus integrator for the precession equation dS/dt = Omega(t) x S.
+ *
+ * Each step samples the precession axis at the two Gauss-Legendre points of the step and combines them into the fourth-order Magnus rotation vector
+ * theta = h/2*(Omega1 + Omega2) + sqrt(3)/12*h^2*(Omega2 x Omega1).
+ * The spin is then rotated exactly by the angle |theta| around theta, so its length is conserved to machine precision.
+ * In a constant precession axis the step is exact, the step size is only limited by how fast the precession axis changes, not by the precession frequency.
+ *
+ * The error is estimated by comparing one full step with two half steps, which also covers the truncated higher-order Magnus terms.
+ * Additionally, theta is compared with the fourth-order Magnus rotation vector built from the step's end points and mid point,
+ * h/6*(Omega(0) + 4*Omega(h/2) + Omega(h)) + h^2/12*(Omega(h) x Omega(0)).
+ * Since this samples the end points, steps across sudden changes of the field (e.g. a spin-flip pulse being switched on) are refined, too.
+ */
+class TMagnusSpinStepper{
+public:
+	typedef double value_type; ///< data type used for spin integration
+	typedef std::array<value_type, SPIN_STATE_VARIABLES> state_type; ///< type representing spin state (spin vector, time, and total phase)
+private:
+	value_type tolerance; ///< max. error of spin components per step
+	value_type x; ///< current time
+	value_type dt; ///< proposed size of next step
+	state_type y; ///< current spin state
+	double Omega0[3]; ///< precession axis at current time
+	bool Omega0valid; ///< true if Omega0 has been calculated at current time
+	TRotatingSpinFrame frame; ///< reference frame in which spin is integrated
+
+	/**
+	 * Calculate fourth-order Magnus rotation vector from precession axis at Gauss-Legendre points
+	 *
+	 * @param h Step size
+	 * @param Omega1 Precession axis at first Gauss-Legendre point
+	 * @param Omega2 Precession axis at second Gauss-Legendre point
+	 * @param theta Returns rotation vector
+	 */
+	static void GaussRotation(const value_type h, const double Omega1[3], const double Omega2[3], double theta[3]){
+		static const double c = std::sqrt(3.)/12.;
+		CrossProduct(Omega2, Omega1, theta);
+		for (int i = 0; i < 3; ++i)
+			theta[i] = 0.5*h*(Omega1[i] + Omega2[i]) + c*h*h*theta[i];
+	};
+
+	/**
+	 * Take a single Magnus step without error control
+	 *
+	 * @param axis Function object returning the precession axis at time t, called as axis(t, Omega)
+	 * @param x0 Start time of step
+	 * @param h Step size
+	 * @param y1 Spin state at start of step, returns spin state at end of step
+	 * @param theta Returns rotation vector of step
+	 */
+	template<class Axis> void Step(Axis &axis, const value_type x0, const value_type h, state_type &y1, double theta[3]) const{
+		static const double c = std::sqrt(3.)/6.; // Gauss-Legendre points are at h*(1/2 -+ sqrt(3)/6)
+		double Omega1[3], Omega2[3];
+		axis(x0 + (0.5 - c)*h, Omega1);
+		axis(x0 + (0.5 + c)*h, Omega2);
+		GaussRotation(h, Omega1, Omega2, theta);
+		RotateAroundVector(theta, &y1[0]);
+		y1[3] += h; // time
+		y1[4] += 0.5*h*(frame.LabFrequency(Omega1) + frame.LabFrequency(Omega2)); // total precession phase in lab frame, Gauss-Legendre quadrature of |Omega|
+	};
+
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param atolerance Max. error of spin components per step
+	 * @param aframe Reference frame in which the spin is integrated, axis passed to do_step has to be given in this frame
+	 */
+	TMagnusSpinStepper(const value_type atolerance, const TRotatingSpinFrame &aframe = TRotatingSpinFrame()): tolerance(atolerance), x(0), dt(0), Omega0valid(false), frame(aframe){ y.fill(0); };
+
+	/**
+	 * (Re-)start integration
+	 *
+	 * @param y0 Initial spin state
+	 * @param x0 Initial time
+	 * @param dt0 First trial step size
+	 */
+	void initialize(const state_type &y0, const value_type x0, const value_type dt0){
+		y = y0;
+		x = x0;
+		dt = dt0;
+		Omega0valid = false;
+	};
+
+	/**
+	 * Take one step, step size is adapted to meet the requested tolerance
+	 *
+	 * @param axis Function object returning the precession axis at time t, called as axis(t, Omega)
+	 * @param xmax The step does not go beyond this time
+	 */
+	template<class Axis> void do_step(Axis axis, const value_type xmax){
+		if (!Omega0valid){
+			axis(x, Omega0);
+			Omega0valid = true;
+		}
+		while (true){
+			value_type h = std::min(dt, xmax - x);
+			if (x + 0.5*h == x)
+				throw std::runtime_error("Spin-integration step size underflow!");
+			state_type yfull = y, yhalf = y;
+			double theta[3], thetahalf[3], Omegam[3], Omegae[3], Lobatto[3];
+			Step(axis, x, h, yfull, theta);
+			Step(axis, x, 0.5*h, yhalf, thetahalf);
+			Step(axis, x + 0.5*h, 0.5*h, yhalf, thetahalf);
+
+			axis(x + 0.5*h, Omegam);
+			axis(x + h, Omegae);
+			CrossProduct(Omegae, Omega0, Lobatto);
+			double err = 0, quaderr = 0;
+			for (int i = 0; i < 3; ++i){
+				err = std::max(err, std::abs(yhalf[i] - yfull[i])/15.); // error of two half steps, local error of fourth-order scheme is proportional to h^5
+				Lobatto[i] = h/6*(Omega0[i] + 4*Omegam[i] + Omegae[i]) + h*h/12*Lobatto[i];
+				quaderr += (theta[i] - Lobatto[i])*(theta[i] - Lobatto[i]);
+			}
+			err = std::max(err, std::sqrt(quaderr));
+
+			double factor = err > 0 ? 0.9*std::pow(tolerance/err, 0.2) : 5;
+			if (err <= tolerance){
+				x += h;
+				y = yhalf;
+				std::copy(Omegae, Omegae + 3, Omega0);
+				if (h == dt) // do not adapt step size if step was shortened to end at xmax
+					dt = h*std::min(factor, 5.);
+				return;
+			}
+			dt = h*std::max(factor, 0.2);
+		}
+	};
+
+	const state_type& current_state() const{ return y; }; ///< spin state at end of last step
+	value_type current_time() const{ return x; }; ///< time at end of last step
+	value_type current_time_step() const{ return dt; }; ///< proposed size of next step
+};
+
+#endif // SPINSTEPPER_H_
@@ -0,0 +1,506 @@
+/**
+ * \file
+ * Integration schemes for particle trajectories.
+ */
+
+#ifndef STEPPER_H_
+#define STEPPER_H_
+
+#include <array>
+#include <vector>
+#include <functional>
+#include <memory>
+
+#include <boost/numeric/odeint.hpp>
+
+static const int STATE_VARIABLES = 9; ///< number of variables in trajectory integration (position, velocity, proper time, polarization, path length)
+
+/**
+ * Adaptive trajectory stepper with dense output (virtual).
+ *
+ * Follows the interface of the dense-output steppers in boost::numeric::odeint, so TParticle::Integrate can use different integration schemes.
+ * After each step, the state can be interpolated anywhere between previous_time() and current_time().
+ */
+class TStepper{
+public:
+	typedef double value_type; ///< data type used for trajectory integration
+	typedef std::array<value_type, STATE_VARIABLES> state_type; ///< type representing particle state (position, velocity, proper time, polarization, and path length)
+	typedef std::function<void(const state_type &y, state_type &dydx, const value_type x)> system_type; ///< equations of motion dy/dx = f(x,y)
+	typedef std::function<void(const state_type &y, const value_type x, double B[3], double dBidxj[3][3], double F[3])> force_type; ///< returns magnetic field, its gradient (if dBidxj is not null), and all other forces (electric, gravitational, magnetic-moment) acting on particle in state y at time x
+
+	virtual ~TStepper(){ };
+
+	/**
+	 * (Re-)start integration
+	 *
+	 * @param y Initial state
+	 * @param x Initial time
+	 * @param dt First trial step size
+	 */
+	virtual void initialize(const state_type &y, const value_type x, const value_type dt) = 0;
+
+	/**
+	 * Take one step, step size is adapted to meet the requested accuracy
+	 */
+	virtual void do_step() = 0;
+
+	/**
+	 * Interpolate state within last step
+	 *
+	 * @param x Time between previous_time() and current_time()
+	 * @param y Returns state at time x
+	 */
+	virtual void calc_state(const value_type x, state_type &y) const = 0;
+
+	virtual const state_type& current_state() const = 0; ///< state at end of last step
+	virtual value_type current_time() const = 0; ///< time at end of last step
+	virtual const state_type& previous_state() const = 0; ///< state at beginning of last step
+	virtual value_type previous_time() const = 0; ///< time at beginning of last step
+	virtual value_type current_time_step() const = 0; ///< proposed size of next step
+
+	/**
+	 * Calculate when the trajectory of the last step crosses a plane, if the stepper knows the trajectory analytically
+	 *
+	 * @param p Point on plane
+	 * @param n Normal of plane
+	 * @param x1 Start of time interval to search, within last step
+	 * @param x2 End of time interval to search, within last step
+	 * @param xc Returns time of first crossing between x1 and x2
+	 *
+	 * @return Returns false if the crossing time cannot be calculated analytically or there is no crossing between x1 and x2
+	 */
+	virtual bool crossing_time(const double p[3], const double n[3], const value_type x1, const value_type x2, value_type &xc) const{ return false; };
+};
+
+
+/**
+ * Wrapper for the dense-output steppers of boost::numeric::odeint (runge_kutta_dopri5 and bulirsch_stoer_dense_out)
+ */
+template<class DenseStepper> class TOdeintStepper: public TStepper{
+private:
+	DenseStepper stepper; ///< odeint stepper
+	system_type system; ///< equations of motion
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param astepper Odeint dense-output stepper, already configured with error tolerances
+	 * @param asystem Equations of motion
+	 */
+	TOdeintStepper(const DenseStepper &astepper, const system_type &asystem): stepper(astepper), system(asystem){ };
+
+	void initialize(const state_type &y, const value_type x, const value_type dt) override{ stepper.initialize(y, x, dt); };
+	void do_step() override{ stepper.do_step(std::cref(system)); }; // pass system by reference, odeint would copy it in every step otherwise
+	void calc_state(const value_type x, state_type &y) const override{ stepper.calc_state(x, y); };
+	const state_type& current_state() const override{ return stepper.current_state(); };
+	value_type current_time() const override{ return stepper.current_time(); };
+	const state_type& previous_state() const override{ return stepper.previous_state(); };
+	value_type previous_time() const override{ return stepper.previous_time(); };
+	value_type current_time_step() const override{ return stepper.current_time_step(); };
+};
+
+typedef TOdeintStepper<boost::numeric::odeint::dense_output_runge_kutta<boost::numeric::odeint::controlled_runge_kutta<
+			boost::numeric::odeint::runge_kutta_dopri5<TStepper::state_type, TStepper::value_type> > > > TDopri5Stepper; ///< 5th-order Runge-Kutta with 4th-order dense output
+typedef TOdeintStepper<boost::numeric::odeint::bulirsch_stoer_dense_out<TStepper::state_type, TStepper::value_type> > TBulirschStoerStepper; ///< Bulirsch-Stoer extrapolation with variable order
+
+
+/**
+ * Runge-Kutta-Fehlberg 7(8) stepper.
+ *
+ * Odeint does not provide dense output for this scheme, so states within a step are interpolated with cubic Hermite polynomials.
+ * The interpolation is only third order, but exactly matches state and derivatives at the step end points.
+ */
+class TRK78Stepper: public TStepper{
+private:
+	typedef boost::numeric::odeint::controlled_runge_kutta<boost::numeric::odeint::runge_kutta_fehlberg78<state_type, value_type> > controlled_stepper_type; ///< adaptive RK78 stepper
+	controlled_stepper_type stepper; ///< adaptive RK78 stepper
+	system_type system; ///< equations of motion
+	value_type x0, x1; ///< time at beginning and end of last step
+	state_type y0, y1; ///< state at beginning and end of last step
+	state_type dydx0, dydx1; ///< derivatives at beginning and end of last step
+	value_type dt; ///< proposed size of next step
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param abserr Absolute error tolerance
+	 * @param relerr Relative error tolerance
+	 * @param asystem Equations of motion
+	 */
+	TRK78Stepper(const value_type abserr, const value_type relerr, const system_type &asystem);
+
+	void initialize(const state_type &y, const value_type x, const value_type adt) override;
+	void do_step() override;
+	void calc_state(const value_type x, state_type &y) const override;
+	const state_type& current_state() const override{ return y1; };
+	value_type current_time() const override{ return x1; };
+	const state_type& previous_state() const override{ return y0; };
+	value_type previous_time() const override{ return x0; };
+	value_type current_time_step() const override{ return dt; };
+};
+
+
+/**
+ * Relativistic Boris pusher.
+ *
+ * Drift-kick-drift scheme with one field evaluation per step at the step midpoint.
+ * The magnetic force is applied as an exact rotation of the momentum, so energy is conserved in pure magnetic fields and long-term errors do not accumulate like in Runge-Kutta schemes.
+ * For neutral particles it reduces to the leapfrog (Stoermer-Verlet) scheme.
+ * The scheme is second order and has no error estimate. Instead, the step is limited such that the relative error in the gyration phase is about relerr
+ * and the particle does not travel further than a maximum distance per step.
+ * Within a step, velocities are interpolated by repeating the kicks and rotation of the step for a fraction of the step size,
+ * positions with a cubic Hermite polynomial, and all other variables linearly.
+ */
+class TBorisStepper: public TStepper{
+private:
+	force_type force; ///< fields and forces acting on particle
+	double q; ///< charge [C]
+	double mass; ///< mass [kg]
+	double maxangle; ///< max. gyration angle per step
+	double maxlength; ///< max. distance traveled per step [m]
+	double omega; ///< gyration frequency in last evaluated field
+	double force_mid[3]; ///< non-magnetic force at midpoint of last step
+	double rotation[3]; ///< Boris rotation vector t = q*B*dt/(2*gamma*m) of last step
+	value_type x0, x1; ///< time at beginning and end of last step
+	state_type y0, y1; ///< state at beginning and end of last step
+	value_type dt; ///< proposed size of next step
+
+	/**
+	 * Return max. step size allowed by max. gyration angle and max. step length
+	 */
+	double MaxStep() const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aq Charge of particle [C]
+	 * @param amass Mass of particle [kg]
+	 * @param relerr Relative error in gyration phase per step
+	 * @param amaxlength Max. distance traveled in one step [m]
+	 * @param aforce Fields and forces acting on particle
+	 */
+	TBorisStepper(const double aq, const double amass, const double relerr, const double amaxlength, const force_type &aforce);
+
+	void initialize(const state_type &y, const value_type x, const value_type adt) override;
+	void do_step() override;
+	void calc_state(const value_type x, state_type &y) const override;
+	const state_type& current_state() const override{ return y1; };
+	value_type current_time() const override{ return x1; };
+	const state_type& previous_state() const override{ return y0; };
+	value_type previous_time() const override{ return x0; };
+	value_type current_time_step() const override{ return dt; };
+};
+
+
+/**
+ * Guiding-centre stepper for charged particles in strong magnetic fields.
+ *
+ * Where the magnetic field changes little during one gyration, the gyration is averaged out and only the motion of the guiding centre is integrated:
+ * parallel motion along the field line, mirror force, ExB, grad-B, curvature, and gravitational drifts, with the magnetic moment as adiabatic invariant.
+ * Step sizes are then limited by changes of the field along the path, not by the gyration period.
+ * After each step the adiabaticity parameter (see gyroadiabaticity() in adiabacity.h) is checked. If it exceeds maxadiabaticity,
+ * the particle is placed back on its gyration orbit and integrated with the full equations of motion by the orbit stepper,
+ * until it drops below half that value again.
+ *
+ * In guiding-centre mode states returned by the stepper contain the position of the guiding centre and the particle velocity at the current gyration phase,
+ * path length is counted along the guiding-centre path. States passed to initialize() are interpreted in the same way, if the stepper is in guiding-centre mode.
+ */
+class TGuidingCentreStepper: public TStepper{
+private:
+	static const int GC_STATE_VARIABLES = 7; ///< number of variables in guiding-centre integration (position, parallel momentum per mass, proper time, path length, gyration phase)
+	typedef std::array<value_type, GC_STATE_VARIABLES> gc_state_type; ///< type representing guiding-centre state
+	typedef boost::numeric::odeint::dense_output_runge_kutta<boost::numeric::odeint::controlled_runge_kutta<
+				boost::numeric::odeint::runge_kutta_dopri5<gc_state_type, value_type> > > gc_stepper_type; ///< adaptive guiding-centre stepper
+
+	std::unique_ptr<TStepper> orbitstepper; ///< stepper integrating full equations of motion in non-adiabatic regions
+	gc_stepper_type gcstepper; ///< stepper integrating guiding-centre equations of motion
+	force_type force; ///< fields and forces acting on particle
+	double q; ///< charge [C]
+	double mass; ///< mass [kg]
+	double maxadiabaticity; ///< switch to full equations of motion above this adiabaticity parameter
+	bool gcmode; ///< true if particle is currently integrated in guiding-centre approximation
+	double adiabaticity; ///< adiabaticity parameter at end of last step
+	double moment; ///< adiabatic invariant u_perp^2/2/B, u = gamma*v
+	double polarization; ///< polarization of particle, constant during guiding-centre integration
+	state_type y0, y1; ///< state at beginning and end of last guiding-centre step
+
+	/**
+	 * Calculate adiabaticity parameter at particle state y
+	 *
+	 * @param y Particle state
+	 * @param x Time
+	 *
+	 * @return Returns adiabaticity parameter, infinity if there is no magnetic field
+	 */
+	double Adiabaticity(const state_type &y, const value_type x) const;
+
+	/**
+	 * Calculate vector from guiding centre to particle
+	 *
+	 * @param y Particle state
+	 * @param x Time
+	 * @param rho Returns gyration radius vector
+	 *
+	 * @return Returns gyration frequency
+	 */
+	double GyrationRadius(const state_type &y, const value_type x, double rho[3]) const;
+
+	/**
+	 * Convert particle state into guiding-centre state
+	 *
+	 * @param y Particle state, position has to be the guiding centre already
+	 * @param x Time
+	 * @param g Returns guiding-centre state
+	 */
+	void ToGuidingCentre(const state_type &y, const value_type x, gc_state_type &g);
+
+	/**
+	 * Convert guiding-centre state into particle state
+	 *
+	 * @param g Guiding-centre state
+	 * @param x Time
+	 * @param y Returns particle state with guiding-centre position and particle velocity
+	 */
+	void FromGuidingCentre(const gc_state_type &g, const value_type x, state_type &y) const;
+
+	/**
+	 * Guiding-centre equations of motion
+	 *
+	 * @param g Guiding-centre state
+	 * @param dgdx Returns derivatives of guiding-centre state
+	 * @param x Time
+	 */
+	void GuidingCentreDerivs(const gc_state_type &g, gc_state_type &dgdx, const value_type x) const;
+
+	/**
+	 * Switch integration mode if required by adiabaticity parameter and (re-)start integration with the according stepper
+	 *
+	 * @param y Particle state in representation of current mode
+	 * @param x Time
+	 * @param dt First trial step size
+	 */
+	void Start(state_type y, const value_type x, value_type dt);
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param aq Charge of particle [C]
+	 * @param amass Mass of particle [kg]
+	 * @param abserr Absolute error tolerance of guiding-centre integration
+	 * @param relerr Relative error tolerance of guiding-centre integration
+	 * @param amaxadiabaticity Max. adiabaticity parameter for guiding-centre approximation
+	 * @param aorbitstepper Stepper used in non-adiabatic regions
+	 * @param aforce Fields and forces acting on particle
+	 */
+	TGuidingCentreStepper(const double aq, const double amass, const value_type abserr, const value_type relerr, const double amaxadiabaticity,
+						std::unique_ptr<TStepper> aorbitstepper, const force_type &aforce);
+
+	void initialize(const state_type &y, const value_type x, const value_type adt) override;
+	void do_step() override;
+	void calc_state(const value_type x, state_type &y) const override;
+	const state_type& current_state() const override{ return gcmode ? y1 : orbitstepper->current_state(); };
+	value_type current_time() const override{ return gcmode ? gcstepper.current_time() : orbitstepper->current_time(); };
+	const state_type& previous_state() const override{ return gcmode ? y0 : orbitstepper->previous_state(); };
+	value_type previous_time() const override{ return gcmode ? gcstepper.previous_time() : orbitstepper->previous_time(); };
+	value_type current_time_step() const override{ return gcmode ? gcstepper.current_time_step() : orbitstepper->current_time_step(); };
+};
+
+
+/**
+ * Stepper propagating particles analytically where only gravity acts.
+ *
+ * Before each step, the bounding box of the parabola the particle would follow is checked against the bounding boxes of all fields.
+ * If no field reaches into it, the particle is moved along the exact parabola, without any field evaluations and with exact
+ * crossing times with surfaces, see crossing_time(). Otherwise, the step is taken by the field stepper.
+ * Steps are limited such that the parabola deviates no more than a given distance from a straight line,
+ * so the collision test of TParticle::Integrate does not have to split them.
+ * Relativistic corrections to the gravitational acceleration are neglected, they are of order v^2/c^2.
+ */
+class TBallisticStepper: public TStepper{
+public:
+	typedef std::function<bool(const double lower[3], const double upper[3])> region_type; ///< returns true if no field reaches into box given by lower and upper corner
+private:
+	std::unique_ptr<TStepper> fieldstepper; ///< stepper integrating equations of motion where fields act on particle
+	region_type fieldfree; ///< check if box is free of fields
+	double g[3]; ///< gravitational acceleration
+	double maxstep; ///< max. step size, given by max. deviation of parabola from straight line
+	bool ballistic; ///< true if last step was analytic
+	bool fieldstarted; ///< true if field stepper has been initialized at current state
+	value_type x0, x1; ///< time at beginning and end of last analytic step
+	state_type y0, y1; ///< state at beginning and end of last analytic step
+	value_type dt; ///< proposed size of next step of field stepper
+
+	/**
+	 * Calculate bounding box of parabola
+	 *
+	 * @param y State at start of parabola
+	 * @param h Time along parabola
+	 * @param lower Returns lower corner of bounding box
+	 * @param upper Returns upper corner of bounding box
+	 */
+	void ParabolaBounds(const state_type &y, const value_type h, double lower[3], double upper[3]) const;
+
+	/**
+	 * Propagate state along parabola
+	 *
+	 * @param y Start state
+	 * @param h Time along parabola
+	 * @param yh Returns state after time h
+	 */
+	void Propagate(const state_type &y, const value_type h, state_type &yh) const;
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param gravity Gravitational acceleration
+	 * @param maxdeviation Max. deviation of trajectory from straight line in one step [m]
+	 * @param afieldfree Check if box is free of fields
+	 * @param afieldstepper Stepper used where fields act on particle
+	 */
+	TBallisticStepper(const double gravity[3], const double maxdeviation, const region_type &afieldfree, std::unique_ptr<TStepper> afieldstepper);
+
+	void initialize(const state_type &y, const value_type x, const value_type adt) override;
+	void do_step() override;
+	void calc_state(const value_type x, state_type &y) const override;
+	const state_type& current_state() const override{ return ballistic ? y1 : fieldstepper->current_state(); };
+	value_type current_time() const override{ return ballistic ? x1 : fieldstepper->current_time(); };
+	const state_type& previous_state() const override{ return ballistic ? y0 : fieldstepper->previous_state(); };
+	value_type previous_time() const override{ return ballistic ? x0 : fieldstepper->previous_time(); };
+	value_type current_time_step() const override{ return ballistic ? maxstep : fieldstepper->current_time_step(); };
+	bool crossing_time(const double p[3], const double n[3], const value_type xa, const value_type xb, value_type &xc) const override;
+};
+
+
+/**
+ * Dormand-Prince 5(4) stepper advancing a batch of independent particles in lockstep.
+ *
+ * All lanes of the batch compute their Runge-Kutta stages together, so the equations of motion are evaluated for the whole batch at once
+ * and the data of each field is loaded once per stage for all particles (see TFieldManager::Fields). States and stages are stored in
+ * structure-of-arrays layout, one array per state variable with one entry per lane, so the stage updates vectorize over the batch.
+ *
+ * Each lane has its own adaptive step size, controlled like TDopri5Stepper (error norm and step-size adaptation of odeint's controlled_runge_kutta).
+ * do_step() makes one attempt in every occupied lane, lanes whose attempt was rejected retry with a smaller step in the next call.
+ * The particle in a lane accesses its trajectory through the TStepper returned by lane(), which provides the dense output of the last accepted step.
+ */
+class TBatchStepper{
+public:
+	typedef TStepper::value_type value_type; ///< data type used for trajectory integration
+	typedef TStepper::state_type state_type; ///< type representing state of a single particle
+	typedef std::array<std::vector<value_type>, STATE_VARIABLES> batch_state_type; ///< states of all lanes, one array per state variable
+	typedef std::function<void(const std::vector<unsigned> &lanes, const std::vector<value_type> &x, const batch_state_type &y, batch_state_type &dydx)> batch_system_type; ///< equations of motion, evaluated for all listed lanes at once
+
+	/**
+	 * Status of a lane
+	 */
+	enum lane_status { idle, ///< lane is empty
+					stepping, ///< last step attempt was rejected or lane has not made an attempt yet
+					accepted, ///< last step attempt was accepted
+					failed ///< step-size adaptation failed
+					};
+private:
+	/**
+	 * Access to a single lane of the batch
+	 */
+	class TLane: public TStepper{
+		friend class TBatchStepper;
+	private:
+		TBatchStepper &batch; ///< batch containing this lane
+		unsigned index; ///< index of lane in batch
+		value_type x0, x1; ///< time at beginning and end of last step
+		state_type y0, y1; ///< state at beginning and end of last step
+		std::array<state_type, 6> k; ///< stages 1, 3, 4, 5, 6, and 7 of last step, required for dense output
+	public:
+		/**
+		 * Constructor
+		 *
+		 * @param abatch Batch containing this lane
+		 * @param aindex Index of lane in batch
+		 */
+		TLane(TBatchStepper &abatch, const unsigned aindex): batch(abatch), index(aindex), x0(0), x1(0){ };
+
+		void initialize(const state_type &y, const value_type x, const value_type dt) override;
+		void do_step() override;
+		void calc_state(const value_type x, state_type &y) const override;
+		const state_type& current_state() const override{ return y1; };
+		value_type current_time() const override{ return x1; };
+		const state_type& previous_state() const override{ return y0; };
+		value_type previous_time() const override{ return x0; };
+		value_type current_time_step() const override{ return batch.dt[index]; };
+	};
+
+	batch_system_type system; ///< equations of motion
+	unsigned capacity; ///< number of lanes
+	std::vector<value_type> abserr; ///< absolute error tolerance of each lane
+	std::vector<value_type> relerr; ///< relative error tolerance of each lane
+	std::vector<value_type> x; ///< current time of each lane
+	std::vector<value_type> xtmp; ///< time of current stage
+	std::vector<value_type> dt; ///< size of next step attempt of each lane
+	batch_state_type y; ///< current state of each lane
+	batch_state_type ytmp; ///< state at current stage
+	std::array<batch_state_type, 7> k; ///< derivatives at Runge-Kutta stages, first stage is derivative at current state
+	std::vector<lane_status> status; ///< status of each lane
+	std::vector<char> derivvalid; ///< true if first stage has been calculated at current state
+	std::vector<unsigned> fails; ///< number of consecutive rejected attempts of each lane
+	std::vector<std::unique_ptr<TLane> > lanes; ///< access to single lanes
+	std::vector<unsigned> active; ///< occupied lanes taking part in current step attempt
+	std::vector<unsigned> startlanes; ///< lanes whose first stage is unknown
+
+	/**
+	 * Calculate state at a Runge-Kutta stage for all lanes and evaluate derivatives there
+	 *
+	 * @param s Index of stage (1..6)
+	 * @param c Fraction of step at which stage is evaluated
+	 * @param a Coefficients of previous stages
+	 */
+	void Stage(const int s, const value_type c, const value_type a[6]);
+public:
+	/**
+	 * Constructor
+	 *
+	 * @param acapacity Number of lanes
+	 * @param asystem Equations of motion for a batch of particles
+	 */
+	TBatchStepper(const unsigned acapacity, const batch_system_type &asystem);
+
+	/**
+	 * Return number of lanes
+	 */
+	unsigned size() const{ return capacity; };
+
+	/**
+	 * Return access to lane, the lane is occupied when it is initialized
+	 *
+	 * @param i Index of lane
+	 */
+	TStepper& lane(const unsigned i){ return *lanes[i]; };
+
+	/**
+	 * Set error tolerances of lane, has to be called before the lane is initialized
+	 *
+	 * @param i Index of lane
+	 * @param aabserr Absolute error tolerance
+	 * @param arelerr Relative error tolerance
+	 */
+	void set_tolerances(const unsigned i, const value_type aabserr, const value_type arelerr){ abserr[i] = aabserr; relerr[i] = arelerr; };
+
+	/**
+	 * Return status of lane
+	 *
+	 * @param i Index of lane
+	 */
+	lane_status lanestatus(const unsigned i) const{ return status[i]; };
+
+	/**
+	 * Empty lane, so it no longer takes part in integration
+	 *
+	 * @param i Index of lane
+	 */
+	void release(const unsigned i){ status[i] = idle; };
+
+	/**
+	 * Make one step attempt in all occupied lanes
+	 */
+	void do_step();
+};
+
+#endif // STEPPER_H_
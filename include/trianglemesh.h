@@ -23,8 +23,11 @@
 #define TRIANGLEMESH_H_
 
 #include <vector>
+#include <string>
+#include <ostream>
 #include <memory>
 #include <random>
+#include <cstdint>
 
 #include <algorithm>
 
@@ -36,7 +39,15 @@
 #include <CGAL/Side_of_triangle_mesh.h>
 #include <CGAL/Polygon_mesh_processing/compute_normal.h>
 
+#include "voxelgrid.h"
+#include "mc.h"
+
 static const double REFLECT_TOLERANCE = 1e-8;  ///< max distance of reflection point to actual surface collision point
+static const double TRIANGLE_CACHE_MARGIN = 0.01; ///< min. distance [m] by which the region covered by a TTriangleCache extends beyond the segment that created it
+static const size_t TRIANGLE_CACHE_SIZE = 128; ///< max. number of triangles stored in a TTriangleCache, if the region contains more the AABB tree is used instead
+static const unsigned INSIDE_GRID_RESOLUTION = 64; ///< the grid used to speed up point-in-solid tests contains about INSIDE_GRID_RESOLUTION^3 voxels per mesh
+static const unsigned VOLUME_SAMPLER_LEVELS = 4; ///< maximum number of times cells intersecting the surface are split in TTriangleMesh::BuildVolumeSampler
+static const size_t VOLUME_SAMPLER_MAX_CELLS = 1000000; ///< TTriangleMesh::BuildVolumeSampler does not split cells if a mesh would be covered by more cells
 
 typedef CGAL::Simple_cartesian<double> CKernel; ///< Geometric Kernel used for CGAL types
 typedef CKernel::Segment_3 CSegment; ///< CGAL segment type
@@ -51,6 +62,25 @@ typedef CGAL::AABB_tree<CTraits> CTree; ///< CGAL AABB tree type containing CPri
 typedef boost::optional< CTree::Intersection_and_primitive_id<CSegment>::Type > CIntersection; ///< CGAL segment-triangle intersection type
 
 
+/**
+ * Calculate 64-bit FNV-1a hash of a block of data
+ *
+ * @param data Data
+ * @param size Size of data in bytes
+ * @param hash Hash of preceding data, if hash of several blocks should be calculated
+ *
+ * @return Returns hash value
+ */
+inline uint64_t FNV1a(const void *data, const size_t size, uint64_t hash = 14695981039346656037ULL){
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i){
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
 /**
  * Structure returned by TTriangleMesh::Collision.
  */
@@ -76,6 +106,16 @@ struct TCollision{
       distnormal = segment.to_vector()*n;
     };
 
+	/**
+	 * Create TCollision object from parametric coordinate of intersection point
+	 *
+	 * @param as Parametric coordinate of intersection point
+	 * @param n Normal (length = 1) of intersected surface
+	 * @param d Vector from start to end point of segment
+	 * @param aID ID of solid the intersected surface belongs to
+	 */
+	TCollision(const double as, const double n[3], const double d[3], const unsigned aID): s(as), normal{n[0], n[1], n[2]}, ID(aID), distnormal(d[0]*n[0] + d[1]*n[1] + d[2]*n[2]){ };
+
 	/**
 	 * Overloaded operator, needed for sorting
 	 */
@@ -89,40 +129,153 @@ struct TCollision{
 
 
 
+/**
+ * Local copy of all triangles close to a particle's recent path.
+ *
+ * Consecutive trajectory segments usually lie close to each other,
+ * so they can be tested against this short list instead of traversing the AABB tree from its root.
+ * The list is rebuilt by TTriangleMesh::Collision when a segment leaves the cached region.
+ */
+class TTriangleCache{
+	friend class TTriangleMesh;
+private:
+	struct TCachedTriangle{
+		CKernel::Triangle_3 triangle; ///< triangle
+		CGAL::Bbox_3 bbox; ///< bounding box of triangle
+		CVector normal; ///< normal of triangle
+		unsigned ID; ///< ID of solid the triangle belongs to
+	};
+	CGAL::Bbox_3 region; ///< region covered by cache, all triangles intersecting it are stored in triangles
+	std::vector<TCachedTriangle> triangles; ///< triangles intersecting region
+	bool valid; ///< false if cache has not been filled yet
+	bool overflow; ///< true if region contains more than TRIANGLE_CACHE_SIZE triangles and the AABB tree should be used instead
+	std::vector<CTree::Primitive_id> faces; ///< scratch list of faces found in region of a mesh, kept so refilling the cache does not allocate memory
+public:
+	/**
+	 * Create empty cache
+	 */
+	TTriangleCache(): valid(false), overflow(false){ };
+};
+
+
 /**
  * Class to hold your STL geometry and do intersection tests.
  */
 class TTriangleMesh{
 private:
+    enum VoxelClass : unsigned char { OUTSIDE, INSIDE, BOUNDARY }; ///< classification of voxels in CTriangleMesh::voxels
     struct CTriangleMesh{
         std::unique_ptr<CMesh> mesh;
         std::unique_ptr<CTree> tree;
         int ID;
         std::discrete_distribution<size_t> triangle_sampler;
+        TVoxelGrid<unsigned char> voxels; ///< voxels classified as completely outside, completely inside, or intersecting the mesh
+
+        /**
+         * Check if point is inside the mesh, only voxels intersecting the surface require a ray cast
+         */
+        bool Contains(const double x, const double y, const double z) const{
+            double p[3] = {x, y, z};
+            size_t i;
+            if (!voxels.Index(p, i)) // grid covers the whole bounding box, points outside are outside the mesh
+                return false;
+            if (voxels[i] != BOUNDARY)
+                return voxels[i] == INSIDE;
+            return tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(x,y,z), CVector(0., 0., 1.))) % 2 != 0;
+        }
     };
+
+    /**
+     * Classify voxels covering the mesh's bounding box as completely inside, completely outside, or intersecting the mesh.
+     *
+     * A single ray cast is used for each run of consecutive non-intersecting voxels along the z axis.
+     *
+     * @param tree AABB tree of the mesh
+     *
+     * @return Returns classified voxel grid
+     */
+    static TVoxelGrid<unsigned char> ClassifyVoxels(const CTree &tree);
+
 	std::vector<CTriangleMesh> meshes;
 	std::discrete_distribution<size_t> mesh_sampler;
+	std::alias_distribution<size_t> bbox_sampler; ///< picks mesh weighted by volume of its bounding box
+	/**
+	 * Cubic cell inside or intersecting a mesh, used to sample points in its volume
+	 */
+	struct TVolumeCell{
+		double lower[3]; ///< lower corner of cell
+		double size; ///< edge length of cell
+		unsigned mesh; ///< index of mesh in meshes
+		bool boundary; ///< true if cell intersects surface of mesh
+	};
+	std::vector<TVolumeCell> volume_cells; ///< cells covering the volume of all meshes, see BuildVolumeSampler
+	std::alias_distribution<size_t> volume_sampler; ///< picks entry of volume_cells weighted by its volume
+
+	/**
+	 * Make sure the triangle cache covers the segment, refill it if it does not.
+	 *
+	 * @param segment Segment that should be tested for collisions
+	 * @param cache Triangle cache
+	 *
+	 * @return Returns false if the region around the segment contains too many triangles to be cached
+	 */
+	bool UpdateCache(const CSegment &segment, TTriangleCache &cache) const;
+
+	/**
+	 * Load mesh from file or mesh cache, repair and validate it, see ReadFile.
+	 *
+	 * Does not modify any shared state, so several meshes can be loaded in parallel.
+	 *
+	 * @param filename Filename of STL or OBJ file
+	 * @param ID ID of solid assigned to this file
+	 * @param cachedir Directory of mesh cache
+	 * @param weldtolerance Vertices closer than this distance [m] are merged
+	 * @param sldname Returns name of mesh in file
+	 * @param out Stream to which progress is printed
+	 * @param err Stream to which warnings are printed
+	 *
+	 * @return Returns loaded mesh
+	 */
+	static CTriangleMesh LoadMesh(const std::string &filename, const int ID, const std::string &cachedir, const double weldtolerance,
+	                              std::string &sldname, std::ostream &out, std::ostream &err);
 
 public:
 	/**
-	 * Read STL-file.
+	 * Read binary or ASCII STL file or Wavefront OBJ file.
 	 *
-	 * @param filename Filename of STL file
-	 * @param ID ID of solid assigned to this STL file
+	 * @param filename Filename of STL or OBJ file, OBJ files are identified by their extension
+	 * @param ID ID of solid assigned to this file
+	 * @param cachedir If not empty, the repaired and validated mesh is loaded from this directory if it was cached before, or written to it otherwise.
+	 *                 Cache files are named after the hash of the file's content and the weld tolerance.
+	 * @param weldtolerance Vertices closer than this distance [m] are merged
 	 *
 	 * @return Returns name of mesh in file
 	 */
-	std::string ReadFile(const std::string &filename, const int ID);
+	std::string ReadFile(const std::string &filename, const int ID, const std::string &cachedir = "", const double weldtolerance = REFLECT_TOLERANCE);
+
+	/**
+	 * Read several STL or OBJ files in parallel, see ReadFile.
+	 *
+	 * Meshes are added and their output is printed in the order in which the files are given.
+	 *
+	 * @param files List of filenames paired with the ID of the solid assigned to each file
+	 * @param cachedir Directory of mesh cache, see ReadFile
+	 * @param weldtolerance Vertices closer than this distance [m] are merged
+	 *
+	 * @return Returns names of meshes in files
+	 */
+	std::vector<std::string> ReadFiles(const std::vector<std::pair<std::string, int> > &files, const std::string &cachedir = "", const double weldtolerance = REFLECT_TOLERANCE);
 
 	/**
 	 * Test line segment p1->p2 for collision with all triangles in previously read files.
 	 *
 	 * @param p1 Line start point
 	 * @param p2 Line end point
-	 *
-	 * @return Returns vector containing collisions
+	 * @param colls Collisions are appended to this list, sorted along the segment
+	 * @param cache Optional triangle cache. If given, the segment is tested against the triangles in the cache, which is refilled if the segment leaves its region
+	 * @param skip Optional flags indexed by solid ID. Meshes of solids whose flag is set are not tested
 	 */
-	std::vector<TCollision> Collision(const std::vector<double> &p1, const std::vector<double> &p2) const;
+	void Collision(const double p1[3], const double p2[3], std::vector<TCollision> &colls, TTriangleCache *cache = nullptr, const std::vector<bool> *skip = nullptr) const;
 
 	/**
 	 * Test if point is inside the mesh
@@ -135,6 +288,11 @@ public:
 		return InSolid(p[0], p[1], p[2]);
 	}
 
+	/**
+	 * Check if no meshes were loaded
+	 */
+	bool empty() const{ return meshes.empty(); }
+
 	CCuboid GetBoundingBox() const{
 	    std::vector<CCuboid> b;
 	    std::transform(meshes.begin(), meshes.end(), std::back_inserter(b), [](const CTriangleMesh &m){ return m.tree->bbox(); });
@@ -151,6 +309,41 @@ public:
 	 * @return Returns true if point inside the mesh
 	 */
 	bool InSolid(const double x, const double y, const double z) const;
+
+	/**
+	 * Test if point is inside the mesh of a single solid
+	 *
+	 * @param p Point
+	 * @param ID ID of solid
+	 *
+	 * @return Returns true if point is inside the mesh with this ID
+	 */
+	bool InSolid(const double p[3], const unsigned ID) const;
+
+	/**
+	 * Return distance of point to closest triangle in any mesh
+	 *
+	 * @param x X coordinate of point
+	 * @param y Y coordinate of point
+	 * @param z Z coordinate of point
+	 *
+	 * @return Returns distance to closest triangle, infinity if no meshes were loaded
+	 */
+	double Distance(const double x, const double y, const double z) const;
+
+	/**
+	 * Return hash value of all vertices, faces and IDs of loaded meshes, used to check if cached data belongs to this geometry
+	 */
+	uint64_t Fingerprint() const;
+
+	/**
+	 * Build search trees used to speed up Distance, has to be called before calling Distance from several threads
+	 */
+	void AccelerateDistanceQueries() const{
+		for (auto &m: meshes)
+			m.tree->accelerate_distance_queries();
+	}
+
 	/**
 	  * Test if point is inside the mesh
 	  *
@@ -170,7 +363,7 @@ public:
     template<class Point> std::vector<unsigned> GetSolids(Point p) const{
         std::vector<unsigned> solids;
         for (auto &m: meshes){
-            if (m.tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(p[0],p[1],p[2]), CVector(0., 0., 1.))) % 2 != 0)
+            if (m.Contains(p[0], p[1], p[2]))
                 solids.push_back(m.ID);
         }
         return solids;
@@ -211,24 +404,76 @@ public:
 	}
 
 	/**
-	 * Return random point in volume bounded by mesh
+	 * Call function for each triangle of all meshes
+	 *
+	 * @param f Function called with the triangle (CKernel::Triangle_3), its unit normal (CVector), and the ID of the solid it belongs to
+	 */
+	template<class Function> void ForEachTriangle(Function f) const{
+		for (auto &m: meshes){
+			for (auto face: m.mesh->faces()){
+				std::vector<CPoint> vertices;
+				for (auto v: m.mesh->vertices_around_face(m.mesh->halfedge(face)))
+					vertices.push_back(m.mesh->point(v));
+				f(CKernel::Triangle_3(vertices[0], vertices[1], vertices[2]), CGAL::Polygon_mesh_processing::compute_face_normal(face, *m.mesh), m.ID);
+			}
+		}
+	}
+
+	/**
+	 * Check if triangle intersects any surface
+	 *
+	 * @param triangle Triangle
+	 *
+	 * @return Returns true if the triangle touches or crosses any triangle of any mesh
+	 */
+	bool Intersects(const CKernel::Triangle_3 &triangle) const{
+		return std::any_of(meshes.begin(), meshes.end(), [&triangle](const CTriangleMesh &m){ return m.tree->do_intersect(triangle); });
+	}
+
+	/**
+	 * Prepare RandomPointInVolume to pick points from cells inside or intersecting the meshes instead of their bounding boxes.
+	 *
+	 * Starts with the voxels used by InSolid and repeatedly splits cells intersecting the surface into eight,
+	 * until these make up less than 10% of the sampled volume, at most VOLUME_SAMPLER_LEVELS times or until a mesh is covered by VOLUME_SAMPLER_MAX_CELLS.
+	 * Should be called once after all files were read, if many points are sampled from thin or convoluted volumes.
+	 */
+	void BuildVolumeSampler();
+
+	/**
+	 * Return random point in volume bounded by mesh, uniformly distributed over the union of all meshes
+	 *
+	 * If BuildVolumeSampler was called, a cell inside or intersecting a mesh is chosen and a point is picked inside it.
+	 * Only points in cells intersecting the surface have to be checked and possibly rejected.
+	 * Otherwise, points are picked from the bounding boxes until one is inside a mesh.
 	 */
 	template<class RandomGenerator> std::array<double, 3> RandomPointInVolume(RandomGenerator &rand) const{
         std::array<double, 3> p;
-        do{
-            p = RandomPointInBoundingBox(rand);
-        }while (!InSolid(p));
-        return p;
+        if (volume_cells.empty()){
+            do{
+                p = RandomPointInBoundingBox(rand);
+            }while (!InSolid(p));
+            return p;
+        }
+
+        std::uniform_real_distribution<double> unidist(0, 1);
+        while (true){
+            const TVolumeCell &cell = volume_cells[volume_sampler(rand)];
+            for (int i = 0; i < 3; ++i)
+                p[i] = cell.lower[i] + unidist(rand)*cell.size;
+            if (cell.boundary && !meshes[cell.mesh].Contains(p[0], p[1], p[2]))
+                continue;
+            // if meshes overlap, only accept point if it was picked from the first mesh containing it, to keep the distribution uniform
+            if (std::any_of(meshes.begin(), meshes.begin() + cell.mesh, [&p](const CTriangleMesh &other){ return other.Contains(p[0], p[1], p[2]); }))
+                continue;
+            return p;
+        }
     }
 
 	/**
 	 * Return random point in bounding box
 	 */
     template<class RandomGenerator> std::array<double, 3> RandomPointInBoundingBox(RandomGenerator &rand) const{
-        std::vector<double> bvols;
-        std::transform(meshes.begin(), meshes.end(), std::back_inserter(bvols), [](const CTriangleMesh &mesh){ return CCuboid(mesh.tree->bbox()).volume(); });
-        std::discrete_distribution<unsigned> dist(bvols.begin(), bvols.end());
-        CCuboid bbox = meshes[dist(rand)].tree->bbox();
+        CCuboid bbox = meshes[bbox_sampler(rand)].tree->bbox();
         std::uniform_real_distribution<double> unidist(0, 1);
         return {bbox.xmin() + unidist(rand)*(bbox.xmax() - bbox.xmin()),
                 bbox.ymin() + unidist(rand)*(bbox.ymax() - bbox.ymin()),
@@ -0,0 +1,157 @@
+/**
+ * \file
+ * Regular grid of cubic voxels covering a bounding box.
+ */
+
+#ifndef VOXELGRID_H_
+#define VOXELGRID_H_
+
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+/**
+ * Regular grid of cubic voxels covering a bounding box, storing one value of type T per voxel.
+ *
+ * Voxels are stored with x index running fastest.
+ */
+template<typename T> class TVoxelGrid{
+private:
+	double origin[3]; ///< lower corner of grid
+	double spacing; ///< edge length of voxels
+	unsigned dims[3]; ///< number of voxels in each direction
+	std::vector<T> values; ///< value stored in each voxel
+
+public:
+	/**
+	 * Create empty grid
+	 */
+	TVoxelGrid(): origin{0., 0., 0.}, spacing(0), dims{0, 0, 0} { };
+
+	/**
+	 * Create grid covering bounding box
+	 *
+	 * @param lower Lower corner of bounding box that should be covered by grid
+	 * @param upper Upper corner of bounding box that should be covered by grid
+	 * @param aspacing Edge length of voxels
+	 * @param value Initial value of all voxels
+	 */
+	TVoxelGrid(const double lower[3], const double upper[3], const double aspacing, const T value = T()): spacing(aspacing){
+		if (spacing <= 0)
+			throw std::runtime_error("Voxel size has to be larger than zero!");
+		double size = 1.;
+		for (int i = 0; i < 3; ++i){
+			origin[i] = lower[i];
+			dims[i] = std::max(1., std::ceil((upper[i] - lower[i])/spacing));
+			size *= dims[i];
+		}
+		if (size > 1e9)
+			throw std::runtime_error("Voxel grid would contain more than 1e9 voxels! Choose a larger voxel size.");
+		values.assign(dims[0]*dims[1]*dims[2], value);
+	};
+
+	/**
+	 * Create grid with given origin and number of voxels, e.g. when reading it from a file
+	 *
+	 * @param aorigin Lower corner of grid
+	 * @param adims Number of voxels in each direction
+	 * @param aspacing Edge length of voxels
+	 * @param value Initial value of all voxels
+	 */
+	TVoxelGrid(const double aorigin[3], const unsigned adims[3], const double aspacing, const T value = T()): origin{aorigin[0], aorigin[1], aorigin[2]}, spacing(aspacing), dims{adims[0], adims[1], adims[2]}{
+		if (spacing <= 0)
+			throw std::runtime_error("Voxel size has to be larger than zero!");
+		if (static_cast<double>(dims[0])*dims[1]*dims[2] > 1e9)
+			throw std::runtime_error("Voxel grid would contain more than 1e9 voxels! Choose a larger voxel size.");
+		values.assign(static_cast<size_t>(dims[0])*dims[1]*dims[2], value);
+	};
+
+	/**
+	 * Check if grid contains any voxels
+	 */
+	bool empty() const{ return values.empty(); };
+
+	/**
+	 * Return total number of voxels
+	 */
+	size_t size() const{ return values.size(); };
+
+	/**
+	 * Return edge length of voxels
+	 */
+	double Spacing() const{ return spacing; };
+
+	/**
+	 * Return lower corner of grid
+	 */
+	const double* Origin() const{ return origin; };
+
+	/**
+	 * Return number of voxels in direction i
+	 */
+	unsigned Dim(const int i) const{ return dims[i]; };
+
+	/**
+	 * Return index of voxel with integer coordinates ix, iy, iz
+	 */
+	size_t Index(const unsigned ix, const unsigned iy, const unsigned iz) const{
+		return (static_cast<size_t>(iz)*dims[1] + iy)*dims[0] + ix;
+	};
+
+	/**
+	 * Find voxel containing point
+	 *
+	 * @param p Point
+	 * @param i Returns index of voxel
+	 *
+	 * @return Returns false if point lies outside of grid
+	 */
+	bool Index(const double p[3], size_t &i) const{
+		unsigned ix[3];
+		for (int j = 0; j < 3; ++j){
+			double r = (p[j] - origin[j])/spacing;
+			if (!(r >= 0 && r < dims[j])) // also catches NaN
+				return false;
+			ix[j] = static_cast<unsigned>(r);
+		}
+		i = Index(ix[0], ix[1], ix[2]);
+		return true;
+	};
+
+	/**
+	 * Return center of voxel with integer coordinates ix, iy, iz
+	 */
+	void Center(const unsigned ix, const unsigned iy, const unsigned iz, double c[3]) const{
+		c[0] = origin[0] + (ix + 0.5)*spacing;
+		c[1] = origin[1] + (iy + 0.5)*spacing;
+		c[2] = origin[2] + (iz + 0.5)*spacing;
+	};
+
+	/**
+	 * Return center of voxel with index i
+	 */
+	void Center(const size_t i, double c[3]) const{
+		Center(i % dims[0], (i / dims[0]) % dims[1], i / dims[0] / dims[1], c);
+	};
+
+	/**
+	 * Return lower and upper corner of voxel with integer coordinates ix, iy, iz
+	 */
+	void Corners(const unsigned ix, const unsigned iy, const unsigned iz, double lower[3], double upper[3]) const{
+		lower[0] = origin[0] + ix*spacing;
+		lower[1] = origin[1] + iy*spacing;
+		lower[2] = origin[2] + iz*spacing;
+		upper[0] = lower[0] + spacing;
+		upper[1] = lower[1] + spacing;
+		upper[2] = lower[2] + spacing;
+	};
+
+	T& operator[](const size_t i){ return values[i]; }; ///< Access value of voxel i
+	const T& operator[](const size_t i) const{ return values[i]; }; ///< Access value of voxel i
+
+	T* data(){ return values.data(); }; ///< Direct access to voxel values
+	const T* data() const{ return values.data(); }; ///< Direct access to voxel values
+};
+
+#endif // VOXELGRID_H_
@@ -57,6 +57,12 @@ int TExponentialFieldX::withinBounds(const double x, const double y, const doubl
 					and (y <= this->ymax)	and (z >= this->zmin) and (z <= this->zmax));
 }
 
+bool TExponentialFieldX::Bounds(double lower[3], double upper[3]) const{
+	lower[0] = xmin; lower[1] = ymin; lower[2] = zmin;
+	upper[0] = xmax; upper[1] = ymax; upper[2] = zmax;
+	return true;
+}
+
 //TLinearFieldZ constructor
 TLinearFieldZ::TLinearFieldZ(const double _a1, const double _a2, const double _xmax, const double _xmin,
 									const double _ymax, const double _ymin, const double _zmax, const double _zmin)
@@ -102,3 +108,9 @@ int TLinearFieldZ::withinBounds(const double x, const double y, const double z)
 	return ((x >= this->xmin) and (x <= this->xmax) and (y >= this->ymin)
 					and (y <= this->ymax)	and (z >= this->zmin) and (z <= this->zmax));
 }
+
+bool TLinearFieldZ::Bounds(double lower[3], double upper[3]) const{
+	lower[0] = xmin; lower[1] = ymin; lower[2] = zmin;
+	upper[0] = xmax; upper[1] = ymax; upper[2] = zmax;
+	return true;
+}
@@ -0,0 +1,119 @@
+#include "distancefield.h"
+
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+static const char DISTANCEFIELD_MAGIC[8] = {'P','T','D','I','S','T','1','\0'}; ///< identifier at beginning of distance-field cache files
+
+TDistanceField::TDistanceField(const double lower[3], const double upper[3], const double voxelsize, const std::function<double(const double p[3])> &distance,
+								const uint64_t fingerprint, const boost::filesystem::path &cachefile){
+	grid = TVoxelGrid<float>(lower, upper, voxelsize, 0.f);
+
+	if (!cachefile.empty() && Read(cachefile, fingerprint)){
+		std::cout << "Read distance field with " << grid.size() << " voxels from " << cachefile << "\n";
+		return;
+	}
+
+	Build(distance);
+
+	if (!cachefile.empty()){
+		Write(cachefile, fingerprint);
+		std::cout << "Wrote distance field to " << cachefile << "\n";
+	}
+}
+
+
+void TDistanceField::Build(const std::function<double(const double p[3])> &distance){
+	unsigned nthreads = std::max(1u, std::thread::hardware_concurrency());
+	std::cout << "Building distance field with " << grid.Dim(0) << "x" << grid.Dim(1) << "x" << grid.Dim(2) << " voxels on " << nthreads << " threads ... ";
+	std::cout.flush();
+
+	double c[3];
+	grid.Center(0, 0, 0, c);
+	distance(c); // first query may build search trees, do it before starting parallel queries
+
+	auto fillslices = [this, &distance, nthreads](const unsigned first){
+		double c[3];
+		for (unsigned iz = first; iz < grid.Dim(2); iz += nthreads){
+			for (unsigned iy = 0; iy < grid.Dim(1); ++iy){
+				for (unsigned ix = 0; ix < grid.Dim(0); ++ix){
+					grid.Center(ix, iy, iz, c);
+					double d = distance(c);
+					float df = static_cast<float>(d);
+					if (df > d)
+						df = std::nextafter(df, 0.f); // round down to keep distance a conservative estimate
+					grid[grid.Index(ix, iy, iz)] = df;
+				}
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < nthreads; ++i)
+		threads.push_back(std::thread(fillslices, i));
+	fillslices(0);
+	for (auto &t: threads)
+		t.join();
+
+	std::cout << "done\n";
+}
+
+
+bool TDistanceField::Read(const boost::filesystem::path &filename, const uint64_t fingerprint){
+	std::ifstream f(filename.native(), std::fstream::binary);
+	if (!f.is_open())
+		return false;
+
+	char magic[sizeof(DISTANCEFIELD_MAGIC)];
+	uint64_t filefingerprint;
+	double origin[3], spacing;
+	unsigned dims[3];
+	f.read(magic, sizeof(magic));
+	f.read((char*)&filefingerprint, sizeof(filefingerprint));
+	f.read((char*)origin, sizeof(origin));
+	f.read((char*)&spacing, sizeof(spacing));
+	f.read((char*)dims, sizeof(dims));
+	if (!f || std::memcmp(magic, DISTANCEFIELD_MAGIC, sizeof(magic)) != 0 || filefingerprint != fingerprint || spacing != grid.Spacing()){
+		std::cout << "Distance field in " << filename << " does not match geometry, rebuilding it\n";
+		return false;
+	}
+	for (int i = 0; i < 3; ++i){
+		if (origin[i] != grid.Origin()[i] || dims[i] != grid.Dim(i)){
+			std::cout << "Distance field in " << filename << " does not match geometry, rebuilding it\n";
+			return false;
+		}
+	}
+
+	f.read((char*)grid.data(), grid.size()*sizeof(float));
+	if (!f){
+		std::cout << "Distance field in " << filename << " is incomplete, rebuilding it\n";
+		return false;
+	}
+	return true;
+}
+
+
+void TDistanceField::Write(const boost::filesystem::path &filename, const uint64_t fingerprint) const{
+	boost::filesystem::path tmpfile = filename.parent_path() / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+	std::ofstream f(tmpfile.native(), std::fstream::binary);
+	if (!f.is_open())
+		throw std::runtime_error( (boost::format("Could not create %1%") % tmpfile.native()).str() );
+
+	double spacing = grid.Spacing();
+	unsigned dims[3] = {grid.Dim(0), grid.Dim(1), grid.Dim(2)};
+	f.write(DISTANCEFIELD_MAGIC, sizeof(DISTANCEFIELD_MAGIC));
+	f.write((const char*)&fingerprint, sizeof(fingerprint));
+	f.write((const char*)grid.Origin(), 3*sizeof(double));
+	f.write((const char*)&spacing, sizeof(spacing));
+	f.write((const char*)dims, sizeof(dims));
+	f.write((const char*)grid.data(), grid.size()*sizeof(float));
+	f.close();
+	if (!f)
+		throw std::runtime_error( (boost::format("Could not write distance field to %1%") % tmpfile.native()).str() );
+	boost::filesystem::rename(tmpfile, filename);
+}
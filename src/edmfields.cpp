@@ -292,6 +292,18 @@ void TEDMStaticB0GradZField::CompressionFactor(const double x, const double y, c
 	}
 }
 
+bool TEDMStaticB0GradZField::Bounds(double lower[3], double upper[3]) const{
+	if (BoundaryWidth == 0) // field is only folded to zero outside of min/max if there is a boundary
+		return false;
+	lower[0] = xmin;
+	lower[1] = ymin;
+	lower[2] = zmin;
+	upper[0] = xmax;
+	upper[1] = ymax;
+	upper[2] = zmax;
+	return true;
+}
+
 double TEDMStaticB0GradZField::SmthrStp(const double x) const{
 	return 6*pow(x, 5) - 15*pow(x, 4) + 10*pow(x, 3);
 }
@@ -387,3 +387,13 @@ void TabField::EField(const double x, const double y, const double z, const doub
 
     }
 }
+
+
+bool TabField::Bounds(double lower[3], double upper[3]) const{
+	double rmax = r_mi + rdist*(m - 1);
+	lower[0] = lower[1] = -rmax;
+	upper[0] = upper[1] = rmax;
+	lower[2] = z_mi;
+	upper[2] = z_mi + zdist*(n - 1);
+	return true;
+}
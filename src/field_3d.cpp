@@ -498,6 +498,15 @@ void TabField3::EField(const double x, const double y, const double z, const dou
 }
 
 
+bool TabField3::Bounds(double lower[3], double upper[3]) const{
+	for (int i = 0; i < 3; ++i){
+		lower[i] = xyz[i].front();
+		upper[i] = xyz[i].back();
+	}
+	return true;
+}
+
+
 void TabField3::FieldSmthr(const double x, const double y, const double z, double &F, double dFdxi[3]) const{
 	if (BoundaryWidth != 0 && F != 0){ // skip, if BoundaryWidth is set to zero
         double dxlo = (x - xyz[0].front())/BoundaryWidth; // calculate distance to edges in units of BoundaryWidth
@@ -8,6 +8,7 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include "field_2d.h"
 #include "field_3d.h"
 #include "conductor.h"
@@ -71,10 +72,105 @@ TFieldManager::TFieldManager(TConfig &conf){
 		}
 	}
 	std::cout << "\n";
+
+	bounded = true;
+	for (const auto &f: fields){
+		std::array<double, 6> b;
+		if (f->Bounds(&b[0], &b[3]))
+			bounds.push_back(b);
+		else
+			bounded = false;
+	}
+}
+
+
+void TFieldManager::Fields(const unsigned n, const double p[][4], double B[][3], double dBidxj[][3][3], double V[], double Ei[][3], TFieldCache *const caches[]) const{
+	bool electric = V != nullptr && Ei != nullptr;
+	std::fill(&B[0][0], &B[0][0] + 3*n, 0);
+	std::fill(&dBidxj[0][0][0], &dBidxj[0][0][0] + 9*n, 0);
+	if (electric){
+		std::fill(V, V + n, 0);
+		std::fill(&Ei[0][0], &Ei[0][0] + 3*n, 0);
+	}
+	for (const auto &it: fields){
+		for (unsigned k = 0; k < n; ++k){
+			double Btmp[3] = {0,0,0};
+			double dBtmp[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+			it->BField(p[k][0], p[k][1], p[k][2], p[k][3], Btmp, dBtmp);
+			for (int i = 0; i < 3; i++){
+				B[k][i] += Btmp[i];
+				for (int j = 0; j < 3; j++)
+					dBidxj[k][i][j] += dBtmp[i][j];
+			}
+			if (electric){
+				double Vtmp = 0, Etmp[3] = {0,0,0};
+				it->EField(p[k][0], p[k][1], p[k][2], p[k][3], Vtmp, Etmp);
+				V[k] += Vtmp;
+				for (int i = 0; i < 3; i++)
+					Ei[k][i] += Etmp[i];
+			}
+		}
+	}
+	if (caches == nullptr)
+		return;
+	for (unsigned k = 0; k < n; ++k){
+		if (caches[k] == nullptr)
+			continue;
+		TFieldCache::TCachedFields &e = caches[k]->Lookup(p[k][0], p[k][1], p[k][2], p[k][3]);
+		std::copy(B[k], B[k] + 3, e.B);
+		std::copy(&dBidxj[k][0][0], &dBidxj[k][0][0] + 9, &e.dBidxj[0][0]);
+		e.Bvalid = e.dBvalid = true;
+		if (electric){
+			e.V = V[k];
+			std::copy(Ei[k], Ei[k] + 3, e.E);
+			e.Evalid = true;
+		}
+	}
 }
 
 
-void TFieldManager::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3]) const{
+bool TFieldManager::FieldFree(const double lower[3], const double upper[3]) const{
+	if (!bounded)
+		return false;
+	return std::none_of(bounds.begin(), bounds.end(), [lower, upper](const std::array<double, 6> &b){
+		return	lower[0] <= b[3] && upper[0] >= b[0] &&
+				lower[1] <= b[4] && upper[1] >= b[1] &&
+				lower[2] <= b[5] && upper[2] >= b[2];
+	});
+}
+
+
+TFieldCache::TCachedFields& TFieldCache::Lookup(const double x, const double y, const double z, const double t){
+	for (unsigned i = 0; i < FIELD_CACHE_SIZE; ++i){
+		TCachedFields &e = entries[(next + FIELD_CACHE_SIZE - 1 - i) % FIELD_CACHE_SIZE]; // search from newest to oldest entry
+		if (e.x == x && e.y == y && e.z == z && e.t == t && (e.Bvalid || e.Evalid))
+			return e;
+	}
+	TCachedFields &e = entries[next];
+	next = (next + 1) % FIELD_CACHE_SIZE;
+	e.x = x;
+	e.y = y;
+	e.z = z;
+	e.t = t;
+	e.Bvalid = e.dBvalid = e.Evalid = false;
+	return e;
+}
+
+
+void TFieldManager::BField(const double x, const double y, const double z, const double t, double B[3], double dBidxj[3][3], TFieldCache *cache) const{
+	if (cache != nullptr){
+		TFieldCache::TCachedFields &e = cache->Lookup(x, y, z, t);
+		if (!e.Bvalid || (dBidxj != nullptr && !e.dBvalid)){ // fields at this point not known yet
+			BField(x, y, z, t, e.B, dBidxj != nullptr ? e.dBidxj : nullptr);
+			e.Bvalid = true;
+			e.dBvalid |= (dBidxj != nullptr);
+		}
+		std::copy(e.B, e.B + 3, B);
+		if (dBidxj != nullptr)
+			std::copy(&e.dBidxj[0][0], &e.dBidxj[0][0] + 9, &dBidxj[0][0]);
+		return;
+	}
+
 	for (int i = 0; i < 3; i++){
 		B[i] = 0;
 		if (dBidxj != nullptr){
@@ -103,7 +199,18 @@ void TFieldManager::BField(const double x, const double y, const double z, const
 
 
 void TFieldManager::EField(const double x, const double y, const double z, const double t,
-		double &V, double Ei[3]) const{
+		double &V, double Ei[3], TFieldCache *cache) const{
+	if (cache != nullptr){
+		TFieldCache::TCachedFields &e = cache->Lookup(x, y, z, t);
+		if (!e.Evalid){ // fields at this point not known yet
+			EField(x, y, z, t, e.V, e.E);
+			e.Evalid = true;
+		}
+		V = e.V;
+		std::copy(e.E, e.E + 3, Ei);
+		return;
+	}
+
 	V = 0;
 	for (int i = 0; i < 3; i++){
 		Ei[i] = 0;
@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <limits>
 
 #include "globals.h"
 
@@ -104,6 +106,13 @@ TGeometry::TGeometry(TConfig &geometryin){
 		matconf.ReadFromFile(matpath.native());
 	}
 	
+	boost::filesystem::path meshcache;
+	istringstream(geometryin["GLOBAL"]["meshcache"]) >> meshcache;
+	if (!meshcache.empty()){
+		meshcache = boost::filesystem::absolute(meshcache, configpath.parent_path()); // relative paths are assumed to be relative to the config file's path
+		boost::filesystem::create_directories(meshcache);
+	}
+
 	vector<material> materials;
 	std::transform(matconf["MATERIALS"].begin(), matconf["MATERIALS"].end(), back_inserter(materials), 
 					[](const std::pair<std::string, std::string> &i){
@@ -114,6 +123,10 @@ TGeometry::TGeometry(TConfig &geometryin){
 					}
 	); // Read materials from config and add them to list
 	
+	double weldtolerance = REFLECT_TOLERANCE;
+	istringstream(geometryin["GLOBAL"]["weldtolerance"]) >> weldtolerance;
+
+	std::vector<std::pair<std::string, int> > files;
 	for (auto sldparams : geometryin["GEOMETRY"]){
 		solid sld;
 		istringstream(sldparams.first) >> sld.ID;
@@ -128,50 +141,171 @@ TGeometry::TGeometry(TConfig &geometryin){
 			sld.name = "default solid";
 			defaultsolid = sld;
 		}
+		else if (IsPrimitive(sld.filename.native())){
+			primitives.push_back(CreatePrimitive(sld.filename.native(), sld.ID));
+			sld.name = sld.filename.native();
+			solids.push_back(sld);
+		}
 		else{
-			sld.name = mesh.ReadFile(boost::filesystem::absolute(sld.filename, configpath.parent_path()).native(), sld.ID);
+			files.push_back(std::make_pair(boost::filesystem::absolute(sld.filename, configpath.parent_path()).native(), sld.ID));
 			solids.push_back(sld);
 		}
 	}
+	std::vector<std::string> names = mesh.ReadFiles(files, meshcache.native(), weldtolerance); // load all files in parallel
+	auto name = names.begin();
+	for (solid &sld: solids){
+		if (!IsPrimitive(sld.filename.native()))
+			sld.name = *name++;
+	}
 	
-	if (std::unique(solids.begin(), solids.end(), [](const solid s1, const solid s2){ return s1.ID == s2.ID; }) != solids.end()) // check if IDs of each solid are unique
-		throw std::runtime_error("You defined solids with identical ID! IDs have to be unique!");
+	solidsbyID.assign(2, nullptr);
+	solidsbyID[1] = &defaultsolid; // default solid always has ID 1
+	for (const solid &sld: solids){ // solids list does not change anymore, so pointers to its elements stay valid
+		if (sld.ID >= solidsbyID.size())
+			solidsbyID.resize(sld.ID + 1, nullptr);
+		if (solidsbyID[sld.ID] != nullptr) // check if IDs of each solid are unique
+			throw std::runtime_error("You defined solids with identical ID! IDs have to be unique!");
+		solidsbyID[sld.ID] = &sld;
+	}
+
+	double voxelsize = 0;
+	istringstream(geometryin["GLOBAL"]["distancefield"]) >> voxelsize;
+	if (voxelsize > 0 && !solids.empty()){
+		boost::filesystem::path cachefile;
+		istringstream(geometryin["GLOBAL"]["distancefieldcache"]) >> cachefile;
+		if (!cachefile.empty())
+			cachefile = boost::filesystem::absolute(cachefile, configpath.parent_path()); // relative paths are assumed to be relative to the config file's path
+
+		// distance field covers all meshes and bounded primitives
+		double lower[3], upper[3];
+		std::fill(lower, lower + 3, std::numeric_limits<double>::infinity());
+		std::fill(upper, upper + 3, -std::numeric_limits<double>::infinity());
+		if (!mesh.empty()){
+			CCuboid bbox = mesh.GetBoundingBox();
+			for (int i = 0; i < 3; ++i){
+				lower[i] = bbox.min_coord(i);
+				upper[i] = bbox.max_coord(i);
+			}
+		}
+		uint64_t fingerprint = mesh.Fingerprint();
+		for (auto &p: primitives){
+			double plower[3], pupper[3];
+			if (p->Bounds(plower, pupper)){
+				for (int i = 0; i < 3; ++i){
+					lower[i] = std::min(lower[i], plower[i]);
+					upper[i] = std::max(upper[i], pupper[i]);
+				}
+			}
+			unsigned ID = p->GetID();
+			std::string definition = GetSolid(ID).filename.native();
+			fingerprint = FNV1a(&ID, sizeof(ID), fingerprint);
+			fingerprint = FNV1a(definition.data(), definition.size(), fingerprint);
+		}
+		if (lower[0] < upper[0]){
+			mesh.AccelerateDistanceQueries();
+			distancefield = TDistanceField(lower, upper, voxelsize, [this](const double p[3]){
+				double d = mesh.Distance(p[0], p[1], p[2]);
+				for (auto &prim: primitives)
+					d = std::min(d, prim->Distance(p));
+				return d;
+			}, fingerprint, cachefile);
+		}
+	}
+
+	// split time axis into windows in which the set of ignored solids does not change
+	for (const solid &sld: solids){
+		for (auto &its: sld.ignoretimes){
+			windowstarts.push_back(its.first);
+			windowstarts.push_back(its.second);
+		}
+	}
+	std::sort(windowstarts.begin(), windowstarts.end());
+	windowstarts.erase(std::unique(windowstarts.begin(), windowstarts.end()), windowstarts.end());
+	ignoredsolids.resize(windowstarts.size() + 1);
+	for (unsigned w = 0; w < ignoredsolids.size(); ++w){
+		double t = w == 0 ? -std::numeric_limits<double>::infinity() : windowstarts[w - 1]; // ignore times include their start, so the window start is representative for the whole window
+		for (const solid &sld: solids){
+			if (sld.is_ignored(t)){
+				ignoredsolids[w].resize(solidsbyID.size(), false);
+				ignoredsolids[w][sld.ID] = true;
+			}
+		}
+	}
+}
+
+bool TGeometry::InSolid(const double p[3], const unsigned ID) const{
+	for (auto &prim: primitives){
+		if (prim->GetID() == ID)
+			return prim->Contains(p);
+	}
+	return mesh.InSolid(p, ID);
+}
+
+void TGeometry::UpdateInactiveSolids(const double t1, const double t2, const double p[3], std::vector<std::pair<const solid*, bool> > &currentsolids, std::vector<bool> &inactive,
+										std::vector<bool> &newinactive) const{
+	unsigned w1 = GetTimeWindow(t1), w2 = GetTimeWindow(t2);
+	newinactive.assign(ignoredsolids[w1].begin(), ignoredsolids[w1].end()); // reuses memory of scratch list
+	for (unsigned w = w1 + 1; w <= w2 && !newinactive.empty(); ++w){ // solid can only be skipped if it is ignored in all windows touched by the step
+		if (ignoredsolids[w].empty())
+			newinactive.clear();
+		else
+			std::transform(newinactive.begin(), newinactive.end(), ignoredsolids[w].begin(), newinactive.begin(), std::logical_and<bool>());
+	}
+	if (!newinactive.empty()){
+		for (auto &s: currentsolids) // collisions with solids the particle is inside of are needed to detect when it leaves them
+			newinactive[s.first->ID] = false;
+		if (std::none_of(newinactive.begin(), newinactive.end(), [](const bool b){ return b; }))
+			newinactive.clear();
+	}
+
+	for (unsigned ID = 0; ID < inactive.size(); ++ID){
+		// particle may have entered solids that were skipped in the previous step without noticing, add them as if the entrance had been detected while they were ignored
+		if (inactive[ID] && (ID >= newinactive.size() || !newinactive[ID]) && InSolid(p, ID))
+			currentsolids.push_back(std::make_pair(solidsbyID[ID], true));
+	}
+	inactive.swap(newinactive);
 }
 
-bool TGeometry::GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], multimap<TCollision, bool> &colls) const{
-	vector<TCollision> c = mesh.Collision(std::vector<double>{p1[0], p1[1], p1[2]}, std::vector<double>{p2[0], p2[1], p2[2]});
-	colls.clear();
-	for (auto it: c){
-		solid sld = GetSolid(it.ID);
+bool TGeometry::GetCollisions(const double x1, const double p1[3], const double x2, const double p2[3], TCollisionList &colls,
+								TTriangleCache *cache, const std::vector<bool> *inactive) const{
+	const std::vector<bool> *skip = inactive != nullptr && !inactive->empty() ? inactive : nullptr;
+	colls.found.clear();
+	mesh.Collision(p1, p2, colls.found, cache, skip);
+	for (auto &prim: primitives){
+		if (skip == nullptr || !(*skip)[prim->GetID()])
+			prim->Collisions(p1, p2, colls.found);
+	}
+	colls.colls.clear();
+	for (auto &it: colls.found){
 		double t = x1 + (x2 - x1)*it.s;
-		colls.emplace(it, sld.is_ignored(t));
+		auto pos = std::upper_bound(colls.colls.begin(), colls.colls.end(), it, [](const TCollision &c, const std::pair<TCollision, bool> &p){ return c < p.first; });
+		colls.colls.insert(pos, std::make_pair(it, IsIgnored(GetSolid(it.ID), t))); // insert behind collisions with equal key, keeping the order in which they were found
 	}
 	return !colls.empty();
 }
 
 
-std::vector<std::pair<solid, bool> > TGeometry::GetSolids(const double t, const double p[3]) const{
-	std::vector<std::pair<solid, bool> > currentsolids = { std::make_pair(defaultsolid, false) };
+std::vector<std::pair<const solid*, bool> > TGeometry::GetSolids(const double t, const double p[3]) const{
+	std::vector<std::pair<const solid*, bool> > currentsolids = { std::make_pair(&defaultsolid, false) };
 	for (unsigned ID: mesh.GetSolids(std::array<double, 3>({p[0], p[1], p[2]}))) {
-	    solid sld = GetSolid(ID);
-        currentsolids.push_back(std::make_pair(sld, sld.is_ignored(t)));
+	    const solid &sld = GetSolid(ID);
+        currentsolids.push_back(std::make_pair(&sld, IsIgnored(sld, t)));
     }
+	for (auto &prim: primitives){
+		if (prim->Contains(p)){
+			const solid &sld = GetSolid(prim->GetID());
+			currentsolids.push_back(std::make_pair(&sld, IsIgnored(sld, t)));
+		}
+	}
 	return currentsolids;
 }
 
-solid TGeometry::GetSolid(const double t, const double p[3]) const{
+const solid& TGeometry::GetSolid(const double t, const double p[3]) const{
 	// find first (highest-priority) solid that's not being ignored
 	auto currentsolids = GetSolids(t, p);
 //	for (auto s: currentsolids)
-//		std::cout << s.first.name << " " << s.second << std::endl;
-	auto sld = std::max_element(currentsolids.begin(), currentsolids.end(), [](const std::pair<solid, bool> s1, const std::pair<solid, bool> s2){ return s1.second || (!s2.second && s1.first.ID < s2.first.ID); });
-//	std::cout << sld->first.name << " " << sld->second << std::endl;
-	return sld->first;
-}
-
-solid TGeometry::GetSolid(const unsigned ID) const{
-	auto sld = std::find_if(solids.begin(), solids.end(), [&ID](const solid &s){ return s.ID == ID; });
-	if (sld == solids.end())
-		throw std::runtime_error((boost::format("Could not find solid with ID %s") % ID).str());
-	return *sld;
+//		std::cout << s.first->name << " " << s.second << std::endl;
+	auto sld = std::max_element(currentsolids.begin(), currentsolids.end(), [](const std::pair<const solid*, bool> &s1, const std::pair<const solid*, bool> &s2){ return s1.second || (!s2.second && s1.first->ID < s2.first->ID); });
+//	std::cout << sld->first->name << " " << sld->second << std::endl;
+	return *sld->first;
 }
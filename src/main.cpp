@@ -15,6 +15,9 @@
 #include <iomanip>
 #include <chrono>
 #include <memory>
+#include <atomic>
+#include <new>
+#include <cstdlib>
 #include <boost/format.hpp>
 
 #include "particle.h"
@@ -40,8 +43,27 @@ double SimTime = 1500.; ///< max. simulation time
 int simcount = 1; ///< number of particles for MC simulation (read from config)
 simType simtype = PARTICLE; ///< type of particle which shall be simulated (read from config)
 int secondaries = 1; ///< should secondary particles be simulated? (read from config)
+unsigned batchsize = 1; ///< number of particles integrated in lockstep (read from config)
 uint64_t seed = 0; ///< random seed used for random-number generator (generated from high-resolution clock)
 
+#ifdef COUNT_ALLOCATIONS
+static std::atomic<unsigned long long> allocationcount(0); ///< number of heap allocations, only counted when compiled with COUNT_ALLOCATIONS to benchmark the integrator
+
+/**
+ * Replacement for global operator new counting all heap allocations (array version and operator delete use it by default).
+ */
+void* operator new(std::size_t size){
+	++allocationcount;
+	if (void *p = std::malloc(size == 0 ? 1 : size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept{
+	std::free(p);
+}
+#endif
+
 /**
  * Catch signals.
  *
@@ -119,6 +141,16 @@ int main(int argc, char **argv){
 		PrintGeometry(outpath / "geometry.out", geom);
 		return 0;
 	}
+
+	double mrtabletolerance = 0;
+	istringstream(configin["GLOBAL"]["mrtabletolerance"]) >> mrtabletolerance;
+	boost::filesystem::path mrtablecache;
+	istringstream(configin["GLOBAL"]["mrtablecache"]) >> mrtablecache;
+	if (!mrtablecache.empty()){
+		mrtablecache = boost::filesystem::absolute(mrtablecache, configpath.parent_path()); // relative paths are assumed to be relative to the config file's path
+		boost::filesystem::create_directories(mrtablecache);
+	}
+	MR::SetTableOptions(mrtabletolerance, mrtablecache); // tabulate micro-roughness distributions, if requested
 	
 	cout << "Loading random number generator...\n";
 	// load random number generator
@@ -142,6 +174,9 @@ int main(int argc, char **argv){
 
 	// simulation time counter
 	chrono::time_point<chrono::steady_clock> simstart = chrono::steady_clock::now();
+#ifdef COUNT_ALLOCATIONS
+	unsigned long long allocationsstart = allocationcount;
+#endif
 
 	cout << "\n";
 	map<string, map<int, int> > ID_counter; // 2D map to store number of each ID for each particle type
@@ -149,10 +184,7 @@ int main(int argc, char **argv){
 	if (simtype == PARTICLE){ // if proton or neutron shall be simulated
 	    cout << "Simulating " << simcount << " " << source->GetParticleName() << "s...\n";
         progress_display progress(simcount);
-		for (int iMC = 1; iMC <= simcount; iMC++)
-		{
-			TParticle *p = source->CreateParticle(mc, geom, field);
-			p->Integrate(SimTime, configin[p->GetName()], mc, geom, field); // integrate particle
+		auto finish = [&](TParticle *p){
 			ID_counter[p->GetName()][p->GetStopID()]++; // increment counters
 			ntotalsteps += p->GetNumberOfSteps();
 
@@ -167,6 +199,19 @@ int main(int argc, char **argv){
 
 			delete p;
             ++progress;
+		};
+		if (batchsize > 1){
+			int iMC = 0;
+			TParticle::IntegrateBatch(batchsize, SimTime, configin, mc, geom, field,
+					[&]{ return iMC++ < simcount ? source->CreateParticle(mc, geom, field) : nullptr; }, finish); // integrate particles in lockstep
+		}
+		else{
+			for (int iMC = 1; iMC <= simcount; iMC++)
+			{
+				TParticle *p = source->CreateParticle(mc, geom, field);
+				p->Integrate(SimTime, configin[p->GetName()], mc, geom, field); // integrate particle
+				finish(p);
+			}
 		}
 	}
 	else{
@@ -179,6 +224,10 @@ int main(int argc, char **argv){
 	
 	// print statistics
 	printf("The integrator made %d steps. \n", ntotalsteps);
+#ifdef COUNT_ALLOCATIONS
+	unsigned long long allocations = allocationcount - allocationsstart;
+	printf("Simulation made %llu heap allocations (%.2f per integrator step).\n", allocations, ntotalsteps > 0 ? double(allocations)/ntotalsteps : 0.);
+#endif
 	chrono::time_point<chrono::steady_clock> simend = chrono::steady_clock::now();
 	float SimulationTime = chrono::duration_cast<chrono::milliseconds>(simend - simstart).count()/1000.;
 	printf("Init: %.2fs, Simulation: %.2fs\n",
@@ -233,6 +282,7 @@ TConfig ConfigInit(int argc, char **argv){
 	istringstream(config["GLOBAL"]["simcount"])		>> simcount;
 	istringstream(config["GLOBAL"]["simtime"])		>> SimTime;
 	istringstream(config["GLOBAL"]["secondaries"])	>> secondaries;
+	istringstream(config["GLOBAL"]["batchsize"])	>> batchsize;
 	
 	// add default parameters from PARTICLES section to each individual particle's parameters
 	for (auto i = config["PARTICLES"].begin(); i != config["PARTICLES"].end(); ++i){
@@ -375,6 +425,7 @@ void OutputCodes(const map<string, map<int, int> > &ID_counter){
 	for (auto i = ID_counter.begin(); i != ID_counter.end(); i++){
 		map<int, int> counts = i->second;
 		const char *name = i->first.c_str();
+		printf("%4i: %6i %10s(s) were stopped by Russian roulette\n", 3, counts[ 3], name);
 		printf("%4i: %6i %10s(s) were absorbed on a surface\n",	 2, counts[ 2], name);
 		printf("%4i: %6i %10s(s) were absorbed in a material\n", 1, counts[ 1], name);
 		printf("%4i: %6i %10s(s) were not categorized\n",		 0, counts[ 0], name);
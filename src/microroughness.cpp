@@ -1,10 +1,18 @@
 #include "microroughness.h"
 
 #include <complex>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <cstring>
+#include <cstdint>
 
 #include "optimization.h"
 #include "specialfunctions.h"
 #include <boost/numeric/odeint.hpp>
+#include <boost/format.hpp>
 
 #include "globals.h"
 
@@ -12,6 +20,137 @@ using namespace std;
 
 namespace MR{
 
+static const char MRTABLE_MAGIC[8] = {'P','T','M','R','T','A','B','1'}; ///< identifier at beginning of MicroRoughness-table cache files
+static const unsigned MRTABLE_MAX_SIZE = 1 << 22; ///< max. number of tabulated values (grid nodes times outgoing theta)
+
+static double tabletolerance = 0; ///< relative tolerance of tabulated distributions, tables are disabled if zero
+static boost::filesystem::path tablecache; ///< directory in which tables are cached
+static map<tuple<bool, double, double, double>, unique_ptr<TMRTable> > tables; ///< tables built so far, sorted by reflection/transmission, roughness, correlation length and potential step
+
+/**
+ * struct containing parameters of the MicroRoughness model for a specific surface hit
+ */
+struct TMRHit{
+	double b; ///< RMS roughness of surface
+	double w; ///< correlation length of surface roughness
+	double Estep; ///< potential step
+	double kc2; ///< squared critical wave number of potential step, negative if potential decreases
+	double ki; ///< incident wave number
+	double kt; ///< transmitted wave number, equal to ki for reflection
+	double costheta_i; ///< cosine of angle between normal and incoming velocity vector
+};
+
+/**
+ * Collect parameters of MicroRoughness model for a surface hit
+ *
+ * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+ * @param v velocity right before surface hit
+ * @param normal Normal vector of hit surface
+ * @param leaving Solid, which the neutron would leave if it were transmitted
+ * @param entering Solid, which the neutron would enter if it were transmitted
+ * @param h Returns parameters
+ *
+ * @return Returns false if the particle is transmitted but its energy is lower than the potential wall
+ */
+static bool HitParameters(const bool transmit, const double v[3], const double normal[3], const solid &leaving, const solid &entering, TMRHit &h){
+	double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
+	double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
+	double E = 0.5*m_n*v2; // kinetic energy
+	h.Estep = entering.mat.FermiReal*1e-9 - leaving.mat.FermiReal*1e-9; // potential wall
+	if (transmit && E <= h.Estep) // if particle is transmitted: check if energy is higher than potential wall
+		return false;
+	const material &mat = vnormal > 0 ? leaving.mat : entering.mat;
+	h.b = mat.RMSRoughness;
+	h.w = mat.CorrelLength;
+	h.kc2 = 2*m_n*h.Estep*ele_e*ele_e/hbar/hbar;
+	h.ki = sqrt(2*m_n*E)*ele_e/hbar;
+	h.kt = transmit ? sqrt(2*m_n*(E - h.Estep))*ele_e/hbar : h.ki;
+	h.costheta_i = abs(vnormal/sqrt(v2));
+	return true;
+}
+
+/**
+ * Amplitude 2*kn/(kn + sqrt(kn^2 - kc^2)) of a wave with normal wave number kn transmitted through a potential step
+ *
+ * @param kn Normal wave number
+ * @param kc2 Squared critical wave number of potential step
+ */
+static complex<double> Amplitude(const double kn, const double kc2){
+	complex<double> d = kn + sqrt(complex<double>(kn*kn - kc2, 0));
+	return d == 0. ? 0. : 2*kn/d;
+}
+
+/**
+ * Part of MRDist that does not depend on the outgoing angles
+ *
+ * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+ * @param h Parameters of surface hit
+ */
+static double Prefactor(const bool transmit, const TMRHit &h){
+	double factor = h.kc2*h.kc2*h.b*h.b*h.w*h.w/8/pi/h.costheta_i*norm(Amplitude(h.ki*h.costheta_i, h.kc2)); // Si is the specularly transmitted amplitude
+	if (transmit)
+		factor *= h.kt/h.ki;
+	return factor;
+}
+
+/**
+ * Angular kernel |So|^2*F(mu) of MRDist
+ *
+ * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+ * @param integral Compute phi-integral, multiplied by sin(theta)
+ * @param ki Incident wave number
+ * @param kt Transmitted wave number, ignored for reflection
+ * @param kc2 Squared critical wave number of potential step
+ * @param w Correlation length of surface roughness
+ * @param sintheta_i Sine of incident angle
+ * @param theta Polar angle of scattered velocity vector
+ * @param phi Azimuthal angle of scattered velocity vector, ignored if integral == true
+ */
+static double Kernel(const bool transmit, const bool integral, const double ki, const double kt, const double kc2, const double w,
+					const double sintheta_i, const double theta, const double phi){
+	double k = transmit ? kt : ki; // wave number of scattered wave
+	double costheta = cos(theta), sintheta = sin(theta);
+	if (transmit && k*k*costheta*costheta + kc2 < 0) // this can happen if Estep < 0
+		return 0;
+	double So = norm(Amplitude(k*costheta, transmit ? -kc2 : kc2)); // diffusely transmitted/reflected amplitude
+	double ai = ki*sintheta_i, ao = k*sintheta; // wave numbers parallel to surface
+
+	// fourier transform of roughness correlation function
+	if (integral) // if integral is set, precalculate phi-integral using modified Bessel function of first kind
+		return So*exp(-w*w/2*(ai*ai + ao*ao))*2*pi*alglib::besseli0(w*w*ai*ao)*sintheta; // integral over sin(theta) dtheta dphi
+	else
+		return So*exp(-w*w/2*(ai*ai + ao*ao - 2*ai*ao*cos(phi)));
+}
+
+/**
+ * Sample angle from von-Mises distribution exp(kappa*cos(phi)) with the algorithm of Best and Fisher, Appl. Statist. 28, 152 (1979)
+ *
+ * @param kappa Concentration parameter
+ * @param mc Random-number generator
+ *
+ * @return Returns angle between 0 and 2*pi
+ */
+static double VonMises(const double kappa, TMCGenerator &mc){
+	std::uniform_real_distribution<double> unidist(0, 1);
+	if (kappa < 1e-12)
+		return 2*pi*unidist(mc);
+	double tau = 1 + sqrt(1 + 4*kappa*kappa);
+	double rho = 2*kappa/(tau + sqrt(2*tau)); // equal to (tau - sqrt(2*tau))/2/kappa, but without cancellation for small kappa
+	double r = (1 + rho*rho)/2/rho;
+	double f;
+	while (true){
+		double z = cos(pi*unidist(mc));
+		f = (1 + r*z)/(r + z);
+		double c = kappa*(r - f);
+		double u = unidist(mc);
+		if (c*(2 - c) > u || log(c/u) + 1 - c >= 0)
+			break;
+	}
+	f = acos(min(max(f, -1.), 1.));
+	return unidist(mc) < 0.5 ? f : 2*pi - f;
+}
+
+
 bool MRValid(const double v[3], const double normal[3], const solid &leaving, const solid &entering){
 	double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
 	material mat;
@@ -42,57 +181,25 @@ bool MRValid(const double v[3], const double normal[3], const solid &leaving, co
 double MRDist(const bool transmit, const bool integral, const double v[3], const double normal[3], const solid &leaving, const solid &entering, const double theta, const double phi){
 	if (theta < 0 || theta > pi/2)
 		return 0;
-	double v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2]; // velocity squared
-	double vnormal = v[0]*normal[0] + v[1]*normal[1] + v[2]*normal[2]; // velocity projected onto surface normal
-	double E = 0.5*m_n*v2; // kinetic energy
-	double Estep = entering.mat.FermiReal*1e-9 - leaving.mat.FermiReal*1e-9; // potential wall
-	if (transmit && E <= Estep) // if particle is transmitted: check if energy is higher than potential wall
+	TMRHit h;
+	if (!HitParameters(transmit, v, normal, leaving, entering, h))
 		return 0;
+	double sintheta_i = sqrt(max(0., 1 - h.costheta_i*h.costheta_i));
+	return Prefactor(transmit, h)*Kernel(transmit, integral, h.ki, h.kt, h.kc2, h.w, sintheta_i, theta, phi); // return probability
+}
 
-	double ki = sqrt(2*m_n*E)*ele_e/hbar; // wave number in first solid
-	std::complex<double> kc = std::sqrt(2*(double)m_n*std::complex<double>(Estep, 0.))*(double)ele_e/(double)hbar; // critical wave number of potential wall
-	double kt = 0;
-
-	double costheta_i = abs(vnormal/sqrt(v2)); // cosine of angle between normal and incoming velocity vector
-	std::complex<double> Si = 2*costheta_i/(costheta_i + sqrt(costheta_i*costheta_i - kc*kc/ki/ki)); // specularly transmitted amplitude
-	std::complex<double> So;
-	if (transmit){
-		kt = sqrt(2*m_n*(E - Estep))*ele_e/hbar; // wave number in second solid
-		if (-real(kc*kc)/kt/kt > cos(theta)*cos(theta)) // this can happen if Estep < 0
-			return 0;
-		So = 2*cos(theta)/(cos(theta) + sqrt(cos(theta)*cos(theta) + kc*kc/kt/kt)); // diffusely transmitted amplitude
-	}
-	else
-		So = 2*cos(theta)/(cos(theta) + sqrt(cos(theta)*cos(theta) - kc*kc/ki/ki)); // diffusely reflected amplitude
-
-	double b, w;
-	if (vnormal > 0){
-		b = leaving.mat.RMSRoughness;
-		w = leaving.mat.CorrelLength;
-	}
-	else{
-		b = entering.mat.RMSRoughness;
-		w = entering.mat.CorrelLength;
-	}
-
-	double theta_i = acos(costheta_i);
-	double Fmu = 0; // fourier transform of roughness correlation function
-	if (!integral && !transmit)
-		Fmu = exp(-w*w/2*ki*ki*(sin(theta_i)*sin(theta_i) +       sin(theta)*sin(theta) -                                 2*sin(theta_i)*sin(theta)*cos(phi)));
-	else if (!integral && transmit)
-		Fmu = exp(-w*w/2*(ki*ki*sin(theta_i)*sin(theta_i) + kt*kt*sin(theta)*sin(theta) -                           2*ki*kt*sin(theta_i)*sin(theta)*cos(phi)));
-	else if (integral && !transmit) // if integral is set, precalculate phi-integral using modified Bessel function of first kind
-		Fmu = exp(-w*w/2*ki*ki*(sin(theta_i)*sin(theta_i) +       sin(theta)*sin(theta))) * 2*pi*alglib::besseli0(w*w*ki*ki*sin(theta_i)*sin(theta));
-	else if (integral && transmit)
-		Fmu = exp(-w*w/2*(ki*ki*sin(theta_i)*sin(theta_i) + kt*kt*sin(theta)*sin(theta))) * 2*pi*alglib::besseli0(w*w*ki*kt*sin(theta_i)*sin(theta));
-	double factor = real(kc*kc*kc*kc)*b*b*w*w/8/pi/costheta_i;
-	if (transmit)
-		factor *= kt/ki;
-	if (integral)
-		factor *= sin(theta); // integral over sin(theta) dtheta dphi
-	double result = factor*norm(Si)*norm(So)*Fmu;
-	//	cout << integral << transmit << ' ' << theta_i << ' ' << theta << ' ' << phi << ' ' << ki << ' ' << kt << ' ' << kc << ' ' << factor << ' ' << Si << ' ' << So << ' ' << Fmu << ' ' << result << '\n';
-	return result; // return probability
+/**
+ * Return table for the MicroRoughness parameters of a surface hit, build it if it does not exist yet
+ *
+ * @param transmit True if the particle is transmitted through the surface, false if it is reflected
+ * @param h Parameters of surface hit
+ */
+static const TMRTable& GetTable(const bool transmit, const TMRHit &h){
+	auto key = make_tuple(transmit, h.b, h.w, h.Estep);
+	auto table = tables.find(key);
+	if (table == tables.end())
+		table = tables.emplace(key, unique_ptr<TMRTable>(new TMRTable(transmit, h.b, h.w, h.Estep, tabletolerance, tablecache))).first;
+	return *table->second;
 }
 
 /**
@@ -108,8 +215,15 @@ struct TMRParams{
 };
 
 double MRProb(const bool transmit, const double v[3], const double normal[3], const solid &leaving, const solid &entering){
+	if (tabletolerance > 0){
+		TMRHit h;
+		if (!HitParameters(transmit, v, normal, leaving, entering, h))
+			return 0;
+		return GetTable(transmit, h).Prob(h.ki, h.kt, h.costheta_i);
+	}
+
 	vector<double> total(1, 0);
-	auto integrand = [transmit, v, normal, leaving, entering](const vector<double> &dummy, std::vector<double> &result, const double theta){ // use lambda expression to define local function that has the proper parameters for odeint
+	auto integrand = [transmit, v, normal, &leaving, &entering](const vector<double> &dummy, std::vector<double> &result, const double theta){ // use lambda expression to define local function that has the proper parameters for odeint
 		result[0] = MRDist(transmit, true, v, normal, leaving, entering, theta, 0);
 	};
 	boost::numeric::odeint::integrate(integrand, total, 0.0, (double)pi/2, 0.01); // integrate "differential equation" dP/dtheta = MRdist(theta) from 0 to pi/2
@@ -145,4 +259,324 @@ double MRDistMax(const bool transmit, const double v[3], const double normal[3],
 	return MRDist(transmit, false, v, normal, leaving, entering, theta[0], 0);
 }
 
+void MRSample(const bool transmit, const double v[3], const double normal[3], const solid &leaving, const solid &entering, TMCGenerator &mc, double &theta, double &phi){
+	if (tabletolerance > 0){
+		TMRHit h;
+		if (!HitParameters(transmit, v, normal, leaving, entering, h))
+			throw std::runtime_error("Tried to sample micro-roughness transmission below potential step. That should not happen!");
+		GetTable(transmit, h).Sample(h.ki, h.kt, h.costheta_i, mc, theta, phi);
+		return;
+	}
+
+	std::uniform_real_distribution<double> MRprobdist(0, 1.5 * MRDistMax(transmit, v, normal, leaving, entering)); // scale up maximum to make sure it lies above all values of scattering distribution
+	std::uniform_real_distribution<double> phidist(0, 2.*pi);
+	std::sin_distribution<double> sindist(0, pi/2.);
+	do{
+		phi = phidist(mc);
+		theta = sindist(mc);
+	}while (MRprobdist(mc) > MRDist(transmit, false, v, normal, leaving, entering, theta, phi));
+}
+
+void SetTableOptions(const double tolerance, const boost::filesystem::path &cachedir){
+	tabletolerance = tolerance;
+	tablecache = cachedir;
+	tables.clear();
+}
+
+
+TMRTable::TMRTable(const bool atransmit, const double ab, const double aw, const double aEstep, const double tolerance, const boost::filesystem::path &cachedir)
+		: transmit(atransmit), b(ab), w(aw), Estep(aEstep), nk(0), nsplit(0), ns(0), ntheta(0){
+	kc2 = 2*m_n*Estep*ele_e*ele_e/hbar/hbar;
+	kmax = 0.5/b; // model is only valid if 2*b*k < 1
+	kmin = transmit ? sqrt(max(0., -kc2)) : 0; // transmitted wave number can not be smaller than critical wave number if potential decreases
+	if (kmin >= kmax) // model is never valid for this combination, table will not be used
+		kmin = 0;
+	// scattered amplitude So has a branch point where k*cos(theta) = sqrt(|kc2|), which makes the kernel behave like (k - ksplit)^(3/2) above it
+	ksplit = kmin;
+	branch = transmit ? kmin > 0 : kc2 > 0 && sqrt(kc2) < kmax;
+	if (!transmit && branch)
+		ksplit = sqrt(kc2);
+
+	boost::filesystem::path cachefile;
+	if (!cachedir.empty()){
+		double params[5] = {static_cast<double>(transmit), b, w, Estep, tolerance};
+		cachefile = cachedir / (boost::format("%016x.mrtable") % FNV1a(params, sizeof(params))).str();
+		if (Read(cachefile, tolerance)){
+			std::cout << "Read micro-roughness " << (transmit ? "transmission" : "reflection") << " table from " << cachefile << "\n";
+			return;
+		}
+	}
+
+	std::cout << "Building micro-roughness " << (transmit ? "transmission" : "reflection") << " table for b = " << b << "m, w = " << w << "m, potential step "
+			<< Estep*1e9 << "neV ... ";
+	std::cout.flush();
+	unsigned ank = 8, ans = 8, antheta = 32;
+	double interror, errk, errs;
+	while (true){
+		Build(ank, ans, antheta);
+		interror = IntegrationError();
+		InterpolationError(errk, errs);
+		// integration error and interpolation errors in both directions add up, each of them may use a third of the tolerance
+		bool refinek = errk > tolerance/3;
+		bool refines = errs > tolerance/3;
+		bool refinetheta = interror > tolerance/3;
+		if (!refinek && !refines && !refinetheta)
+			break;
+		ank <<= refinek;
+		ans <<= refines;
+		antheta <<= refinetheta;
+		if ((ank + 1)*(ans + 1)*(antheta + 1) > MRTABLE_MAX_SIZE) // stop refining if table becomes too large
+			break;
+	}
+	std::cout << nk << "x" << ns << "x" << ntheta << " grid intervals\n";
+	if (interror + errk + errs > tolerance)
+		std::cout << "Could not reach requested accuracy " << tolerance << " with largest table, integration error " << interror << ", interpolation error " << errk + errs << "\n";
+
+	if (!cachefile.empty()){
+		Write(cachefile, tolerance);
+		std::cout << "Wrote micro-roughness table to " << cachefile << "\n";
+	}
+}
+
+
+double TMRTable::GridPoint(const unsigned i) const{
+	if (i < nsplit)
+		return kmin + i*(ksplit - kmin)/nsplit;
+	double t = double(i - nsplit)/(nk - nsplit);
+	if (branch) // kernel is smooth in sqrt(k - ksplit)
+		t *= t;
+	return ksplit + t*(kmax - ksplit);
+}
+
+
+double TMRTable::ThetaMax(const double k) const{
+	if (transmit && kc2 < 0) // transmitted wave is evanescent if k^2*cos(theta)^2 < -kc2
+		return k > 0 ? acos(min(sqrt(-kc2)/k, 1.))*(1 - 1e-12) : 0; // stay inside the cutoff despite rounding errors
+	return pi/2;
+}
+
+
+void TMRTable::Kernel(const double k, const double sintheta_i, double &h, double f[], double F[]) const{
+	double ki = transmit ? sqrt(max(0., k*k + kc2)) : k;
+	double thetamax = ThetaMax(k);
+	h = thetamax/ntheta;
+	F[0] = 0;
+	for (unsigned i = 0; i <= ntheta; ++i){
+		f[i] = MR::Kernel(transmit, true, ki, k, kc2, w, sintheta_i, min(i*h, thetamax), 0);
+		if (i > 0)
+			F[i] = F[i - 1] + 0.5*h*(f[i - 1] + f[i]); // trapezoidal rule is exact for piecewise-linear kernel
+	}
+}
+
+
+double TMRTable::CDF(const unsigned n, const double x) const{
+	const double *f = &pdf[n*(ntheta + 1)], *F = &cdf[n*(ntheta + 1)];
+	if (x >= 1)
+		return F[ntheta];
+	unsigned i = static_cast<unsigned>(x*ntheta);
+	double h = dtheta[n], t = (x*ntheta - i)*h;
+	return F[i] + f[i]*t + (h > 0 ? 0.5*(f[i + 1] - f[i])/h*t*t : 0);
+}
+
+
+void TMRTable::Build(const unsigned ank, const unsigned ans, const unsigned antheta){
+	nk = ank;
+	ns = ans;
+	ntheta = antheta;
+	nsplit = 0;
+	if (ksplit > kmin) // split nodes in proportion to length of both sides of ksplit, but make sure both sides contain at least one interval
+		nsplit = min(max(static_cast<unsigned>(round(nk*(ksplit - kmin)/(kmax - kmin))), 1u), nk - 1);
+	dtheta.resize((nk + 1)*(ns + 1));
+	pdf.resize(dtheta.size()*(ntheta + 1));
+	cdf.resize(pdf.size());
+	for (unsigned i = 0; i <= nk; ++i){
+		for (unsigned j = 0; j <= ns; ++j){
+			unsigned n = i*(ns + 1) + j;
+			Kernel(GridPoint(i), double(j)/ns, dtheta[n], &pdf[n*(ntheta + 1)], &cdf[n*(ntheta + 1)]);
+		}
+	}
+}
+
+
+double TMRTable::IntegrationError() const{
+	double Fmax = 0, error = 0;
+	for (unsigned n = 0; n < dtheta.size(); ++n){
+		const double *f = &pdf[n*(ntheta + 1)], *F = &cdf[n*(ntheta + 1)];
+		Fmax = max(Fmax, F[ntheta]);
+		double Fhalf = 0;
+		for (unsigned i = 2; i <= ntheta; i += 2){
+			Fhalf += dtheta[n]*(f[i - 2] + f[i]); // integration using every other grid point
+			error = max(error, abs(F[i] - Fhalf)/3); // Richardson estimate of error of trapezoidal rule
+		}
+	}
+	return Fmax > 0 ? error/Fmax : 0;
+}
+
+
+void TMRTable::InterpolationError(double &errk, double &errs) const{
+	vector<double> f(ntheta + 1), F(ntheta + 1);
+	double Fmax = 0;
+	for (unsigned n = 0; n < dtheta.size(); ++n)
+		Fmax = max(Fmax, cdf[n*(ntheta + 1) + ntheta]);
+	errk = 0;
+	errs = 0;
+	for (unsigned i = 0; i <= 2*nk; ++i){
+		for (unsigned j = 0; j <= 2*ns; ++j){
+			if (i % 2 == j % 2) // only check points halfway between two nodes
+				continue;
+			double k = 0.5*(GridPoint(i/2) + GridPoint((i + 1)/2)), sintheta_i = 0.5*j/ns, h;
+			Kernel(k, sintheta_i, h, &f[0], &F[0]);
+			unsigned nodes[4];
+			double weights[4];
+			Cell(k, sintheta_i, nodes, weights);
+			double &error = i % 2 == 1 ? errk : errs;
+			for (unsigned m = 0; m <= ntheta; ++m){
+				double interpolated = 0;
+				for (int c = 0; c < 4; ++c)
+					interpolated += weights[c]*CDF(nodes[c], double(m)/ntheta);
+				error = max(error, abs(interpolated - F[m]));
+			}
+		}
+	}
+	if (Fmax > 0){
+		errk /= Fmax;
+		errs /= Fmax;
+	}
+}
+
+
+void TMRTable::Cell(const double k, const double sintheta_i, unsigned nodes[4], double weights[4]) const{
+	double x;
+	if (k < ksplit && nsplit > 0)
+		x = (k - kmin)/(ksplit - kmin)*nsplit;
+	else if (branch)
+		x = nsplit + sqrt(max(0., (k - ksplit)/(kmax - ksplit)))*(nk - nsplit);
+	else
+		x = nsplit + (k - ksplit)/(kmax - ksplit)*(nk - nsplit);
+	double y = sintheta_i*ns;
+	unsigned i = static_cast<unsigned>(min(max(floor(x), 0.), nk - 1.)); // extrapolate with first or last cell
+	unsigned j = static_cast<unsigned>(min(max(floor(y), 0.), ns - 1.));
+	double a = min(max(x - i, 0.), 1.), c = min(max(y - j, 0.), 1.); // relative position in cell, 0..1
+	nodes[0] = i*(ns + 1) + j;
+	nodes[1] = nodes[0] + 1;
+	nodes[2] = nodes[0] + ns + 1;
+	nodes[3] = nodes[2] + 1;
+	weights[0] = (1 - a)*(1 - c);
+	weights[1] = (1 - a)*c;
+	weights[2] = a*(1 - c);
+	weights[3] = a*c;
+}
+
+
+double TMRTable::Prob(const double ki, const double kt, const double costheta_i) const{
+	unsigned nodes[4];
+	double weights[4];
+	Cell(transmit ? kt : ki, sqrt(max(0., 1 - costheta_i*costheta_i)), nodes, weights);
+	double total = 0;
+	for (int c = 0; c < 4; ++c)
+		total += weights[c]*cdf[nodes[c]*(ntheta + 1) + ntheta];
+	TMRHit h = {b, w, Estep, kc2, ki, kt, costheta_i};
+	return Prefactor(transmit, h)*total;
+}
+
+
+void TMRTable::Sample(const double ki, const double kt, const double costheta_i, TMCGenerator &mc, double &theta, double &phi) const{
+	double sintheta_i = sqrt(max(0., 1 - costheta_i*costheta_i));
+	double k = transmit ? kt : ki;
+	unsigned nodes[4];
+	double weights[4];
+	Cell(k, sintheta_i, nodes, weights);
+	double total = 0;
+	for (int c = 0; c < 4; ++c){
+		weights[c] *= cdf[nodes[c]*(ntheta + 1) + ntheta]; // interpolated distribution is the mixture of node distributions weighted by their contribution to the total probability
+		total += weights[c];
+	}
+	if (total <= 0)
+		throw std::runtime_error("Tried to sample micro-roughness distribution with zero probability. That should not happen!");
+
+	std::uniform_real_distribution<double> unidist(0, 1);
+	double u = unidist(mc)*total;
+	int c;
+	for (c = 0; c < 3 && u >= weights[c]; ++c)
+		u -= weights[c];
+	while (weights[c] == 0) // rounding errors can leave u beyond the last node contributing to the distribution
+		--c;
+
+	// invert cumulative distribution of chosen node, kernel is linear between theta grid points
+	const double *f = &pdf[nodes[c]*(ntheta + 1)], *F = &cdf[nodes[c]*(ntheta + 1)];
+	double h = dtheta[nodes[c]];
+	double Fu = unidist(mc)*F[ntheta];
+	unsigned i = std::upper_bound(F, F + ntheta + 1, Fu) - F;
+	i = min(max(i, 1u), ntheta) - 1; // F[i] <= Fu < F[i + 1]
+	double d = Fu - F[i], slope = (f[i + 1] - f[i])/h;
+	double root = sqrt(max(0., f[i]*f[i] + 2*slope*d));
+	double t = f[i] + root > 0 ? 2*d/(f[i] + root) : 0; // solve f[i]*t + slope*t^2/2 = d
+	theta = (i + min(t/h, 1.))/ntheta*ThetaMax(k); // scale with cutoff at actual wave number
+
+	phi = VonMises(w*w*ki*sintheta_i*(transmit ? kt : ki)*sin(theta), mc);
+}
+
+
+bool TMRTable::Read(const boost::filesystem::path &filename, const double tolerance){
+	std::ifstream f(filename.native(), std::fstream::binary);
+	if (!f.is_open())
+		return false;
+
+	char magic[sizeof(MRTABLE_MAGIC)];
+	double params[5];
+	unsigned dims[4];
+	f.read(magic, sizeof(magic));
+	f.read((char*)params, sizeof(params));
+	f.read((char*)dims, sizeof(dims));
+	if (!f || std::memcmp(magic, MRTABLE_MAGIC, sizeof(magic)) != 0 || params[0] != transmit || params[1] != b || params[2] != w || params[3] != Estep || params[4] != tolerance){
+		std::cout << "Micro-roughness table in " << filename << " does not match material, rebuilding it\n";
+		return false;
+	}
+
+	uint64_t nodes = (static_cast<uint64_t>(dims[0]) + 1)*(static_cast<uint64_t>(dims[2]) + 1);
+	uint64_t values = nodes*(static_cast<uint64_t>(dims[3]) + 1);
+	uint64_t headersize = sizeof(magic) + sizeof(params) + sizeof(dims);
+	if (dims[1] > dims[0] || values > MRTABLE_MAX_SIZE || boost::filesystem::file_size(filename) != headersize + (nodes + 2*values)*sizeof(double)){ // check size before allocating memory for table
+		std::cout << "Micro-roughness table in " << filename << " is incomplete, rebuilding it\n";
+		return false;
+	}
+
+	nk = dims[0];
+	nsplit = dims[1];
+	ns = dims[2];
+	ntheta = dims[3];
+	dtheta.resize((nk + 1)*(ns + 1));
+	pdf.resize(dtheta.size()*(ntheta + 1));
+	cdf.resize(pdf.size());
+	f.read((char*)dtheta.data(), dtheta.size()*sizeof(double));
+	f.read((char*)pdf.data(), pdf.size()*sizeof(double));
+	f.read((char*)cdf.data(), cdf.size()*sizeof(double));
+	if (!f){
+		std::cout << "Micro-roughness table in " << filename << " is incomplete, rebuilding it\n";
+		return false;
+	}
+	return true;
+}
+
+
+void TMRTable::Write(const boost::filesystem::path &filename, const double tolerance) const{
+	boost::filesystem::path tmpfile = filename.parent_path() / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+	std::ofstream f(tmpfile.native(), std::fstream::binary);
+	if (!f.is_open())
+		throw std::runtime_error( (boost::format("Could not create %1%") % tmpfile.native()).str() );
+
+	double params[5] = {static_cast<double>(transmit), b, w, Estep, tolerance};
+	unsigned dims[4] = {nk, nsplit, ns, ntheta};
+	f.write(MRTABLE_MAGIC, sizeof(MRTABLE_MAGIC));
+	f.write((const char*)params, sizeof(params));
+	f.write((const char*)dims, sizeof(dims));
+	f.write((const char*)dtheta.data(), dtheta.size()*sizeof(double));
+	f.write((const char*)pdf.data(), pdf.size()*sizeof(double));
+	f.write((const char*)cdf.data(), cdf.size()*sizeof(double));
+	f.close();
+	if (!f)
+		throw std::runtime_error( (boost::format("Could not write micro-roughness table to %1%") % tmpfile.native()).str() );
+	boost::filesystem::rename(tmpfile, filename);
+}
+
 }
@@ -8,8 +8,6 @@
 #include "proton.h"
 #include "electron.h"
 
-#include <valarray>
-
 using namespace std;
 
 const char* NAME_NEUTRON = "neutron";
@@ -46,13 +44,7 @@ void TNeutron::TransmitMR(const value_type x1, const state_type &y1, value_type
 	}
 	
 	double theta_t, phi_t;
-	std::uniform_real_distribution<double> MRprobdist(0, 1.5 * MR::MRDistMax(true, &y1[3], normal, leaving, entering)); // scale up maximum to make sure it lies above all values of scattering distribution
-	std::uniform_real_distribution<double> phidist(0, 2.*pi);
-	std::sin_distribution<double> sindist(0, pi/2.);
-	do{
-		phi_t = phidist(mc);
-		theta_t = sindist(mc);
-	}while (MRprobdist(mc) > MR::MRDist(true, false, &y1[3], normal, leaving, entering, theta_t, phi_t));
+	MR::MRSample(true, &y1[3], normal, leaving, entering, mc, theta_t, phi_t);
 
 	double Estep = CalcPotentialStep(leaving.mat, entering.mat, y1);
 	double vabs = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5] - 2*Estep/m_n);
@@ -68,36 +60,22 @@ void TNeutron::TransmitMR(const value_type x1, const state_type &y1, value_type
 void TNeutron::TransmitLambert(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 		const double normal[3], const solid &leaving, const solid &entering, TMCGenerator &mc) const{
 	double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
-    material mat = leaving.mat;
-    std::valarray<double> n(normal, 3);
-    if (vnormal < 0){
-        mat = entering.mat;
-        vnormal *= -1;
-        n *= -1;
-    }
-	double Enormal = 0.5*m_n*vnormal*vnormal; // energy normal to reflection plane
-	double k1 = sqrt(Enormal); // wavenumber in first solid (use only real part for transmission!)
-	double k2 = sqrt(Enormal - CalcPotentialStep(leaving.mat, entering.mat, y2)); // wavenumber in second solid (use only real part for transmission!)
-	std::valarray<double> specular_trans(&y2[3], 3);
-	specular_trans += (k2/k1 - 1)*n*vnormal;
-
-	double theta_t, phi_t;
-
-	double vabs = std::sqrt((specular_trans*specular_trans).sum());
-	do {
-        std::uniform_real_distribution<double> unidist(0, 2.*pi);
-        phi_t = unidist(mc);
-        std::sincos_distribution<double> sincosdist(0, pi/2.);
-        theta_t = sincosdist(mc);
-        y2[3] = vabs * cos(phi_t) * sin(theta_t);    // new velocity with respect to z-axis
-        y2[4] = vabs * sin(phi_t) * sin(theta_t);
-        y2[5] = vabs * cos(theta_t);
-        if (mat.DiffProb > 0) {
-            RotateVector(&y2[3], &n[0], &y1[3]); // rotate velocity into coordinate system defined by incoming velocity and plane normal
-        } else {
-            RotateVector(&y2[3], &specular_trans[0], &y1[3]);
-        }
-    }while(y2[3]*n[0] + y2[4]*n[1] + y2[5]*n[2] <= 0); // resample until velocity points into correct hemisphere
+	const material &mat = vnormal < 0 ? entering.mat : leaving.mat;
+	double n[3] = {normal[0], normal[1], normal[2]};
+	if (vnormal < 0){ // let n point in direction of travel
+		vnormal *= -1;
+		for (int i = 0; i < 3; ++i)
+			n[i] *= -1;
+	}
+	double Estep = CalcPotentialStep(leaving.mat, entering.mat, y2);
+	double vabs = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5] - 2*Estep/m_n); // velocity in second solid, kinetic energy reduced by potential step
+	double axis[3] = {n[0], n[1], n[2]};
+	if (mat.DiffProb == 0){ // if DiffProb == 0 use modified Lambert model, scatter around specularly transmitted velocity vector
+		double vtrans = sqrt(vnormal*vnormal - 2*Estep/m_n); // refracted normal velocity
+		for (int i = 0; i < 3; ++i)
+			axis[i] = y1[i + 3] + (vtrans - vnormal)*n[i];
+	}
+	LambertScatter(axis, n, vabs, mc, &y2[3]);
 }
 
 void TNeutron::Reflect(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
@@ -128,14 +106,7 @@ void TNeutron::ReflectMR(const value_type x1, const state_type &y1, value_type &
 	}
 
 	double phi_r, theta_r;
-	std::uniform_real_distribution<double> MRprobdist(0, 1.5 * MR::MRDistMax(true, &y1[3], normal, leaving, entering)); // scale up maximum to make sure it lies above all values of scattering distribution
-//			cout << "max: " << MRmax << '\n';
-	std::uniform_real_distribution<double> unidist(0, 2.*pi);
-	std::sin_distribution<double> sindist(0, pi/2.);
-	do{
-		phi_r = unidist(mc);
-		theta_r = sindist(mc);
-	}while (MRprobdist(mc) > MR::MRDist(false, false, &y1[3], normal, leaving, entering, theta_r, phi_r));
+	MR::MRSample(false, &y1[3], normal, leaving, entering, mc, theta_r, phi_r);
 
 	if (vnormal > 0) theta_r = pi - theta_r; // if velocity points out of volume invert polar angle
 	x2 = x1;
@@ -155,12 +126,12 @@ void TNeutron::ReflectMR(const value_type x1, const state_type &y1, value_type &
 void TNeutron::ReflectLambert(const value_type x1, const state_type &y1, value_type &x2, state_type &y2,
 		const double normal[3], const solid &leaving, const solid &entering, TMCGenerator &mc) const{
 	double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
-	material mat = entering.mat;
-	std::valarray<double> n(normal, 3);
-	if (vnormal > 0){
-	    mat = leaving.mat;
-	    vnormal *= -1;
-	    n *= -1;
+	const material &mat = vnormal > 0 ? leaving.mat : entering.mat;
+	double n[3] = {normal[0], normal[1], normal[2]};
+	if (vnormal > 0){ // let n point against direction of travel
+		vnormal *= -1;
+		for (int i = 0; i < 3; ++i)
+			n[i] *= -1;
 	}
 
 	x2 = x1;
@@ -168,33 +139,45 @@ void TNeutron::ReflectLambert(const value_type x1, const state_type &y1, value_t
 	y2[1] = y1[1];
 	y2[2] = y1[2];
 	double vabs = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
-	do {
-        std::uniform_real_distribution<double> unidist(0, 2.*pi);
-        double phi_r = unidist(mc);
-        std::sincos_distribution<double> sincosdist(0, pi/2.);
-        double theta_r = sincosdist(mc);
-
-        y2[3] = vabs * cos(phi_r) * sin(theta_r);    // new velocity with respect to z-axis
-        y2[4] = vabs * sin(phi_r) * sin(theta_r);
-        y2[5] = vabs * cos(theta_r);
-        if (mat.DiffProb > 0) {
-            RotateVector(&y2[3], &n[0], &y1[3]); // rotate velocity into coordinate system defined by incoming velocity and plane normal
-        } else { // if DiffProb == 0 use modified Lambert model
-            std::valarray<double> specular_refl(&y1[3],3);
-            specular_refl -= 2*vnormal*n;
-            RotateVector(&y2[3], &specular_refl[0], &y1[3]); // rotate velocity into coordinate system defined by specularly reflected velocity vector
-        }
-    }while(y2[3]*n[0] + y2[4]*n[1] + y2[5]*n[2] <= 0); // resample until velocity points into correct reflection hemisphere
+	double axis[3] = {n[0], n[1], n[2]};
+	if (mat.DiffProb == 0){ // if DiffProb == 0 use modified Lambert model, scatter around specularly reflected velocity vector
+		for (int i = 0; i < 3; ++i)
+			axis[i] = y1[i + 3] - 2*vnormal*n[i];
+	}
+	LambertScatter(axis, n, vabs, mc, &y2[3]);
 	y2[6] = y1[6];
 	y2[8] = y1[8];
 }
 
+void TNeutron::LambertScatter(const double axis[3], const double n[3], const double vabs, TMCGenerator &mc, double v[3]) const{
+	double axisabs = sqrt(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+	double a = max(0., min(1., (axis[0]*n[0] + axis[1]*n[1] + axis[2]*n[2])/axisabs)); // cosine of angle between axis and n
+
+	// A cosine distribution around the axis is the projection of a uniform distribution on the unit disk perpendicular to the axis onto the unit hemisphere.
+	// In a frame with z along the axis and n = (sqrt(1 - a^2), 0, a), the projected direction points into the hemisphere around n
+	// if x >= 0 or x^2/a^2 + y^2 < 1, so the allowed part of the disk is the half disk x >= 0 plus a half ellipse with semi-axes a and 1.
+	// Both halves are sampled directly, weighted by their areas.
+	uniform_real_distribution<double> unidist(0, 1);
+	bool ellipse = unidist(mc)*(1 + a) < a;
+	double r = sqrt(unidist(mc));
+	double phi = pi*(unidist(mc) - 0.5);
+	v[0] = r*cos(phi);
+	v[1] = r*sin(phi);
+	if (ellipse)
+		v[0] *= -a;
+	double z = sqrt(max(0., 1 - v[0]*v[0] - v[1]*v[1]));
+	v[0] *= vabs;
+	v[1] *= vabs;
+	v[2] = vabs*z;
+	RotateVector(v, axis, n); // rotate into frame with z axis along axis and x axis along projection of n
+}
+
 void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const double normal[3],
-		const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
+		const solid &leaving, const solid &entering, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const{
 
     double vnormal = y1[3]*normal[0] + y1[4]*normal[1] + y1[5]*normal[2]; // velocity normal to reflection plane
     double Enormal = 0.5*m_n*vnormal*vnormal; // energy normal to reflection plane
-    material mat = vnormal < 0 ? entering.mat : leaving.mat; // use material properties of the solid whose surface was hit
+    const material &mat = vnormal < 0 ? entering.mat : leaving.mat; // use material properties of the solid whose surface was hit
 
     std::uniform_real_distribution<double> unidist(0, 1);
     if (unidist(mc) < mat.SpinflipProb){ // should spin be flipped?
@@ -212,7 +195,30 @@ void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2,
 		if (GetKineticEnergy(&y1[3]) > Estep) // MicroRoughness transmission can happen if neutron energy > potential step
 			MRtransprob = MR::MRProb(true, &y1[3], normal, leaving, entering);
 	}
+
+	complex<double> k1 = sqrt(complex<double>(Enormal, -leaving.mat.FermiImag*1e-9)); // wavenumber in first solid
+	complex<double> k2 = sqrt(complex<double>(Enormal - Estep, -entering.mat.FermiImag*1e-9)); // wavenumber in second solid
+	double reflprob = norm((k1 - k2)/(k1 + k2)); // specular reflection probability
+	double absprob = 0;
+	if (Enormal <= Estep){ // absorption can only happen on total reflection
+		absprob = 1 - reflprob + mat.LossPerBounce; // absorption probability during total reflection, add loss per bounce
+		if (UseMRModel){
+			double kc = sqrt(2*m_n*Estep)*ele_e/hbar;
+			double addtrans = 2*pow(entering.mat.RMSRoughness, 2)*kc*kc/(1 + 0.85*kc*entering.mat.CorrelLength + 2*kc*kc*pow(entering.mat.CorrelLength, 2));
+			absprob *= sqrt(1 + addtrans); // second order correction for reflection on MicroRoughness surfaces
+		}
+		absprob *= 1 - MRreflprob - MRtransprob; // scale down absprob so MRreflprob + MRtransprob + absprob + reflprob = 1
+	}
+//	cout << " ReflProb = " << reflprob << '\n';
+
 	double prob = unidist(mc);
+	if (weight && absprob < 1){ // implicit absorption: reduce weight by absorption probability and choose from remaining outcomes
+		*weight *= 1 - absprob;
+		prob *= 1 - absprob;
+		if (prob >= MRreflprob + MRtransprob)
+			prob += absprob; // skip interval corresponding to absorption
+	}
+
 	if (UseMRModel && prob < MRreflprob){
 		ReflectMR(x1, y1, x2, y2, normal, leaving, entering, mc);
 	}
@@ -221,9 +227,6 @@ void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2,
 	}
 
 	else{
-		complex<double> k1 = sqrt(complex<double>(Enormal, -leaving.mat.FermiImag*1e-9)); // wavenumber in first solid
-		complex<double> k2 = sqrt(complex<double>(Enormal - Estep, -entering.mat.FermiImag*1e-9)); // wavenumber in second solid
-		double reflprob = norm((k1 - k2)/(k1 + k2)); // specular reflection probability
 		if (Enormal > Estep){ // transmission only possible if Enormal > Estep
 			if (prob < MRreflprob + MRtransprob + reflprob*(1 - MRreflprob - MRtransprob)){ // reflection, scale down reflprob so MRreflprob + MRtransprob + reflprob + transprob = 1
 				if (!UseMRModel && unidist(mc) < mat.DiffProb + mat.ModifiedLambertProb){
@@ -243,16 +246,7 @@ void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2,
 			}
 		}
 		else{ // total reflection (Enormal < Estep)
-			double absprob = 1 - reflprob + mat.LossPerBounce; // absorption probability during total reflection, add loss per bounce
-
-			if (UseMRModel){
-				double kc = sqrt(2*m_n*Estep)*ele_e/hbar;
-				double addtrans = 2*pow(entering.mat.RMSRoughness, 2)*kc*kc/(1 + 0.85*kc*entering.mat.CorrelLength + 2*kc*kc*pow(entering.mat.CorrelLength, 2));
-				absprob *= sqrt(1 + addtrans); // second order correction for reflection on MicroRoughness surfaces
-			}
-	//			cout << " ReflProb = " << reflprob << '\n';
-
-			if (prob < MRreflprob + MRtransprob + absprob*(1 - MRreflprob - MRtransprob)){ // -> absorption on reflection, scale down absprob so MRreflprob + MRtransprob + absprob + reflprob = 1
+			if (prob < MRreflprob + MRtransprob + absprob){ // -> absorption on reflection
 				ID = ID_ABSORBED_ON_SURFACE;
 			}
 			else{ // no absorption -> reflection
@@ -270,11 +264,15 @@ void TNeutron::OnHit(const value_type x1, const state_type &y1, value_type &x2,
 
 
 void TNeutron::OnStep(const value_type x1, const state_type &y1, value_type &x2, state_type &y2, const dense_stepper_type &stepper,
-					const solid &currentsolid, TMCGenerator &mc, stopID &ID, std::vector<TParticle*> &secondaries) const{
+					const solid &currentsolid, TMCGenerator &mc, stopID &ID, double *weight, std::vector<TParticle*> &secondaries) const{
 	if (currentsolid.mat.FermiImag > 0){
 		complex<double> E(0.5*(double)m_n*(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]), currentsolid.mat.FermiImag*1e-9); // E + i*W
 		complex<double> k = sqrt(2*(double)m_n*E)*(double)ele_e/(double)hbar; // wave vector
 		double l = sqrt(pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2)); // travelled length
+		if (weight){ // implicit absorption: reduce weight by survival probability instead of stopping particle
+			*weight *= exp(-2*imag(k)*l);
+			return;
+		}
 		std::exponential_distribution<double> expdist(2*imag(k));
 		double abspath = expdist(mc);
 		if (abspath < l){
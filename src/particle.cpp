@@ -11,9 +11,15 @@
 #include <boost/math/tools/roots.hpp>
 
 #include "particle.h"
+#include "adiabacity.h"
 
 using namespace std;
 
+// double-precision copies of physical constants, keeps long-double arithmetic out of the equations of motion
+static const double c_0_sq = c_0*c_0;
+static const double ele_e_d = ele_e;
+static const double gravconst_d = gravconst;
+
 double TParticle::GetInitialTotalEnergy(const TGeometry &geom, const TFieldManager &field) const{
 	return GetKineticEnergy(&ystart[3]) + GetPotentialEnergy(tstart, ystart, field, geom.GetSolid(tstart, &ystart[0]));
 }
@@ -33,11 +39,11 @@ double TParticle::GetFinalKineticEnergy() const{
 	return GetKineticEnergy(&yend[3]);
 }
 
-TParticle::TParticle(const char *aname, const  double qq, const long double mm, const long double mumu, const long double agamma, const int number,
+TParticle::TParticle(const char *aname, const double qq, const double mm, const double mumu, const double agamma, const int number,
 		const double t, const double x, const double y, const double z, const double E, const double phi, const double theta, const double polarisation,
 		TMCGenerator &amc, const TGeometry &geometry, const TFieldManager &afield)
 		: name(aname), q(qq), m(mm), mu(mumu), gamma(agamma), particlenumber(number), ID(ID_UNKNOWN),
-		  tstart(t), tend(t), Hmax(0), Nhit(0), Nspinflip(0), noflipprob(1), Nstep(0){
+		  tstart(t), tend(t), Hmax(0), Nhit(0), Nspinflip(0), noflipprob(1), Tspin(0), Nstep(0), weight(1){
 
 	// for small velocities Ekin/m is very small and the relativstic claculation beta^2 = 1 - 1/gamma^2 gives large round-off errors
 	// the round-off error can be estimated as 2*epsilon
@@ -54,7 +60,7 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 	if (polarisation < -1 || polarisation > 1)
 		throw std::runtime_error("Polarisation has to be between -1 and 1");
 
-	ystart.resize(STATE_VARIABLES, 0);
+	ystart.fill(0);
 	ystart[0] = x; // position
 	ystart[1] = y;
 	ystart[2] = z;
@@ -67,7 +73,7 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 	ystart[8] = 0;
 	yend = ystart;
 
-	spinstart.resize(SPIN_STATE_VARIABLES, 0);
+	spinstart.fill(0);
 
 	double B[3];
 	afield.BField(x, y, z, t, B);
@@ -87,7 +93,7 @@ TParticle::TParticle(const char *aname, const  double qq, const long double mm,
 	spinend = spinstart;
 
 	currentsolids = geometry.GetSolids(t, &ystart[0]); // detect solids that surround the particle
-	solidend = solidstart = GetCurrentsolid(); // set to solid with highest priority
+	solidend = solidstart = &GetCurrentsolid(); // set to solid with highest priority
 }
 
 
@@ -98,176 +104,339 @@ TParticle::~TParticle(){
 
 
 void TParticle::Integrate(double tmax, std::map<std::string, std::string> &particleconf, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
-	double tau = 0;
-	istringstream(particleconf["tau"]) >> tau;
-	if (tau > 0){
-		std::exponential_distribution<double> expdist(1./tau);
-		tau = expdist(mc);
+	std::unique_ptr<dense_stepper_type> stepper = CreateStepper(particleconf, field);
+	StartIntegration(tmax, particleconf, mc, geom, field, *stepper);
+
+//	progress_display progress(100, std::cout, ' ' + std::to_string(particlenumber) + ' ');
+
+	while (ID == ID_UNKNOWN){ // integrate as long as nothing happened to particle
+		PrepareStep();
+		bool stepped = true;
+		try{
+			stepper->do_step();
+		}
+		catch(...){ // catch Exceptions thrown by numerical recipes routines
+			stepped = false;
+		}
+		FinishStep(stepped, mc, geom, field);
+	}
+
+//	cout << "Done" << endl;
+
+	StopIntegration(mc, geom, field);
+}
+
+
+void TParticle::IntegrateBatch(const unsigned batchsize, const double tmax, TConfig &conf, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field,
+		const std::function<TParticle*()> &next, const std::function<void(TParticle*)> &finish){
+	std::vector<TParticle*> particles(batchsize, nullptr);
+	std::vector<unsigned> fieldlanes;
+	fieldlanes.reserve(batchsize);
+	std::unique_ptr<double[][4]> p(new double[batchsize][4]);
+	std::unique_ptr<double[][3]> B(new double[batchsize][3]), E(new double[batchsize][3]);
+	std::unique_ptr<double[][3][3]> dBidxj(new double[batchsize][3][3]);
+	std::unique_ptr<double[]> V(new double[batchsize]);
+	std::unique_ptr<TFieldCache*[]> caches(new TFieldCache*[batchsize]);
+
+	// evaluate fields for all lanes at once, then the equations of motion of each lane
+	auto system = [&](const std::vector<unsigned> &lanes, const std::vector<value_type> &x, const TBatchStepper::batch_state_type &y, TBatchStepper::batch_state_type &dydx){
+		fieldlanes.clear();
+		bool charged = false;
+		for (auto i: lanes){
+			if (particles[i]->q != 0 || (particles[i]->mu != 0 && y[7][i] != 0)){ // same criterion as in TParticle::derivs
+				unsigned k = fieldlanes.size();
+				p[k][0] = y[0][i];
+				p[k][1] = y[1][i];
+				p[k][2] = y[2][i];
+				p[k][3] = x[i];
+				caches[k] = &particles[i]->fieldcache; // fields at step end points are reused by energy bookkeeping and spin tracking
+				fieldlanes.push_back(i);
+				charged |= particles[i]->q != 0;
+			}
+		}
+		if (!fieldlanes.empty())
+			field.Fields(fieldlanes.size(), p.get(), B.get(), dBidxj.get(), charged ? V.get() : nullptr, charged ? E.get() : nullptr, caches.get()); // electric field only needed by charged particles
+
+		unsigned k = 0;
+		for (auto i: lanes){
+			double zero[3] = {0, 0, 0}, zerograd[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+			bool hasfields = k < fieldlanes.size() && fieldlanes[k] == i;
+			state_type yi, dydxi;
+			for (int j = 0; j < STATE_VARIABLES; ++j)
+				yi[j] = y[j][i];
+			particles[i]->EquationOfMotion(yi, dydxi, x[i], hasfields ? B[k] : zero, hasfields ? dBidxj[k] : zerograd, hasfields && charged ? E[k] : zero);
+			for (int j = 0; j < STATE_VARIABLES; ++j)
+				dydx[j][i] = dydxi[j];
+			if (hasfields)
+				++k;
+		}
+	};
+	TBatchStepper batch(batchsize, system);
+
+	// put next particle into lane i
+	auto fill = [&](const unsigned i){
+		particles[i] = next();
+		if (particles[i] == nullptr)
+			return;
+		std::map<std::string, std::string> &particleconf = conf[particles[i]->GetName()];
+		std::string type;
+		double abserr, relerr, maxadiabaticity;
+		bool ballistic;
+		particles[i]->StepperOptions(particleconf, type, abserr, relerr, maxadiabaticity, ballistic);
+		if (type != "dopri5" || ballistic || (maxadiabaticity > 0 && particles[i]->q != 0))
+			throw std::runtime_error("Integration in batches requires the stepper dopri5 without ballistic propagation or guiding-centre approximation for " + particles[i]->GetName() + "!");
+		batch.set_tolerances(i, abserr, relerr);
+		particles[i]->StartIntegration(tmax, particleconf, mc, geom, field, batch.lane(i));
+		particles[i]->PrepareStep();
+	};
+
+	for (unsigned i = 0; i < batchsize; ++i)
+		fill(i);
+
+	while (std::any_of(particles.begin(), particles.end(), [](const TParticle *p){ return p != nullptr; })){
+		batch.do_step();
+		for (unsigned i = 0; i < batchsize; ++i){
+			TParticle *particle = particles[i];
+			if (particle == nullptr || batch.lanestatus(i) == TBatchStepper::stepping) // empty lane or step was rejected
+				continue;
+			particle->FinishStep(batch.lanestatus(i) == TBatchStepper::accepted, mc, geom, field);
+			if (particle->ID == ID_UNKNOWN){
+				particle->PrepareStep();
+				continue;
+			}
+			particle->StopIntegration(mc, geom, field);
+			batch.release(i);
+			finish(particle);
+			fill(i);
+		}
+	}
+}
+
+
+void TParticle::StartIntegration(double tmax, std::map<std::string, std::string> &particleconf, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field, dense_stepper_type &stepper){
+	integration.reset(new TIntegration());
+	TIntegration &in = *integration;
+	in.tmax = tmax;
+
+	in.tau = 0;
+	istringstream(particleconf["tau"]) >> in.tau;
+	if (in.tau > 0){
+		std::exponential_distribution<double> expdist(1./in.tau);
+		in.tau = expdist(mc);
 	}
 	else
-		istringstream(particleconf["tmax"]) >> tau;
+		istringstream(particleconf["tmax"]) >> in.tau;
 
 	if (currentsolids.empty())
 		currentsolids = geom.GetSolids(tend, &yend[0]);
 
-	double maxtraj;
-	istringstream(particleconf["lmax"]) >> maxtraj;
+	istringstream(particleconf["lmax"]) >> in.maxtraj;
+
+	in.implicitabsorption = false;
+	istringstream(particleconf["implicitabsorption"]) >> in.implicitabsorption;
+	in.rouletteweight = 0;
+	istringstream(particleconf["rouletteweight"]) >> in.rouletteweight;
+	in.roulettesurvivalweight = 1;
+	istringstream(particleconf["roulettesurvivalweight"]) >> in.roulettesurvivalweight;
+	if (in.rouletteweight > 0 && in.roulettesurvivalweight <= in.rouletteweight)
+		throw std::runtime_error("roulettesurvivalweight for " + name + " has to be larger than rouletteweight!");
 
 //	cout << "Particle no.: " << particlenumber << " particle type: " << name << '\n';
 //	cout << "x: " << yend[0] << "m y: " << yend[1] << "m z: " << yend[2]
 //		 << "m E: " << GetFinalKineticEnergy() << "eV t: " << tend << "s tau: " << tau << "s lmax: " << maxtraj << "m\n";
 
 	// set initial values for integrator
-	value_type x = tend;
-	if (x > tmax)
+	in.x = tend;
+	if (in.x > tmax)
 		throw std::runtime_error("Tried to start trajectory simulation past the maximum simulation time. Check time settings.");
-	state_type y = yend; 
+	in.y = yend;
 
-	bool resetintegration = false;
+	in.resetintegration = false;
 
-	float nextsnapshot = -1;
-	bool snapshotlog = false;
-	istringstream(particleconf["snapshotlog"]) >> snapshotlog;
-	istringstream snapshots(particleconf["snapshots"]);
-	if (snapshotlog){
+	in.nextsnapshot = -1;
+	in.snapshotlog = false;
+	istringstream(particleconf["snapshotlog"]) >> in.snapshotlog;
+	in.snapshots.str(particleconf["snapshots"]);
+	if (in.snapshotlog){
 		do{
-			snapshots >> nextsnapshot;
-		}while (snapshots.good() && nextsnapshot < x); // find first snapshot time
+			in.snapshots >> in.nextsnapshot;
+		}while (in.snapshots.good() && in.nextsnapshot < in.x); // find first snapshot time
 	}
 
-	bool tracklog = false;
-	istringstream(particleconf["tracklog"]) >> tracklog;
-	if (tracklog)
-		PrintTrack(tend, yend, spinend, solidend, field);
-	double trackloginterval = 1e-3;
-	istringstream(particleconf["trackloginterval"]) >> trackloginterval;
-	value_type lastsave = x;
+	in.tracklog = false;
+	istringstream(particleconf["tracklog"]) >> in.tracklog;
+	if (in.tracklog)
+		PrintTrack(tend, yend, spinend, *solidend, field);
+	in.trackloginterval = 1e-3;
+	istringstream(particleconf["trackloginterval"]) >> in.trackloginterval;
+	in.lastsave = in.x;
 
-	bool hitlog = false;
-	istringstream(particleconf["hitlog"]) >> hitlog;
+	in.hitlog = false;
+	istringstream(particleconf["hitlog"]) >> in.hitlog;
 
-	bool flipspin = false;
-	istringstream(particleconf["flipspin"]) >> flipspin;
+	in.flipspin = false;
+	istringstream(particleconf["flipspin"]) >> in.flipspin;
 	
-	bool spininterpolatefields = false;
-	istringstream(particleconf["interpolatefields"]) >> spininterpolatefields;
+	in.spininterpolatefields = false;
+	istringstream(particleconf["interpolatefields"]) >> in.spininterpolatefields;
+
+	std::string spinsteppertype = "dopri5";
+	istringstream(particleconf["spinstepper"]) >> spinsteppertype;
+	if (spinsteppertype != "dopri5" && spinsteppertype != "magnus")
+		throw std::runtime_error("Unknown spin stepper type " + spinsteppertype + " for " + name + "!");
+	in.magnus = spinsteppertype == "magnus";
+
+	double spinreffrequency = 0, spinrefaxis[3] = {0, 0, 1};
+	istringstream(particleconf["spinreferencefrequency"]) >> spinreffrequency;
+	istringstream(particleconf["spinreferenceaxis"]) >> spinrefaxis[0] >> spinrefaxis[1] >> spinrefaxis[2];
+	in.spinframe = TRotatingSpinFrame(spinreffrequency, spinrefaxis);
+
+	in.maxspinadiabaticity = 0;
+	istringstream(particleconf["spinadiabaticity"]) >> in.maxspinadiabaticity;
+	if (in.maxspinadiabaticity < 0)
+		throw std::runtime_error("Adiabaticity limit spinadiabaticity for " + name + " must not be negative!");
+	in.spinnonadiabatic = false;
 
 	int spinlog = false;
-	double SpinBmax = 0, spinloginterval = 0, nextspinlog = std::numeric_limits<double>::infinity();
-	vector<double> SpinTimes;
-	std::istringstream(particleconf["Bmax"]) >> SpinBmax;
+	in.SpinBmax = 0;
+	in.spinloginterval = 0;
+	in.nextspinlog = std::numeric_limits<double>::infinity();
+	std::istringstream(particleconf["Bmax"]) >> in.SpinBmax;
 	std::istringstream SpinTimess(particleconf["spintimes"]);
 	do{
 		double t;
 		SpinTimess >> t;
         if (SpinTimess)
-			SpinTimes.push_back(t);
+			in.SpinTimes.push_back(t);
 	}while(SpinTimess.good());
 	std::istringstream(particleconf["spinlog"]) >> spinlog;
-	std::istringstream(particleconf["spinloginterval"]) >> spinloginterval;
+	std::istringstream(particleconf["spinloginterval"]) >> in.spinloginterval;
 	if (spinlog)
-        nextspinlog = 0.;
-	state_type spin = spinend;
+        in.nextspinlog = 0.;
+	in.spin = spinend;
 
-	dense_stepper_type stepper = boost::numeric::odeint::make_dense_output(1e-9, 1e-9, stepper_type());
-	stepper.initialize(y, x, 10.*MAX_TRACK_DEVIATION/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5])); // initialize stepper with fixed spatial length
+	in.stepper = &stepper;
+	stepper.initialize(in.y, in.x, 10.*MAX_TRACK_DEVIATION/sqrt(in.y[3]*in.y[3] + in.y[4]*in.y[4] + in.y[5]*in.y[5])); // initialize stepper with fixed spatial length
+}
 
-//	progress_display progress(100, std::cout, ' ' + std::to_string(particlenumber) + ' ');
 
-	while (ID == ID_UNKNOWN){ // integrate as long as nothing happened to particle
-		if (resetintegration){
-			stepper.initialize(y, x, stepper.current_time_step()); // (re-)start integration with last step size
-		}
-		value_type x1 = x; // save point before next step
-		state_type y1 = y;
+void TParticle::PrepareStep(){
+	TIntegration &in = *integration;
+	if (in.resetintegration){
+		in.stepper->initialize(in.y, in.x, in.stepper->current_time_step()); // (re-)start integration with last step size
+	}
+}
 
-		try{
-			stepper.do_step(std::bind(&TParticle::derivs, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, &field));
-			x = stepper.current_time();
-			y = stepper.current_state();
-			Nstep++;
-		}
-		catch(...){ // catch Exceptions thrown by numerical recipes routines
-			ID = ID_ODEINT_ERROR;
-		}
 
-		if (tau > 0 && y[6] > tau){ // if proper time is larger than lifetime
-			x = x1 + (x - x1)*(tau - y1[6])/(y[6] - y1[6]); // interpolate decay time in lab frame
-			stepper.calc_state(x, y);
-		}
-		if (x > tmax){	//If stepsize overshot max simulation time
-			x = tmax;
-			stepper.calc_state(x, y);
-		}
+void TParticle::FinishStep(const bool stepped, TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
+	TIntegration &in = *integration;
+	dense_stepper_type &stepper = *in.stepper;
+	value_type &x = in.x;
+	state_type &y = in.y;
+	value_type x1 = x; // save point before step
+	state_type y1 = y;
 
-		while (x1 < x){ // split integration step in pieces (x1,y1->x2,y2) to reduce chord length, go through all pieces
-			double l2 = pow(y[8] - y1[8], 2); // actual length of step squared
-			double d2 = pow(y[0] - y1[0], 2) + pow(y[1] - y1[1], 2) + pow(y[2] - y1[2], 2); // length of straight line between start and end point of step squared
-			double dev2 = 0.25*(l2 - d2); // max. possible squared deviation of real path from straight line
-			value_type x2 = x;
-			state_type y2 = y;
-			if (dev2 > MAX_TRACK_DEVIATION*MAX_TRACK_DEVIATION){ // if deviation is larger than MAX_TRACK_DEVIATION
-//				cout << "split " << x - x1 << " " << sqrt(l2) << " " << sqrt(d2) << " " << sqrt(dev2) << "\n";
-				x2 = x1 + (x - x1)/ceil(sqrt(dev2)/MAX_TRACK_DEVIATION); // split step to reduce deviation
-				stepper.calc_state(x2, y2);
-				assert(x2 <= x);
-			}
-//			l2 = pow(y2[8] - y1[8], 2);
-//			d2 = pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2);
-//			cout << x2 - x1 << " " << sqrt(l2) << " " << sqrt(d2) << " " << 0.5*sqrt(l2 - d2) << "\n";
-
-			resetintegration = CheckHit(x1, y1, x2, y2, stepper, mc, geom, hitlog); // check if particle hit a material boundary or was absorbed between y1 and y2
-			if (resetintegration){
-				x = x2; // if particle path was changed: reset integration end point
-				y = y2;
-			}
+	if (stepped){
+		x = stepper.current_time();
+		y = stepper.current_state();
+		Nstep++;
+	}
+	else
+		ID = ID_ODEINT_ERROR;
 
-			x1 = x2;
-			y1 = y2;
+	if (in.tau > 0 && y[6] > in.tau){ // if proper time is larger than lifetime
+		x = x1 + (x - x1)*(in.tau - y1[6])/(y[6] - y1[6]); // interpolate decay time in lab frame
+		stepper.calc_state(x, y);
+	}
+	if (x > in.tmax){	//If stepsize overshot max simulation time
+		x = in.tmax;
+		stepper.calc_state(x, y);
+	}
+
+	geom.UpdateInactiveSolids(x1, x, &y1[0], currentsolids, inactivesolids, newinactivesolids); // skip solids that are ignored during the whole step
+
+	while (x1 < x){ // split integration step in pieces (x1,y1->x2,y2) to reduce chord length, go through all pieces
+		double l2 = pow(y[8] - y1[8], 2); // actual length of step squared
+		double d2 = pow(y[0] - y1[0], 2) + pow(y[1] - y1[1], 2) + pow(y[2] - y1[2], 2); // length of straight line between start and end point of step squared
+		double dev2 = 0.25*(l2 - d2); // max. possible squared deviation of real path from straight line
+		value_type x2 = x;
+		state_type y2 = y;
+		if (dev2 > MAX_TRACK_DEVIATION*MAX_TRACK_DEVIATION){ // if deviation is larger than MAX_TRACK_DEVIATION
+//			cout << "split " << x - x1 << " " << sqrt(l2) << " " << sqrt(d2) << " " << sqrt(dev2) << "\n";
+			x2 = x1 + (x - x1)/ceil(sqrt(dev2)/MAX_TRACK_DEVIATION); // split step to reduce deviation
+			stepper.calc_state(x2, y2);
+			assert(x2 <= x);
+		}
+//		l2 = pow(y2[8] - y1[8], 2);
+//		d2 = pow(y2[0] - y1[0], 2) + pow(y2[1] - y1[1], 2) + pow(y2[2] - y1[2], 2);
+//		cout << x2 - x1 << " " << sqrt(l2) << " " << sqrt(d2) << " " << 0.5*sqrt(l2 - d2) << "\n";
+
+		in.resetintegration = CheckHit(x1, y1, x2, y2, stepper, mc, geom, in.hitlog); // check if particle hit a material boundary or was absorbed between y1 and y2
+		if (in.resetintegration){
+			x = x2; // if particle path was changed: reset integration end point
+			y = y2;
 		}
 
-		// take snapshots at certain times
-		if (snapshotlog && snapshots.good()){
-			if (stepper.previous_time() <= nextsnapshot && x > nextsnapshot){
-				state_type ysnap(STATE_VARIABLES);
-				stepper.calc_state(nextsnapshot, ysnap);
-//				cout << "\n Snapshot at " << nextsnapshot << " s \n";
+		x1 = x2;
+		y1 = y2;
+	}
 
-				Print(nextsnapshot, ysnap, spin, geom, field, snapshotLog);
-				snapshots >> nextsnapshot;
-			}
+	if (ID == ID_UNKNOWN && weight < in.rouletteweight){ // Russian roulette: keep particle with probability weight/roulettesurvivalweight and increase its weight accordingly
+		std::uniform_real_distribution<double> unidist(0, 1);
+		if (unidist(mc)*in.roulettesurvivalweight < weight)
+			weight = in.roulettesurvivalweight;
+		else{
+			weight = 0;
+			ID = ID_ROULETTE;
 		}
+	}
 
-		double prevpol = y[7];
-		noflipprob *= 1 - IntegrateSpin(spin, stepper, x, y, SpinTimes, field, spininterpolatefields, SpinBmax, mc, flipspin, spinloginterval, nextspinlog); // calculate spin precession and spin-flip probability
-		if (y[7] != prevpol)
-			Nspinflip++;
+	// take snapshots at certain times
+	if (in.snapshotlog && in.snapshots.good()){
+		if (stepper.previous_time() <= in.nextsnapshot && x > in.nextsnapshot){
+			state_type ysnap;
+			stepper.calc_state(in.nextsnapshot, ysnap);
+//			cout << "\n Snapshot at " << nextsnapshot << " s \n";
 
-		Hmax = max(GetKineticEnergy(&y[3]) + GetPotentialEnergy(x, y, field, GetCurrentsolid()), Hmax);
-		if (tracklog && x - lastsave > trackloginterval/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5])){
-			PrintTrack(x, y, spin, GetCurrentsolid(), field);
-			lastsave = x;
+			Print(in.nextsnapshot, ysnap, in.spin, geom, field, snapshotLog);
+			in.snapshots >> in.nextsnapshot;
 		}
+	}
+
+	double prevpol = y[7];
+	noflipprob *= 1 - IntegrateSpin(in.spin, stepper, x, y, in.SpinTimes, field, in.spininterpolatefields, in.magnus, in.spinframe,
+									in.maxspinadiabaticity, in.spinnonadiabatic, in.SpinBmax, mc, in.flipspin, in.spinloginterval, in.nextspinlog, Tspin); // calculate spin precession and spin-flip probability
+	if (y[7] != prevpol)
+		Nspinflip++;
 
-//		progress += 100*max(y[6]/tau, max((x - tstart)/(tmax - tstart), y[8]/maxtraj)) - progress.count();
-		
-		if (ID == ID_UNKNOWN && y[6] >= tau) // proper time >= tau?
-			ID = ID_DECAYED;
-		else if (ID == ID_UNKNOWN && (x >= tmax || y[8] >= maxtraj)) // time > tmax or trajectory length > max length?
-			ID = ID_NOT_FINISH;
+	Hmax = max(GetKineticEnergy(&y[3]) + GetPotentialEnergy(x, y, field, GetCurrentsolid()), Hmax);
+	if (in.tracklog && x - in.lastsave > in.trackloginterval/sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5])){
+		PrintTrack(x, y, in.spin, GetCurrentsolid(), field);
+		in.lastsave = x;
 	}
 
-//	cout << "Done" << endl;
+//	progress += 100*max(y[6]/tau, max((x - tstart)/(tmax - tstart), y[8]/maxtraj)) - progress.count();
+	
+	if (ID == ID_UNKNOWN && y[6] >= in.tau) // proper time >= tau?
+		ID = ID_DECAYED;
+	else if (ID == ID_UNKNOWN && (x >= in.tmax || y[8] >= in.maxtraj)) // time > tmax or trajectory length > max length?
+		ID = ID_NOT_FINISH;
+}
+
 
-	tend = x;
-	yend = y;
-	spinend = spin;
-	solidend = GetCurrentsolid();
+void TParticle::StopIntegration(TMCGenerator &mc, const TGeometry &geom, const TFieldManager &field){
+	tend = integration->x;
+	yend = integration->y;
+	spinend = integration->spin;
+	solidend = &GetCurrentsolid();
+	integration.reset();
 	Print(tend, yend, spinend, geom, field, endLog);
 
 	if (ID == ID_DECAYED){ // if particle reached its lifetime call TParticle::Decay
 //		cout << "Decayed!\n";
 		Decay(tend, yend, mc, geom, field, secondaries);
+		for (auto s: secondaries)
+			s->weight = weight; // secondaries inherit statistical weight
 	}
 
 //	cout << "x: " << yend[0];
@@ -285,28 +454,117 @@ void TParticle::Integrate(double tmax, std::map<std::string, std::string> &parti
 }
 
 
-void TParticle::derivs(const state_type &y, state_type &dydx, const value_type x, const TFieldManager *field) const{
-	double B[3], dBidxj[3][3], E[3], V; // magnetic/electric field and electric potential in lab frame
-	if (q != 0 || (mu != 0 && y[7] != 0)) // if particle has charge or magnetic moment, calculate magnetic field
-		field->BField(y[0],y[1],y[2], x, B, dBidxj);
- 	if (q != 0) // if particle has charge caculate electric field
-		field->EField(y[0],y[1],y[2], x, V, E);
-	EquationOfMotion(y, dydx, x, B, dBidxj, E);
+template<bool charged, bool magnetic> void TParticle::derivs(const state_type &y, state_type &dydx, const value_type x, const TFieldManager *field) const{
+	double B[3] = {0,0,0}, dBidxj[3][3], E[3] = {0,0,0}, V; // magnetic/electric field and electric potential in lab frame
+	if (charged) // Lorentz force needs magnetic field, gradient only needed if particle also has a magnetic moment
+		field->BField(y[0],y[1],y[2], x, B, magnetic && y[7] != 0 ? dBidxj : nullptr, &fieldcache);
+	else if (magnetic && y[7] != 0) // force on magnetic moment needs magnetic field and its gradient
+		field->BField(y[0],y[1],y[2], x, B, dBidxj, &fieldcache);
+	if (charged) // if particle has charge caculate electric field
+		field->EField(y[0],y[1],y[2], x, V, E, &fieldcache);
+	EquationOfMotion<charged, magnetic>(y, dydx, x, B, dBidxj, E);
+}
+
+
+TParticle::derivs_type TParticle::SelectDerivs() const{
+	if (q != 0 && mu != 0)
+		return &TParticle::derivs<true, true>;
+	else if (q != 0)
+		return &TParticle::derivs<true, false>;
+	else if (mu != 0)
+		return &TParticle::derivs<false, true>;
+	else
+		return &TParticle::derivs<false, false>;
+}
+
+
+void TParticle::StepperForce(const state_type &y, const value_type x, const TFieldManager *field, double B[3], double dBidxj[3][3], double F[3]) const{
+	double dB[3][3], E[3] = {0,0,0}, V;
+	B[0] = B[1] = B[2] = 0;
+	bool gradient = mu != 0 && y[7] != 0;
+	if (dBidxj == nullptr && gradient)
+		dBidxj = dB;
+	if (q != 0 || dBidxj != nullptr)
+		field->BField(y[0],y[1],y[2], x, B, dBidxj, &fieldcache);
+	if (q != 0)
+		field->EField(y[0],y[1],y[2], x, V, E, &fieldcache);
+	F[0] = q*E[0]; // electric force
+	F[1] = q*E[1];
+	F[2] = q*E[2] - gravconst_d*m*ele_e_d; // add gravitation
+	if (gradient && (B[0] != 0 || B[1] != 0 || B[2] != 0)){
+		double Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+		for (int i = 0; i < 3; ++i)
+			F[i] += y[7]*mu*(B[0]*dBidxj[0][i] + B[1]*dBidxj[1][i] + B[2]*dBidxj[2][i])/Babs; // add force on magnetic dipole moment
+	}
 }
 
+
+void TParticle::StepperOptions(std::map<std::string, std::string> &particleconf, std::string &type, double &abserr, double &relerr, double &maxadiabaticity, bool &ballistic) const{
+	type = "dopri5";
+	abserr = 1e-9;
+	relerr = 1e-9;
+	maxadiabaticity = 0;
+	ballistic = false;
+	istringstream(particleconf["stepper"]) >> type;
+	istringstream(particleconf["abserr"]) >> abserr;
+	istringstream(particleconf["relerr"]) >> relerr;
+	istringstream(particleconf["guidingcentre"]) >> maxadiabaticity;
+	istringstream(particleconf["ballistic"]) >> ballistic;
+	if (abserr < 0 || relerr < 0 || (abserr == 0 && relerr == 0))
+		throw std::runtime_error("Error tolerances abserr and relerr for " + name + " must not be negative or both zero!");
+	if (maxadiabaticity < 0)
+		throw std::runtime_error("Adiabaticity limit guidingcentre for " + name + " must not be negative!");
+}
+
+
+std::unique_ptr<TParticle::dense_stepper_type> TParticle::CreateStepper(std::map<std::string, std::string> &particleconf, const TFieldManager &field) const{
+	std::string type;
+	double abserr, relerr, maxadiabaticity;
+	bool ballistic;
+	StepperOptions(particleconf, type, abserr, relerr, maxadiabaticity, ballistic);
+
+	TStepper::system_type system = std::bind(SelectDerivs(), this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, &field);
+	TStepper::force_type force = std::bind(&TParticle::StepperForce, this, std::placeholders::_1, std::placeholders::_2, &field, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5);
+	std::unique_ptr<dense_stepper_type> stepper;
+	if (type == "dopri5")
+		stepper.reset(new TDopri5Stepper(boost::numeric::odeint::make_dense_output(abserr, relerr, boost::numeric::odeint::runge_kutta_dopri5<state_type, value_type>()), system));
+	else if (type == "bulirschstoer")
+		stepper.reset(new TBulirschStoerStepper(boost::numeric::odeint::bulirsch_stoer_dense_out<state_type, value_type>(abserr, relerr), system));
+	else if (type == "rk78")
+		stepper.reset(new TRK78Stepper(abserr, relerr, system));
+	else if (type == "boris")
+		stepper.reset(new TBorisStepper(q, m*ele_e_d, relerr, 10.*MAX_TRACK_DEVIATION, force));
+	else
+		throw std::runtime_error("Unknown stepper type " + type + " for " + name + "!");
+
+	if (maxadiabaticity > 0 && q != 0) // neutral particles do not gyrate, always use full equations of motion for them
+		stepper.reset(new TGuidingCentreStepper(q, m*ele_e_d, abserr, relerr, maxadiabaticity, std::move(stepper), force));
+	if (ballistic){ // outside of all fields, move particle along parabola
+		double g[3] = {0, 0, -gravconst_d};
+		stepper.reset(new TBallisticStepper(g, MAX_TRACK_DEVIATION, std::bind(&TFieldManager::FieldFree, &field, std::placeholders::_1, std::placeholders::_2), std::move(stepper)));
+	}
+	return stepper;
+}
+
+
 void TParticle::EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const{
+	EquationOfMotion<true, true>(y, dydx, x, B, dBidxj, E);
+}
+
+
+template<bool charged, bool magnetic> void TParticle::EquationOfMotion(const state_type &y, state_type &dydx, const value_type x, const double B[3], const double dBidxj[3][3], const double E[3]) const{
 	dydx[0] = y[3]; // time derivatives of position = velocity
 	dydx[1] = y[4];
 	dydx[2] = y[5];
 
 	value_type F[3] = {0,0,0}; // Force in lab frame
-	F[2] += -gravconst*m*ele_e; // add gravitation to force
-	if (q != 0){
+	F[2] += -gravconst_d*m*ele_e_d; // add gravitation to force
+	if (charged){
 		F[0] += q*(E[0] + y[4]*B[2] - y[5]*B[1]); // add Lorentz-force
 		F[1] += q*(E[1] + y[5]*B[0] - y[3]*B[2]);
 		F[2] += q*(E[2] + y[3]*B[1] - y[4]*B[0]);
 	}
-	if (mu != 0 && y[7] != 0 && (B[0] != 0 || B[1] != 0 || B[2] != 0)){
+	if (magnetic && y[7] != 0 && (B[0] != 0 || B[1] != 0 || B[2] != 0)){
 		double Babs = sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
 		double dBdxi[3] = {	(B[0]*dBidxj[0][0] + B[1]*dBidxj[1][0] + B[2]*dBidxj[2][0])/Babs,
 							(B[0]*dBidxj[0][1] + B[1]*dBidxj[1][1] + B[2]*dBidxj[2][1])/Babs,
@@ -316,10 +574,11 @@ void TParticle::EquationOfMotion(const state_type &y, state_type &dydx, const va
 		F[2] += y[7]*mu*dBdxi[2];
 	}
 	double v2 = y[3]*y[3] + y[4]*y[4] + y[5]*y[5];
-	value_type inversegamma = sqrt(1 - v2/(c_0*c_0)); // relativstic factor 1/gamma
-	dydx[3] = inversegamma/m/ele_e*(F[0] - (y[3]*y[3]*F[0] + y[3]*y[4]*F[1] + y[3]*y[5]*F[2])/c_0/c_0); // general relativstic equation of motion
-	dydx[4] = inversegamma/m/ele_e*(F[1] - (y[4]*y[3]*F[0] + y[4]*y[4]*F[1] + y[4]*y[5]*F[2])/c_0/c_0); // dv/dt = 1/gamma/m*(F - v * v^T * F / c^2)
-	dydx[5] = inversegamma/m/ele_e*(F[2] - (y[5]*y[3]*F[0] + y[5]*y[4]*F[1] + y[5]*y[5]*F[2])/c_0/c_0);
+	value_type inversegamma = sqrt(1 - v2/c_0_sq); // relativstic factor 1/gamma
+	double vF = (y[3]*F[0] + y[4]*F[1] + y[5]*F[2])/c_0_sq;
+	dydx[3] = inversegamma/m/ele_e_d*(F[0] - y[3]*vF); // general relativstic equation of motion
+	dydx[4] = inversegamma/m/ele_e_d*(F[1] - y[4]*vF); // dv/dt = 1/gamma/m*(F - v * v^T * F / c^2)
+	dydx[5] = inversegamma/m/ele_e_d*(F[2] - y[5]*vF);
 
 	dydx[6] = inversegamma; // derivative of proper time is 1/gamma
 	dydx[7] = 0; // polarisaton does not change
@@ -327,16 +586,17 @@ void TParticle::EquationOfMotion(const state_type &y, state_type &dydx, const va
 }
 
 
-double TParticle::IntegrateSpin(state_type &spin, const dense_stepper_type &stepper, const double x2, state_type &y2, const std::vector<double> &times, const TFieldManager &field,
-								const bool interpolatefields, const double Bmax, TMCGenerator &mc, const bool flipspin, const double spinloginterval, double &nextspinlog) const{
+double TParticle::IntegrateSpin(spin_state_type &spin, const dense_stepper_type &stepper, const double x2, state_type &y2, const std::vector<double> &times, const TFieldManager &field,
+								const bool interpolatefields, const bool magnus, const TRotatingSpinFrame &frame,
+								const double maxadiabaticity, bool &nonadiabatic, const double Bmax, TMCGenerator &mc, const bool flipspin, const double spinloginterval, double &nextspinlog, double &spintime) const{
 	value_type x1 = stepper.previous_time();
 	if (gamma == 0 || x1 == x2)
 		return 0;
 
 	state_type y1 = stepper.previous_state();
 	double B1[3], B2[3], polarisation;
-	field.BField(y1[0], y1[1], y1[2], x1, B1);
-	field.BField(y2[0], y2[1], y2[2], x2, B2);
+	field.BField(y1[0], y1[1], y1[2], x1, B1, nullptr, &fieldcache); // fields at step end points are usually known from the integrator
+	field.BField(y2[0], y2[1], y2[2], x2, B2, nullptr, &fieldcache);
 	double Babs1 = sqrt(B1[0]*B1[0] + B1[1]*B1[1] + B1[2]*B1[2]);
 	double Babs2 = sqrt(B2[0]*B2[0] + B2[1]*B2[1] + B2[2]*B2[2]);
 
@@ -371,29 +631,33 @@ double TParticle::IntegrateSpin(state_type &spin, const dense_stepper_type &step
 		integrate2 |= (x2 >= times[i] && x2 < times[i+1]);
 	}
 
-	if ((integrate1 || integrate2) && (Babs1 < Bmax || Babs2 < Bmax)){ // do spin integration only, if time is in specified range and field is smaller than Bmax
+	bool adiabatic = false;
+	if (maxadiabaticity > 0){ // switch spin integration on where spin motion becomes non-adiabatic, and off where it is adiabatic again
+		double dBidxj2[3][3];
+		field.BField(y2[0], y2[1], y2[2], x2, B2, dBidxj2, &fieldcache);
+		double k = spinadiabaticity(dBidxj2[0][0], dBidxj2[0][1], dBidxj2[0][2], dBidxj2[1][0], dBidxj2[1][1], dBidxj2[1][2], dBidxj2[2][0], dBidxj2[2][1], dBidxj2[2][2],
+									Babs2, y2[3], y2[4], y2[5], gamma);
+		// field gradient is only known at step points, estimate rotation of field direction within step to catch zero crossings and sharp turns in between
+		double B1xB2[3];
+		CrossProduct(B1, B2, B1xB2);
+		double angle = atan2(sqrt(B1xB2[0]*B1xB2[0] + B1xB2[1]*B1xB2[1] + B1xB2[2]*B1xB2[2]), B1[0]*B2[0] + B1[1]*B2[1] + B1[2]*B2[2]);
+		k = std::max<double>(k, angle/(x2 - x1)/std::abs(gamma)/std::min(Babs1, Babs2));
+
+		bool nonadiabatic1 = nonadiabatic;
+		if (k > maxadiabaticity)
+			nonadiabatic = true;
+		else if (k < 0.5*maxadiabaticity)
+			nonadiabatic = false;
+		adiabatic = !nonadiabatic1 && !nonadiabatic; // integrate step if either of its end points is in non-adiabatic region
+	}
+
+	if ((integrate1 || integrate2) && (Babs1 < Bmax || Babs2 < Bmax) && !adiabatic){ // do spin integration only, if time is in specified range and field is smaller than Bmax
 //		if ((!integrate1 && integrate2) || (Babs1 > Bmax && Babs2 < Bmax))
 //			std::cout << x1 << "s " << y1[7] - polarisation << " ";
 
-		vector<alglib::spline1dinterpolant> omega_int;
-		if (interpolatefields){
-			alglib::real_1d_array ts; // set up values for interpolation of precession axis
-			vector<alglib::real_1d_array> omega(3);
-			omega_int.resize(3);
-			const int int_points = 10;
-			ts.setlength(int_points + 1);
-			for (int i = 0; i < 3; i++)
-				omega[i].setlength(int_points + 1);
-
-			for (int i = 0; i <= int_points; i++){ // calculate precession axis at several points along trajectory step
-				double t = x1 + i*(x2 - x1)/int_points;
-				ts[i] = t;
-				SpinPrecessionAxis(t, stepper, field, omega[0][i], omega[1][i], omega[2][i]);
-			}
-
-			for (int i = 0; i < 3; i++)
-				alglib::spline1dbuildcubic(ts, omega[i], omega_int[i]); // interpolate all three components of precession axis
-		}
+		TPrecessionSpline omega_int;
+		if (interpolatefields)
+			SpinPrecessionSpline(x1, x2, stepper, field, omega_int);
 
 		if (x1 >= nextspinlog){
 			// PrintSpin(x1, spin, stepper, field);
@@ -401,34 +665,81 @@ double TParticle::IntegrateSpin(state_type &spin, const dense_stepper_type &step
 			nextspinlog += spinloginterval;
 		}
 
-		dense_stepper_type spinstepper = boost::numeric::odeint::make_dense_output(1e-12, 1e-12, stepper_type());
-		spinstepper.initialize(spin, x1, std::abs(pi/gamma/Babs1)); // initialize integrator with step size = half rotation
-		unsigned int steps = 0;
-		while (true){
-			// take an integration step, SpinDerivs contains right-hand side of equation of motion
-			spinstepper.do_step(std::bind(&TParticle::SpinDerivs, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, stepper, &field, omega_int));
-			steps++;
-			double t = spinstepper.current_time();
-			if (t > x2){ // if stepper overshot, calculate end point and stop
-				t = x2;
-				spinstepper.calc_state(t, spin);
-			}
-			else
-				spin = spinstepper.current_state();
-
+		auto logspin = [&](const double t){
 			if (t >= nextspinlog){
 				// PrintSpin(t, spin, stepper, field);
-                state_type y(STATE_VARIABLES);
+                state_type y;
                 stepper.calc_state(t,y);
                 PrintSpin(t, y, spin, stepper, field);
 				nextspinlog += spinloginterval;
 			}
-			if (t >= x2)
-				break;
+		};
+		const TPrecessionSpline *omega = interpolatefields ? &omega_int : nullptr;
+		auto axis = [this, &stepper, &field, omega, &frame](const double t, double Omega[3]){
+			SpinPrecessionAxis(t, &stepper, &field, omega, Omega);
+			frame.PrecessionAxis(t, Omega); // transform precession axis into reference frame
+		};
+
+		spin_state_type spin1 = spin;
+		frame.FromLab(x1, &spin1[0]); // integrate spin in reference frame
+		double dt1 = std::abs(pi/gamma/Babs1); // initialize integrator with step size = half rotation
+		if (frame.IsRotating()){ // in rotating frame, use half rotation around precession axis in rotating frame, but not more than trajectory step
+			double Omega1[3];
+			axis(x1, Omega1);
+			dt1 = std::min<double>(pi/sqrt(Omega1[0]*Omega1[0] + Omega1[1]*Omega1[1] + Omega1[2]*Omega1[2]), x2 - x1);
+		}
+
+		if (magnus){
+			TMagnusSpinStepper spinstepper(1e-12, frame);
+			spinstepper.initialize(spin1, x1, dt1);
+			while (spinstepper.current_time() < x2){
+				spinstepper.do_step(axis, x2); // take an integration step, never beyond end of trajectory step
+				spin = spinstepper.current_state();
+				frame.ToLab(spinstepper.current_time(), &spin[0]);
+				logspin(spinstepper.current_time());
+			}
+		}
+		else{
+			dense_spin_stepper_type spinstepper = boost::numeric::odeint::make_dense_output(1e-12, 1e-12, spin_stepper_type());
+			spinstepper.initialize(spin1, x1, dt1);
+			// SpinDerivs contains right-hand side of equation of motion, trajectory stepper, fields, spline, and frame are only referenced by pointers,
+			// so odeint can copy the functor cheaply
+			auto spinderivs = std::bind(&TParticle::SpinDerivs, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, &stepper, &field, omega, &frame);
+			while (true){
+				spinstepper.do_step(spinderivs); // take an integration step
+				double t = spinstepper.current_time();
+				if (t > x2){ // if stepper overshot, calculate end point and stop
+					t = x2;
+					spinstepper.calc_state(t, spin);
+				}
+				else
+					spin = spinstepper.current_state();
+				frame.ToLab(t, &spin[0]);
+
+				logspin(t);
+				if (t >= x2)
+					break;
+			}
 		}
 
 		// calculate new spin projection
 		polarisation = (spin[0]*B2[0] + spin[1]*B2[1] + spin[2]*B2[2])/Babs2/sqrt(spin[0]*spin[0] + spin[1]*spin[1] + spin[2]*spin[2]);
+		spintime += x2 - x1;
+	}
+	else if ((integrate1 || integrate2) && (Babs1 < Bmax || Babs2 < Bmax)){ // if spin motion is adiabatic, transport spin along magnetic field, keeping its projection and precession phase
+		double theta[3];
+		for (int i = 0; i < 3; ++i)
+			theta[i] = -gamma*0.5*(Babs1 + Babs2)*(x2 - x1)*B1[i]/Babs1; // precession around initial field direction, Omega = -gamma*B
+		RotateAroundVector(theta, &spin[0]);
+		double B1xB2[3];
+		CrossProduct(B1, B2, B1xB2);
+		double sinangle = sqrt(B1xB2[0]*B1xB2[0] + B1xB2[1]*B1xB2[1] + B1xB2[2]*B1xB2[2])/Babs1/Babs2;
+		if (sinangle > 0){
+			double angle = atan2(sinangle, (B1[0]*B2[0] + B1[1]*B2[1] + B1[2]*B2[2])/Babs1/Babs2);
+			for (int i = 0; i < 3; ++i)
+				theta[i] = angle*B1xB2[i]/Babs1/Babs2/sinangle; // rotate spin along with field direction
+			RotateAroundVector(theta, &spin[0]);
+		}
 	}
 	else if ((Babs1 < Bmax || Babs2 < Bmax)){ // if time outside selected ranges, parallel-transport spin along magnetic field
 		if (polarisation*polarisation >= 1){ // catch rounding errors
@@ -465,7 +776,7 @@ double TParticle::IntegrateSpin(state_type &spin, const dense_stepper_type &step
 
 void TParticle::SpinPrecessionAxis(const double t, const dense_stepper_type &stepper, const TFieldManager &field, double &Omegax, double &Omegay, double &Omegaz) const{
 	double B[3], dBidxj[3][3], V, E[3];
-	state_type y(STATE_VARIABLES), dydt(STATE_VARIABLES);
+	state_type y, dydt;
 	stepper.calc_state(t, y); // calculate particle state at time t
 	field.BField(y[0], y[1], y[2], t, B, dBidxj);
 	field.EField(y[0], y[1], y[2], t, V, E);
@@ -500,27 +811,48 @@ void TParticle::SpinPrecessionAxis(const double t, const double B[3], const doub
 }
 
 
-void TParticle::SpinDerivs(const state_type &y, state_type &dydx, const value_type x, const dense_stepper_type &stepper, const TFieldManager *field, const std::vector<alglib::spline1dinterpolant> &omega) const{
-	double omegax, omegay, omegaz;
-	if (omega.size() == 3){ // if interpolator exists, use it
-		omegax = alglib::spline1dcalc(omega[0], x);
-		omegay = alglib::spline1dcalc(omega[1], x);
-		omegaz = alglib::spline1dcalc(omega[2], x);
-	}
+void TParticle::SpinPrecessionAxis(const double t, const dense_stepper_type *stepper, const TFieldManager *field, const TPrecessionSpline *omega, double Omega[3]) const{
+	if (omega != nullptr) // if interpolator exists, use it
+		omega->Evaluate(t, Omega);
 	else
-		SpinPrecessionAxis(x, stepper, *field, omegax, omegay, omegaz); // else calculate precession axis directly
+		SpinPrecessionAxis(t, *stepper, *field, Omega[0], Omega[1], Omega[2]); // else calculate precession axis directly
+}
 
-	dydx[0] = omegay*y[2] - omegaz*y[1]; // dS/dt = W x S
-	dydx[1] = omegaz*y[0] - omegax*y[2];
-	dydx[2] = omegax*y[1] - omegay*y[0];
+
+void TParticle::SpinPrecessionSpline(const value_type x1, const value_type x2, const dense_stepper_type &stepper, const TFieldManager &field, TPrecessionSpline &omega) const{
+	const int n = TPrecessionSpline::NODES;
+	state_type y[n], dydt;
+	double p[n][4], B[n][3], dBidxj[n][3][3], V[n], E[n][3], samples[n][3];
+	for (int i = 0; i < n; i++){ // calculate particle state at several points along trajectory step
+		p[i][3] = x1 + i*(x2 - x1)/PRECESSION_SPLINE_INTERVALS;
+		stepper.calc_state(p[i][3], y[i]);
+		std::copy(y[i].begin(), y[i].begin() + 3, p[i]);
+	}
+	field.Fields(n, p, B, dBidxj, V, E);
+	for (int i = 0; i < n; i++){
+		EquationOfMotion(y[i], dydt, p[i][3], B[i], dBidxj[i], E[i]); // calculate velocity and acceleration required for vxE effect and Thomas precession
+		SpinPrecessionAxis(p[i][3], B[i], E[i], dydt, samples[i][0], samples[i][1], samples[i][2]);
+	}
+	omega.Build(x1, x2, samples); // interpolate all three components of precession axis
+}
+
+
+void TParticle::SpinDerivs(const spin_state_type &y, spin_state_type &dydx, const value_type x, const dense_stepper_type *stepper, const TFieldManager *field, const TPrecessionSpline *omega, const TRotatingSpinFrame *frame) const{
+	double Omega[3];
+	SpinPrecessionAxis(x, stepper, field, omega, Omega);
+	dydx[4] = sqrt(Omega[0]*Omega[0] + Omega[1]*Omega[1] + Omega[2]*Omega[2]); // integrate precession phase in lab frame
+	frame->PrecessionAxis(x, Omega); // transform precession axis into reference frame
+
+	dydx[0] = Omega[1]*y[2] - Omega[2]*y[1]; // dS/dt = W x S
+	dydx[1] = Omega[2]*y[0] - Omega[0]*y[2];
+	dydx[2] = Omega[0]*y[1] - Omega[1]*y[0];
 	dydx[3] = 1.; // integrate time
-	dydx[4] = sqrt(omegax*omegax + omegay*omegay + omegaz*omegaz); // integrate precession phase
 }
 
 
 const solid& TParticle::GetCurrentsolid() const{
-	auto sld = max_element(currentsolids.begin(), currentsolids.end(), [](const pair<solid, bool> &s1, const pair<solid, bool> &s2){ return s1.second || (!s2.second && s1.first.ID < s2.first.ID); });
-	return sld->first;
+	auto sld = max_element(currentsolids.begin(), currentsolids.end(), [](const pair<const solid*, bool> &s1, const pair<const solid*, bool> &s2){ return s1.second || (!s2.second && s1.first->ID < s2.first->ID); });
+	return *sld->first;
 }
 
 
@@ -528,7 +860,7 @@ bool TParticle::DoStep(const value_type x1, const state_type &y1, value_type &x2
 		TMCGenerator &mc, const TGeometry &geom){
   value_type x2temp = x2;
   state_type y2temp = y2;
-  OnStep(x1, y1, x2, y2, stepper, currentsolid, mc, ID, secondaries);
+  OnStep(x1, y1, x2, y2, stepper, currentsolid, mc, ID, integration->implicitabsorption ? &weight : nullptr, secondaries);
   if (x2temp == x2 && y2temp == y2)
     return false;
   else{
@@ -542,15 +874,15 @@ bool TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2,
 		TMCGenerator &mc, const TGeometry &geom, const bool hitlog){
   bool trajectoryaltered = false, traversed = true;
 
-  multimap<TCollision, bool> colls;
-  if (!geom.GetCollisions(x1, &y1[0], x2, &y2[0], colls))
+  const TCollisionList &colls = collisions;
+  if (!geom.GetCollisions(x1, &y1[0], x2, &y2[0], collisions, &trianglecache, &inactivesolids))
     throw std::runtime_error("Called DoHit for a trajectory segment that does not contain a collision!");
 
-  vector<pair<solid, bool> > newsolids = currentsolids;
-  for (auto coll: colls){
+  newsolids.assign(currentsolids.begin(), currentsolids.end());
+  for (auto &coll: colls){
 //    cout << x1 << " " << x2 - x1 << " " << coll.first.distnormal << " " << coll.first.s << " " << coll.first.ID << endl;
-    solid sld = geom.GetSolid(coll.first.ID);
-    auto foundsld = find_if(newsolids.begin(), newsolids.end(), [&sld](const std::pair<solid, bool> s){ return s.first.ID == sld.ID; });
+    const solid *sld = &geom.GetSolid(coll.first.ID);
+    auto foundsld = find_if(newsolids.begin(), newsolids.end(), [sld](const std::pair<const solid*, bool> &s){ return s.first == sld; });
     if (coll.first.distnormal < 0){ // if entering solid
       if (foundsld != newsolids.end()){ // if solid has been entered before (self-intersecting surface)
 //	cout << x1 << " " << x2 - x1 << " " << coll.first.distnormal << " " << coll.first.s << " " << sld.name << endl;
@@ -565,7 +897,7 @@ bool TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2,
 	if (coll.first.s > 0){ // if collision happened right at the start of the step it is likely that the hit solid was already removed from the list in the previous step and this is not an error
 //	  cout << x1 << " " << x2 - x1 << " " << coll.first.distnormal << " " << coll.first.s << " " << sld.name << endl;
 //          throw runtime_error((boost::format("Particle inside '%1%' which it did not enter before!") % sld.name).str());
-          cout << "Particle inside solid " << sld.name << " which it did not enter before. Stopping it!\n";
+          cout << "Particle inside solid " << sld->name << " which it did not enter before. Stopping it!\n";
 	  ID = ID_GEOMETRY_ERROR;
 	  return true;
         }
@@ -581,12 +913,13 @@ bool TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2,
     }
   }
   
-  solid leaving = GetCurrentsolid(); // particle can only leave highest-priority solid
-  solid entering = geom.defaultsolid;
-  for (auto sld: newsolids){
-    if (!sld.second && sld.first.ID > entering.ID)
-      entering = sld.first;
+  const solid &leaving = GetCurrentsolid(); // particle can only leave highest-priority solid
+  const solid *enteringsld = &geom.defaultsolid;
+  for (auto &sld: newsolids){
+    if (!sld.second && sld.first->ID > enteringsld->ID)
+      enteringsld = sld.first;
   }
+  const solid &entering = *enteringsld;
 //  cout << "Leaving " << leaving.name << ", entering " << entering.name << '\n';
   if (leaving.ID != entering.ID){ // if the particle actually traversed a material interface
     auto coll = find_if(colls.begin(), colls.end(), [&leaving, &entering](const pair<TCollision, bool> &c){ return !c.second && (c.first.ID == leaving.ID || c.first.ID == entering.ID); });
@@ -594,7 +927,7 @@ bool TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2,
       throw std::runtime_error("Did not find collision corresponding to entering/leaving solid!");
     value_type x2temp = x2;
     state_type y2temp = y2;
-    OnHit(x1, y1, x2, y2, coll->first.normal, leaving, entering, mc, ID, secondaries); // do particle specific things
+    OnHit(x1, y1, x2, y2, coll->first.normal, leaving, entering, mc, ID, integration->implicitabsorption ? &weight : nullptr, secondaries); // do particle specific things
     if (x2temp == x2 && y2temp == y2){ // if end point of step was not modified
       trajectoryaltered = false;
       traversed = true;
@@ -620,7 +953,7 @@ bool TParticle::DoHit(const value_type x1, const state_type &y1, value_type &x2,
   }
  
   if (traversed){
-    currentsolids = newsolids; // if surface was traversed (even if it was  physically ignored) replace current solids with list of new solids
+    currentsolids.swap(newsolids); // if surface was traversed (even if it was  physically ignored) replace current solids with list of new solids
   }
  
   if (trajectoryaltered || ID != ID_UNKNOWN)
@@ -642,23 +975,48 @@ bool TParticle::iterate_collision(value_type &x1, state_type &y1, value_type &x2
     return true;
   }
 
+  value_type xc;
+  state_type yc;
+  TCollisionList &colls = collisions;
+  if (iteration == 0){ // if the stepper knows the trajectory analytically, calculate crossing with plane of hit surface directly
+    double p[3];
+    for (int i = 0; i < 3; ++i)
+      p[i] = y1[i] + coll.s*(y2[i] - y1[i]);
+    double v = sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]) + sqrt(y2[3]*y2[3] + y2[4]*y2[4] + y2[5]*y2[5]); // upper limit of speed along parabola
+    if (v > 0 && stepper.crossing_time(p, coll.normal, x1, x2, xc)){
+      value_type xc1 = max(x1, xc - 0.25*REFLECT_TOLERANCE/v), xc2 = min(x2, xc + 0.25*REFLECT_TOLERANCE/v);
+      state_type yc1, yc2;
+      stepper.calc_state(xc1, yc1);
+      stepper.calc_state(xc2, yc2);
+      // surface has to be hit close to crossing point and no other surface before it
+      if ((xc1 == x1 || !geom.GetCollisions(x1, &y1[0], xc1, &yc1[0], colls, &trianglecache, &inactivesolids)) &&
+          geom.GetCollisions(xc1, &yc1[0], xc2, &yc2[0], colls, &trianglecache, &inactivesolids)){
+        x1 = xc1;
+        y1 = yc1;
+        x2 = xc2;
+        y2 = yc2;
+        return true;
+      }
+    }
+  }
+
 //  value_type xc = x1 + (x2 - x1)*coll.s;
 //  if (xc == x1 || xc == x2)
-  value_type xc = x1 + (x2 - x1)*0.5;
-  state_type yc(STATE_VARIABLES);
+  xc = x1 + (x2 - x1)*0.5;
   stepper.calc_state(xc, yc);
-  multimap<TCollision, bool> colls;
-  if (geom.GetCollisions(x1, &y1[0], xc, &yc[0], colls)){ // if collision in first segment, further iterate
+  if (geom.GetCollisions(x1, &y1[0], xc, &yc[0], colls, &trianglecache, &inactivesolids)){ // if collision in first segment, further iterate
 //    cout << "1 " << x1 << " " << xc1 - x1 << endl;
-    if (iterate_collision(x1, y1, xc, yc, colls.begin()->first, stepper, geom, iteration + 1)){
+    TCollision first = colls.begin()->first; // copy first collision, list is refilled by next iteration
+    if (iterate_collision(x1, y1, xc, yc, first, stepper, geom, iteration + 1)){
       x2 = xc;
       y2 = yc;
       return true; // if successfully iterated
     }
   }
-  if (geom.GetCollisions(xc, &yc[0], x2, &y2[0], colls)){ // if collision in second segment, further iterate
+  if (geom.GetCollisions(xc, &yc[0], x2, &y2[0], colls, &trianglecache, &inactivesolids)){ // if collision in second segment, further iterate
 //    cout << "2 " << xc1 << " " << xc2 - xc1 << endl;
-    if (iterate_collision(xc, yc, x2, y2, colls.begin()->first, stepper, geom, iteration + 1)){
+    TCollision first = colls.begin()->first;
+    if (iterate_collision(xc, yc, x2, y2, first, stepper, geom, iteration + 1)){
       x1 = xc;
       y1 = yc;
       return true; // if successfully iterated
@@ -677,12 +1035,14 @@ bool TParticle::CheckHit(const value_type x1, const state_type &y1, value_type &
   if (x2 == x1)
     return false;
   
-  solid currentsolid = GetCurrentsolid();
+  const solid &currentsolid = GetCurrentsolid();
+
+  if (geom.InFreeSpace(&y1[0], &y2[0])) // if segment is far away from all surfaces, skip collision test
+    return DoStep(x1, y1, x2, y2, stepper, currentsolid, mc, geom);
 
-  multimap<TCollision, bool> colls;
   bool collfound = false;
   try{
-    collfound = geom.GetCollisions(x1, &y1[0], x2, &y2[0], colls);
+    collfound = geom.GetCollisions(x1, &y1[0], x2, &y2[0], collisions, &trianglecache, &inactivesolids);
   }
   catch(...){
     ID = ID_CGAL_ERROR;
@@ -691,10 +1051,11 @@ bool TParticle::CheckHit(const value_type x1, const state_type &y1, value_type &
   
   if (collfound){	// if there is a collision with a wall
     value_type xc1 = x1, xc2 = x2;
-//    for (auto c: colls)
+//    for (auto c: collisions)
 //      cout << x1 << " " << x2 - x1 << " " << c.first.distnormal << " " << c.first.s << " " << c.first.ID << endl;
     state_type yc1 = y1, yc2 = y2;
-    if (iterate_collision(xc1, yc1, xc2, yc2, colls.begin()->first, stepper, geom)){
+    TCollision coll = collisions.begin()->first; // copy first collision, list is refilled during iteration
+    if (iterate_collision(xc1, yc1, xc2, yc2, coll, stepper, geom)){
       if (xc1 > x1 && DoStep(x1, y1, xc1, yc1, stepper, currentsolid, mc, geom)){
         x2 = xc1;
         y2 = yc1;
@@ -720,7 +1081,7 @@ bool TParticle::CheckHit(const value_type x1, const state_type &y1, value_type &
 }
 
 
-void TParticle::Print(const value_type x, const state_type &y, const state_type &spin, const TGeometry &geom, const TFieldManager &field, const LogStream logType) const{
+void TParticle::Print(const value_type x, const state_type &y, const spin_state_type &spin, const TGeometry &geom, const TFieldManager &field, const LogStream logType) const{
 	ofstream &file = GetLogStream(logType);
 	if (!file.is_open()){
 		ostringstream filename;
@@ -745,7 +1106,7 @@ void TParticle::Print(const value_type x, const state_type &y, const state_type
 					"Sxend Syend Szend "
 					"Hend Eend Bend Uend solidend "
 					"stopID Nspinflip spinflipprob "
-					"Nhit Nstep trajlength Hmax wL\n";
+					"Nhit Nstep trajlength Hmax wL tspin weight\n";
 		file << std::setprecision(std::numeric_limits<double>::digits10); // need maximum precision for wL and delwL 
 	}
 //	cout << "Printing status\n";
@@ -760,14 +1121,14 @@ void TParticle::Print(const value_type x, const state_type &y, const state_type
 			<< tstart << " " << ystart[0] << " " << ystart[1] << " " << ystart[2] << " "
 			<< ystart[3] << " " << ystart[4] << " " << ystart[5] << " " << ystart[7] << " "
 			<< spinstart[0] << " " << spinstart[1] << " " << spinstart[2] << " " << GetInitialTotalEnergy(geom, field) << " " << GetInitialKineticEnergy() << " "
-			<< sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]) << " " << V << " " << solidstart.ID << " ";
+			<< sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]) << " " << V << " " << solidstart->ID << " ";
 
 	double H;
-	solid sld = GetCurrentsolid();
+	const solid &sld = GetCurrentsolid();
 	H = E + GetPotentialEnergy(x, y, field, sld);
 
-	field.BField(y[0], y[1], y[2], x, B);
-	field.EField(y[0], y[1], y[2], x, V, Ei);
+	field.BField(y[0], y[1], y[2], x, B, nullptr, &fieldcache);
+	field.EField(y[0], y[1], y[2], x, V, Ei, &fieldcache);
 
 	double wL = 0;
 	if (spin[3] > 0)
@@ -778,11 +1139,11 @@ void TParticle::Print(const value_type x, const state_type &y, const state_type
 			<< spin[0] << " " << spin[1] << " " << spin[2] << " " << H << " " << E << " "
 			<< sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]) << " " << V << " " << sld.ID << " "
 			<< ID << " " << Nspinflip << " " << 1 - noflipprob << " "
-			<< Nhit << " " << Nstep << " " << y[8] << " " << Hmax << " " << wL << '\n';
+			<< Nhit << " " << Nstep << " " << y[8] << " " << Hmax << " " << wL << " " << Tspin << " " << weight << '\n';
 }
 
 
-void TParticle::PrintTrack(const value_type x, const state_type &y, const state_type &spin, const solid &sld, const TFieldManager &field) const{
+void TParticle::PrintTrack(const value_type x, const state_type &y, const spin_state_type &spin, const solid &sld, const TFieldManager &field) const{
 	ofstream &trackfile = GetLogStream(trackLog);
 	if (!trackfile.is_open()){
 		ostringstream filename;
@@ -805,8 +1166,8 @@ void TParticle::PrintTrack(const value_type x, const state_type &y, const state_
 	double dBidxj[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
 	double E[3] = {0,0,0};
 	double V = 0;
-	field.BField(y[0],y[1],y[2],x,B, dBidxj);
-	field.EField(y[0],y[1],y[2],x,V,E);
+	field.BField(y[0],y[1],y[2],x,B, dBidxj, &fieldcache);
+	field.EField(y[0],y[1],y[2],x,V,E, &fieldcache);
 	value_type Ek = GetKineticEnergy(&y[3]);
 	value_type H = Ek + GetPotentialEnergy(x, y, field, sld);
 
@@ -848,11 +1209,11 @@ void TParticle::PrintHit(const value_type x, const state_type &y1, const state_t
 }
 
 
-// void TParticle::PrintSpin(const value_type x, const state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const{
-void TParticle::PrintSpin(const value_type x, const state_type &y, const state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const{
+// void TParticle::PrintSpin(const value_type x, const spin_state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const{
+void TParticle::PrintSpin(const value_type x, const state_type &y, const spin_state_type &spin, const dense_stepper_type &stepper, const TFieldManager &field) const{
 	ofstream &spinfile = GetLogStream(spinLog);
 	double B[3] = {0,0,0};
-	field.BField(y[0],y[1],y[2],x,B);
+	field.BField(y[0],y[1],y[2],x,B, nullptr, &fieldcache);
 	if (!spinfile.is_open()){
 		std::ostringstream filename;
 		filename << std::setw(12) << std::setfill('0') << jobnumber << std::setw(0) << name << "spin.out";
@@ -906,11 +1267,11 @@ double TParticle::GetPotentialEnergy(const value_type t, const state_type &y, co
 	if (q != 0 || mu != 0){
 		double B[3], E[3], V;
 		if (mu != 0){
-			field.BField(y[0],y[1],y[2],t,B);
+			field.BField(y[0],y[1],y[2],t,B, nullptr, &fieldcache);
 			result += -y[7]*mu/ele_e*sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
 		}
 		if (q != 0){
-			field.EField(y[0],y[1],y[2],t,V,E);
+			field.EField(y[0],y[1],y[2],t,V,E, &fieldcache);
 			result += q/ele_e*V;
 		}
 	}
@@ -0,0 +1,50 @@
+/**
+ * \file
+ * Interpolation of the spin-precession axis along a trajectory step.
+ */
+
+#include "precessionspline.h"
+
+#include <cmath>
+#include <algorithm>
+
+void TPrecessionSpline::Build(const double x1, const double x2, const double samples[NODES][3]){
+	x0 = x1;
+	h = (x2 - x1)/PRECESSION_SPLINE_INTERVALS;
+	for (int i = 0; i < NODES; ++i){
+		for (int j = 0; j < 3; ++j)
+			omega[i][j] = samples[i][j];
+	}
+
+	// Solve tridiagonal system M[i-1] + 4*M[i] + M[i+1] = 6/h^2*(y[i-1] - 2*y[i] + y[i+1]) for the second derivatives M at the inner nodes,
+	// parabolic termination sets M[0] = M[1] and M[N] = M[N-1]. The matrix is the same for all components, so it is only eliminated once.
+	const int N = PRECESSION_SPLINE_INTERVALS;
+	std::array<double, NODES> diag; // diagonal after forward elimination
+	std::array<std::array<double, 3>, NODES> rhs;
+	for (int i = 1; i < N; ++i){
+		diag[i] = 4 + (i == 1) + (i == N - 1);
+		for (int j = 0; j < 3; ++j)
+			rhs[i][j] = 6*(omega[i - 1][j] - 2*omega[i][j] + omega[i + 1][j])/h/h;
+		if (i > 1){
+			diag[i] -= 1/diag[i - 1];
+			for (int j = 0; j < 3; ++j)
+				rhs[i][j] -= rhs[i - 1][j]/diag[i - 1];
+		}
+	}
+	for (int j = 0; j < 3; ++j){
+		d2omega[N - 1][j] = rhs[N - 1][j]/diag[N - 1];
+		for (int i = N - 2; i >= 1; --i)
+			d2omega[i][j] = (rhs[i][j] - d2omega[i + 1][j])/diag[i];
+		d2omega[0][j] = d2omega[1][j];
+		d2omega[N][j] = d2omega[N - 1][j];
+	}
+}
+
+
+void TPrecessionSpline::Evaluate(const double x, double Omega[3]) const{
+	int i = std::min(std::max(static_cast<int>(std::floor((x - x0)/h)), 0), PRECESSION_SPLINE_INTERVALS - 1); // extrapolate with first or last interval
+	double a = (x - x0)/h - i; // relative position in interval, 0..1
+	double b = 1 - a;
+	for (int j = 0; j < 3; ++j)
+		Omega[j] = b*omega[i][j] + a*omega[i + 1][j] + ((b*b*b - b)*d2omega[i][j] + (a*a*a - a)*d2omega[i + 1][j])*h*h/6;
+}
@@ -0,0 +1,330 @@
+#include "primitives.h"
+
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include <map>
+
+#include <boost/format.hpp>
+
+// dot product of two vectors
+static double Dot(const double a[3], const double b[3]){
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+
+// solve a*s^2 + b*s + c = 0 and return number of real roots, stored in ascending order in s
+static int SolveQuadratic(const double a, const double b, const double c, double s[2]){
+	if (std::abs(a) <= std::numeric_limits<double>::epsilon()*(std::abs(b) + std::abs(c))){ // linear equation
+		if (b == 0)
+			return 0;
+		s[0] = -c/b;
+		return 1;
+	}
+	double disc = b*b - 4*a*c;
+	if (disc < 0)
+		return 0;
+	double q = -0.5*(b + std::copysign(std::sqrt(disc), b)); // avoid cancellation
+	s[0] = q/a;
+	s[1] = q != 0 ? c/q : s[0];
+	if (s[0] > s[1])
+		std::swap(s[0], s[1]);
+	return 2;
+}
+
+
+// distance of point (x, y) from 2D line segment (x1, y1)->(x2, y2)
+static double SegmentDistance2D(const double x, const double y, const double x1, const double y1, const double x2, const double y2){
+	double dx = x2 - x1, dy = y2 - y1;
+	double l2 = dx*dx + dy*dy;
+	double t = l2 > 0 ? std::max(0., std::min(1., ((x - x1)*dx + (y - y1)*dy)/l2)) : 0.;
+	return std::sqrt(std::pow(x - x1 - t*dx, 2) + std::pow(y - y1 - t*dy, 2));
+}
+
+
+bool TPrimitive::InBoundingBox(const double p1[3], const double p2[3]) const{
+	double lower[3], upper[3];
+	if (!Bounds(lower, upper))
+		return false;
+	return CGAL::do_intersect(CSegment(CPoint(p1[0], p1[1], p1[2]), CPoint(p2[0], p2[1], p2[2])), CGAL::Bbox_3(lower[0], lower[1], lower[2], upper[0], upper[1], upper[2]));
+}
+
+
+TBoxPrimitive::TBoxPrimitive(const unsigned aID, const double alower[3], const double aupper[3]): TPrimitive(aID){
+	for (int i = 0; i < 3; ++i){
+		if (alower[i] >= aupper[i])
+			throw std::runtime_error((boost::format("Lower corner of box %1% has to be smaller than upper corner!") % ID).str());
+		lower[i] = alower[i];
+		upper[i] = aupper[i];
+	}
+}
+
+void TBoxPrimitive::Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const{
+	double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	for (int i = 0; i < 3; ++i){
+		if (d[i] == 0)
+			continue;
+		for (int side = 0; side < 2; ++side){
+			double s = ((side == 0 ? lower[i] : upper[i]) - p1[i])/d[i];
+			if (s < 0 || s > 1)
+				continue;
+			int j = (i + 1) % 3, k = (i + 2) % 3;
+			double pj = p1[j] + s*d[j], pk = p1[k] + s*d[k];
+			if (pj >= lower[j] && pj <= upper[j] && pk >= lower[k] && pk <= upper[k]){
+				double n[3] = {0., 0., 0.};
+				n[i] = side == 0 ? -1. : 1.;
+				colls.push_back(TCollision(s, n, d, ID));
+			}
+		}
+	}
+}
+
+bool TBoxPrimitive::Contains(const double p[3]) const{
+	return	p[0] >= lower[0] && p[0] <= upper[0] && p[1] >= lower[1] && p[1] <= upper[1] && p[2] >= lower[2] && p[2] <= upper[2];
+}
+
+double TBoxPrimitive::Distance(const double p[3]) const{
+	if (Contains(p)){ // distance to closest face
+		double d = std::numeric_limits<double>::infinity();
+		for (int i = 0; i < 3; ++i)
+			d = std::min(d, std::min(p[i] - lower[i], upper[i] - p[i]));
+		return d;
+	}
+	double d2 = 0;
+	for (int i = 0; i < 3; ++i)
+		d2 += std::pow(std::max(0., std::max(lower[i] - p[i], p[i] - upper[i])), 2);
+	return std::sqrt(d2);
+}
+
+bool TBoxPrimitive::Bounds(double alower[3], double aupper[3]) const{
+	std::copy(lower, lower + 3, alower);
+	std::copy(upper, upper + 3, aupper);
+	return true;
+}
+
+
+TRevolvedPrimitive::TRevolvedPrimitive(const unsigned aID, const double p1[3], const double p2[3], const double rin1, const double rout1, const double rin2, const double rout2)
+		: TPrimitive(aID), rin{rin1, rin2}, rout{rout1, rout2}{
+	double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	length = std::sqrt(Dot(d, d));
+	if (length <= 0)
+		throw std::runtime_error((boost::format("End points of axis of solid %1% have to be different!") % ID).str());
+	for (int i = 0; i < 3; ++i){
+		origin[i] = p1[i];
+		axis[i] = d[i]/length;
+	}
+	for (int i = 0; i < 2; ++i){
+		if (rin[i] < 0 || rout[i] < rin[i])
+			throw std::runtime_error((boost::format("Radii of solid %1% have to fulfill 0 <= inner radius <= outer radius!") % ID).str());
+	}
+	if (rout[0] == 0 && rout[1] == 0)
+		throw std::runtime_error((boost::format("Outer radius of solid %1% has to be larger than zero!") % ID).str());
+}
+
+void TRevolvedPrimitive::Cylindrical(const double p[3], double &h, double &rho) const{
+	double w[3] = {p[0] - origin[0], p[1] - origin[1], p[2] - origin[2]};
+	h = Dot(w, axis);
+	rho = std::sqrt(std::max(0., Dot(w, w) - h*h));
+}
+
+void TRevolvedPrimitive::LateralCollisions(const double p1[3], const double p2[3], const double r0, const double r1, const bool outer, std::vector<TCollision> &colls) const{
+	double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	double w[3] = {p1[0] - origin[0], p1[1] - origin[1], p1[2] - origin[2]};
+	double h0 = Dot(w, axis), dh = Dot(d, axis);
+	double b = (r1 - r0)/length; // radius changes by b per unit length along axis
+	double r = r0 + b*h0;
+	// |w + s*d|^2 - (h0 + s*dh)^2 = (r + s*b*dh)^2
+	double s[2];
+	int n = SolveQuadratic(Dot(d, d) - dh*dh - b*b*dh*dh, 2*(Dot(w, d) - h0*dh - b*dh*r), Dot(w, w) - h0*h0 - r*r, s);
+	for (int i = 0; i < n; ++i){
+		if (s[i] < 0 || s[i] > 1)
+			continue;
+		double h = h0 + s[i]*dh;
+		if (h < 0 || h > length || r + s[i]*b*dh < 0) // outside of end faces or on mirrored sheet of cone
+			continue;
+		double q[3]; // vector from axis to intersection point
+		for (int j = 0; j < 3; ++j)
+			q[j] = w[j] + s[i]*d[j] - h*axis[j];
+		double rho = std::sqrt(Dot(q, q));
+		if (rho == 0)
+			continue; // segment touches tip of cone
+		double normal[3];
+		for (int j = 0; j < 3; ++j)
+			normal[j] = q[j]/rho - b*axis[j];
+		double norm = std::sqrt(Dot(normal, normal))*(outer ? 1. : -1.);
+		for (int j = 0; j < 3; ++j)
+			normal[j] /= norm;
+		colls.push_back(TCollision(s[i], normal, d, ID));
+	}
+}
+
+void TRevolvedPrimitive::Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const{
+	LateralCollisions(p1, p2, rout[0], rout[1], true, colls);
+	if (rin[0] > 0 || rin[1] > 0)
+		LateralCollisions(p1, p2, rin[0], rin[1], false, colls);
+
+	double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	double h1, rho1, h2, rho2;
+	Cylindrical(p1, h1, rho1);
+	Cylindrical(p2, h2, rho2);
+	if (h1 == h2)
+		return;
+	for (int face = 0; face < 2; ++face){ // end faces
+		double s = ((face == 0 ? 0. : length) - h1)/(h2 - h1);
+		if (s < 0 || s > 1)
+			continue;
+		double q[3] = {p1[0] + s*d[0], p1[1] + s*d[1], p1[2] + s*d[2]};
+		double h, rho;
+		Cylindrical(q, h, rho);
+		if (rho >= rin[face] && rho <= rout[face]){
+			double normal[3] = {axis[0], axis[1], axis[2]};
+			if (face == 0)
+				normal[0] = -normal[0], normal[1] = -normal[1], normal[2] = -normal[2];
+			colls.push_back(TCollision(s, normal, d, ID));
+		}
+	}
+}
+
+bool TRevolvedPrimitive::Contains(const double p[3]) const{
+	double h, rho;
+	Cylindrical(p, h, rho);
+	if (h < 0 || h > length)
+		return false;
+	double f = h/length;
+	return rho >= rin[0] + f*(rin[1] - rin[0]) && rho <= rout[0] + f*(rout[1] - rout[0]);
+}
+
+double TRevolvedPrimitive::Distance(const double p[3]) const{
+	// distance to surface of revolution equals distance to its cross section in the half-plane containing the point
+	double h, rho;
+	Cylindrical(p, h, rho);
+	double d = std::min(SegmentDistance2D(rho, h, rin[0], 0., rout[0], 0.), SegmentDistance2D(rho, h, rin[1], length, rout[1], length));
+	d = std::min(d, SegmentDistance2D(rho, h, rout[0], 0., rout[1], length));
+	if (rin[0] > 0 || rin[1] > 0)
+		d = std::min(d, SegmentDistance2D(rho, h, rin[0], 0., rin[1], length));
+	return d;
+}
+
+bool TRevolvedPrimitive::Bounds(double lower[3], double upper[3]) const{
+	for (int i = 0; i < 3; ++i){
+		double e = std::sqrt(std::max(0., 1. - axis[i]*axis[i])); // extent of a unit circle perpendicular to axis in direction i
+		double x1 = origin[i], x2 = origin[i] + length*axis[i];
+		lower[i] = std::min(x1 - e*rout[0], x2 - e*rout[1]);
+		upper[i] = std::max(x1 + e*rout[0], x2 + e*rout[1]);
+	}
+	return true;
+}
+
+
+TSpherePrimitive::TSpherePrimitive(const unsigned aID, const double acenter[3], const double aradius): TPrimitive(aID), center{acenter[0], acenter[1], acenter[2]}, radius(aradius){
+	if (radius <= 0)
+		throw std::runtime_error((boost::format("Radius of sphere %1% has to be larger than zero!") % ID).str());
+}
+
+void TSpherePrimitive::Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const{
+	double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	double w[3] = {p1[0] - center[0], p1[1] - center[1], p1[2] - center[2]};
+	double s[2];
+	int n = SolveQuadratic(Dot(d, d), 2*Dot(w, d), Dot(w, w) - radius*radius, s);
+	for (int i = 0; i < n; ++i){
+		if (s[i] < 0 || s[i] > 1)
+			continue;
+		double normal[3] = {(w[0] + s[i]*d[0])/radius, (w[1] + s[i]*d[1])/radius, (w[2] + s[i]*d[2])/radius};
+		colls.push_back(TCollision(s[i], normal, d, ID));
+	}
+}
+
+bool TSpherePrimitive::Contains(const double p[3]) const{
+	double w[3] = {p[0] - center[0], p[1] - center[1], p[2] - center[2]};
+	return Dot(w, w) <= radius*radius;
+}
+
+double TSpherePrimitive::Distance(const double p[3]) const{
+	double w[3] = {p[0] - center[0], p[1] - center[1], p[2] - center[2]};
+	return std::abs(std::sqrt(Dot(w, w)) - radius);
+}
+
+bool TSpherePrimitive::Bounds(double lower[3], double upper[3]) const{
+	for (int i = 0; i < 3; ++i){
+		lower[i] = center[i] - radius;
+		upper[i] = center[i] + radius;
+	}
+	return true;
+}
+
+
+TPlanePrimitive::TPlanePrimitive(const unsigned aID, const double apoint[3], const double anormal[3]): TPrimitive(aID), point{apoint[0], apoint[1], apoint[2]}{
+	double n = std::sqrt(Dot(anormal, anormal));
+	if (n <= 0)
+		throw std::runtime_error((boost::format("Normal of plane %1% must not be zero!") % ID).str());
+	for (int i = 0; i < 3; ++i)
+		normal[i] = anormal[i]/n;
+}
+
+void TPlanePrimitive::Collisions(const double p1[3], const double p2[3], std::vector<TCollision> &colls) const{
+	double d[3] = {p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]};
+	double dn = Dot(d, normal);
+	if (dn == 0)
+		return;
+	double w[3] = {point[0] - p1[0], point[1] - p1[1], point[2] - p1[2]};
+	double s = Dot(w, normal)/dn;
+	if (s >= 0 && s <= 1)
+		colls.push_back(TCollision(s, normal, d, ID));
+}
+
+bool TPlanePrimitive::Contains(const double p[3]) const{
+	double w[3] = {p[0] - point[0], p[1] - point[1], p[2] - point[2]};
+	return Dot(w, normal) <= 0;
+}
+
+double TPlanePrimitive::Distance(const double p[3]) const{
+	double w[3] = {p[0] - point[0], p[1] - point[1], p[2] - point[2]};
+	return std::abs(Dot(w, normal));
+}
+
+bool TPlanePrimitive::Bounds(double lower[3], double upper[3]) const{
+	return false;
+}
+
+
+bool IsPrimitive(const std::string &definition){
+	std::string type = definition.substr(0, definition.find(':'));
+	return definition.find(':') != std::string::npos &&
+			(type == "box" || type == "cylinder" || type == "tube" || type == "cone" || type == "sphere" || type == "plane");
+}
+
+
+std::unique_ptr<TPrimitive> CreatePrimitive(const std::string &definition, const unsigned ID){
+	size_t colon = definition.find(':');
+	std::string type = definition.substr(0, colon);
+	std::vector<double> p;
+	std::string params = definition.substr(colon + 1);
+	std::replace(params.begin(), params.end(), ',', ' ');
+	std::istringstream ss(params);
+	double v;
+	while (ss >> v)
+		p.push_back(v);
+	if (!ss.eof())
+		throw std::runtime_error((boost::format("Could not read parameters of %1% %2%!") % type % ID).str());
+
+	const std::map<std::string, size_t> nparams = {{"box", 6}, {"cylinder", 7}, {"tube", 8}, {"cone", 8}, {"sphere", 4}, {"plane", 6}};
+	auto n = nparams.find(type);
+	if (n == nparams.end())
+		throw std::runtime_error((boost::format("Unknown primitive type %1% for solid %2%!") % type % ID).str());
+	if (p.size() != n->second)
+		throw std::runtime_error((boost::format("%1% %2% needs %3% parameters, but %4% were given!") % type % ID % n->second % p.size()).str());
+
+	if (type == "box")
+		return std::unique_ptr<TPrimitive>(new TBoxPrimitive(ID, &p[0], &p[3]));
+	else if (type == "cylinder")
+		return std::unique_ptr<TPrimitive>(new TRevolvedPrimitive(ID, &p[0], &p[3], 0., p[6], 0., p[6]));
+	else if (type == "tube")
+		return std::unique_ptr<TPrimitive>(new TRevolvedPrimitive(ID, &p[0], &p[3], p[6], p[7], p[6], p[7]));
+	else if (type == "cone")
+		return std::unique_ptr<TPrimitive>(new TRevolvedPrimitive(ID, &p[0], &p[3], 0., p[6], 0., p[7]));
+	else if (type == "sphere")
+		return std::unique_ptr<TPrimitive>(new TSpherePrimitive(ID, &p[0], p[3]));
+	else
+		return std::unique_ptr<TPrimitive>(new TPlanePrimitive(ID, &p[0], &p[3]));
+}
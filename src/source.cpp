@@ -59,13 +59,51 @@ TParticle* TParticleSource::CreateParticle(double t, double x, double y, double
 }
 
 
+void TSurfaceSource::FindSourceTriangles(const TGeometry &geometry){
+	CCuboid bbox = GetSourceVolumeBoundingBox();
+	std::vector<double> areas;
+	unsigned nstraddling = 0;
+	geometry.mesh.ForEachTriangle([&](const CKernel::Triangle_3 &tri, const CVector &normal, const unsigned ID){
+		if (!CGAL::do_intersect(tri.bbox(), bbox.bbox()))
+			return;
+		bool straddling = TriangleIntersectsBoundary(tri);
+		if (!straddling){ // triangle is completely inside or outside, check its centroid
+			CPoint c = CGAL::centroid(tri);
+			if (!InSourceVolume(c.x(), c.y(), c.z()))
+				return;
+		}
+		else
+			++nstraddling;
+		triangles.push_back({tri, normal, straddling});
+		areas.push_back(std::sqrt(tri.squared_area()));
+	});
+	if (triangles.empty())
+		throw std::runtime_error("Could not find any surface inside the surface source's volume!");
+	triangle_sampler = std::alias_distribution<size_t>(areas.begin(), areas.end());
+	cout << "Found " << triangles.size() << " triangles in surface source, " << nstraddling << " crossing its boundary\n";
+}
+
+
 TParticle* TSurfaceSource::CreateParticle(TMCGenerator &mc, TGeometry &geometry, const TFieldManager &field){
-    CPoint p;
-    CVector nv;
-    unsigned ID;
-    do{
-        geometry.mesh.RandomPointOnSurface(p, nv, ID, mc, GetSourceVolumeBoundingBox());
-    } while(!InSourceVolume(p[0], p[1], p[2]));
+	if (triangles.empty())
+		FindSourceTriangles(geometry);
+
+	CPoint p;
+	CVector nv;
+	std::uniform_real_distribution<double> unidist01(0, 1);
+	while (true){
+		const TSourceTriangle &tri = triangles[triangle_sampler(mc)];
+		double a = unidist01(mc); // generate random point on triangle (see Numerical Recipes 3rd ed., p. 1114)
+		double b = unidist01(mc);
+		if (a+b > 1){
+			a = 1 - a;
+			b = 1 - b;
+		}
+		p = tri.triangle[0] + a*(tri.triangle[1] - tri.triangle[0]) + b*(tri.triangle[2] - tri.triangle[0]);
+		nv = tri.normal;
+		if (!tri.straddling || InSourceVolume(p[0], p[1], p[2])) // only points on triangles crossing the boundary need to be checked
+			break;
+	}
 	p = p + nv*REFLECT_TOLERANCE; // move point slightly away from surface
 
 	double Ekin = spectrum(mc);
@@ -0,0 +1,724 @@
+/**
+ * \file
+ * Integration schemes for particle trajectories.
+ */
+
+#include "stepper.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "globals.h"
+#include "adiabacity.h"
+
+/**
+ * Cubic Hermite interpolation between two points with known derivatives
+ *
+ * @param theta Relative position between both points (0..1)
+ * @param h Distance between both points
+ * @param y0 Value at first point
+ * @param dydx0 Derivative at first point
+ * @param y1 Value at second point
+ * @param dydx1 Derivative at second point
+ *
+ * @return Returns interpolated value
+ */
+static double Hermite(const double theta, const double h, const double y0, const double dydx0, const double y1, const double dydx1){
+	double theta_m_1 = theta - 1;
+	return	(1 + 2*theta)*theta_m_1*theta_m_1*y0 + theta*theta_m_1*theta_m_1*h*dydx0
+			+ theta*theta*(3 - 2*theta)*y1 + theta*theta*theta_m_1*h*dydx1;
+}
+
+
+TRK78Stepper::TRK78Stepper(const value_type abserr, const value_type relerr, const system_type &asystem)
+		: stepper(boost::numeric::odeint::make_controlled(abserr, relerr, boost::numeric::odeint::runge_kutta_fehlberg78<state_type, value_type>())), system(asystem),
+		  x0(0), x1(0), dt(0){
+	y0.fill(0);
+	y1.fill(0);
+	dydx0.fill(0);
+	dydx1.fill(0);
+}
+
+
+void TRK78Stepper::initialize(const state_type &y, const value_type x, const value_type adt){
+	x0 = x1 = x;
+	y0 = y1 = y;
+	dt = adt;
+	system(y1, dydx1, x1);
+	dydx0 = dydx1;
+}
+
+
+void TRK78Stepper::do_step(){
+	state_type y = y1;
+	value_type x = x1;
+	boost::numeric::odeint::failed_step_checker fail_checker; // throws if step size adjustment fails too often
+	while (stepper.try_step(std::cref(system), y, dydx1, x, dt) == boost::numeric::odeint::fail)
+		fail_checker();
+	x0 = x1;
+	y0 = y1;
+	dydx0 = dydx1;
+	x1 = x;
+	y1 = y;
+	system(y1, dydx1, x1); // derivatives at new point are also needed as first stage of next step
+}
+
+
+void TRK78Stepper::calc_state(const value_type x, state_type &y) const{
+	value_type h = x1 - x0;
+	if (h == 0){
+		y = y1;
+		return;
+	}
+	value_type theta = (x - x0)/h;
+	for (int i = 0; i < STATE_VARIABLES; ++i)
+		y[i] = Hermite(theta, h, y0[i], dydx0[i], y1[i], dydx1[i]);
+}
+
+
+TBorisStepper::TBorisStepper(const double aq, const double amass, const double relerr, const double amaxlength, const force_type &aforce)
+		: force(aforce), q(aq), mass(amass), maxlength(amaxlength), omega(0), force_mid{0, 0, 0}, rotation{0, 0, 0}, x0(0), x1(0), dt(0){
+	if (relerr <= 0)
+		throw std::runtime_error("Boris stepper requires a relative error tolerance larger than zero!");
+	maxangle = std::sqrt(12*relerr); // rotation angle per step has an error of (omega*dt)^3/12, i.e. a relative phase error of (omega*dt)^2/12
+	y0.fill(0);
+	y1.fill(0);
+}
+
+
+double TBorisStepper::MaxStep() const{
+	double limit = std::numeric_limits<double>::infinity();
+	double v = std::sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+	if (omega > 0)
+		limit = std::min(limit, maxangle/omega);
+	if (v > 0)
+		limit = std::min(limit, maxlength/v);
+	return limit;
+}
+
+
+void TBorisStepper::initialize(const state_type &y, const value_type x, const value_type adt){
+	x0 = x1 = x;
+	y0 = y1 = y;
+	double B[3], F[3];
+	force(y1, x1, B, nullptr, F);
+	double v2 = y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5];
+	omega = std::abs(q)*std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2])*std::sqrt(1 - v2/c_0/c_0)/mass;
+	dt = std::min(adt, MaxStep());
+}
+
+
+void TBorisStepper::do_step(){
+	const value_type h = dt;
+	x0 = x1;
+	y0 = y1;
+
+	state_type ym = y0;
+	for (int i = 0; i < 3; ++i)
+		ym[i] += 0.5*h*y0[i + 3]; // drift to midpoint of step
+	double B[3], F[3];
+	force(ym, x0 + 0.5*h, B, nullptr, F);
+
+	double c2 = c_0*c_0;
+	double v0 = std::sqrt(y0[3]*y0[3] + y0[4]*y0[4] + y0[5]*y0[5]);
+	double gamma0 = 1/std::sqrt(1 - v0*v0/c2);
+	double u[3]; // relativistic momentum per mass, u = gamma*v
+	for (int i = 0; i < 3; ++i)
+		u[i] = gamma0*y0[i + 3] + 0.5*h*F[i]/mass; // first half of kick by non-magnetic forces
+	double gammam = std::sqrt(1 + (u[0]*u[0] + u[1]*u[1] + u[2]*u[2])/c2);
+	double *t = rotation, s[3];
+	for (int i = 0; i < 3; ++i){
+		force_mid[i] = F[i];
+		t[i] = 0.5*h*q*B[i]/mass/gammam;
+	}
+	double t2 = t[0]*t[0] + t[1]*t[1] + t[2]*t[2];
+	for (int i = 0; i < 3; ++i)
+		s[i] = 2*t[i]/(1 + t2);
+	double up[3] = {u[0] + u[1]*t[2] - u[2]*t[1], u[1] + u[2]*t[0] - u[0]*t[2], u[2] + u[0]*t[1] - u[1]*t[0]}; // rotation of momentum in magnetic field
+	u[0] += up[1]*s[2] - up[2]*s[1];
+	u[1] += up[2]*s[0] - up[0]*s[2];
+	u[2] += up[0]*s[1] - up[1]*s[0];
+	for (int i = 0; i < 3; ++i)
+		u[i] += 0.5*h*F[i]/mass; // second half of kick
+	double gamma1 = std::sqrt(1 + (u[0]*u[0] + u[1]*u[1] + u[2]*u[2])/c2);
+
+	for (int i = 0; i < 3; ++i){
+		y1[i + 3] = u[i]/gamma1;
+		y1[i] = ym[i] + 0.5*h*y1[i + 3]; // drift to end of step
+	}
+	double v1 = std::sqrt(y1[3]*y1[3] + y1[4]*y1[4] + y1[5]*y1[5]);
+	y1[6] = y0[6] + 0.5*h*(1/gamma0 + 1/gamma1); // proper time
+	y1[7] = y0[7]; // polarization does not change
+	y1[8] = y0[8] + 0.5*h*(v0 + v1); // path length
+	x1 = x0 + h;
+
+	omega = std::abs(q)*std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2])/mass/gammam;
+	dt = MaxStep();
+	if (!std::isfinite(dt)) // particle at rest in field-free region, keep step size
+		dt = h;
+}
+
+
+void TBorisStepper::calc_state(const value_type x, state_type &y) const{
+	value_type h = x1 - x0;
+	if (h == 0){
+		y = y1;
+		return;
+	}
+	value_type theta = (x - x0)/h;
+	for (int i = 0; i < 3; ++i)
+		y[i] = Hermite(theta, h, y0[i], y0[i + 3], y1[i], y1[i + 3]); // velocity is derivative of position
+	for (int i = 6; i < STATE_VARIABLES; ++i)
+		y[i] = y0[i] + theta*(y1[i] - y0[i]);
+
+	// repeat kicks and rotation of last step with fraction theta of the step size, exact for constant forces and for gyration in constant magnetic fields
+	double c2 = c_0*c_0;
+	double gamma0 = 1/std::sqrt(1 - (y0[3]*y0[3] + y0[4]*y0[4] + y0[5]*y0[5])/c2);
+	double u[3];
+	for (int i = 0; i < 3; ++i)
+		u[i] = gamma0*y0[i + 3] + 0.5*theta*h*force_mid[i]/mass;
+	double tabs = std::sqrt(rotation[0]*rotation[0] + rotation[1]*rotation[1] + rotation[2]*rotation[2]);
+	if (tabs > 0){
+		double phi = 2*std::atan(tabs)*theta; // Boris step rotates momentum by 2*atan(|t|) around -t
+		double n[3] = {-rotation[0]/tabs, -rotation[1]/tabs, -rotation[2]/tabs};
+		double ndotu = n[0]*u[0] + n[1]*u[1] + n[2]*u[2];
+		double ncrossu[3] = {n[1]*u[2] - n[2]*u[1], n[2]*u[0] - n[0]*u[2], n[0]*u[1] - n[1]*u[0]};
+		for (int i = 0; i < 3; ++i)
+			u[i] = u[i]*std::cos(phi) + ncrossu[i]*std::sin(phi) + n[i]*ndotu*(1 - std::cos(phi));
+	}
+	for (int i = 0; i < 3; ++i)
+		u[i] += 0.5*theta*h*force_mid[i]/mass;
+	double gamma = std::sqrt(1 + (u[0]*u[0] + u[1]*u[1] + u[2]*u[2])/c2);
+	for (int i = 0; i < 3; ++i)
+		y[i + 3] = u[i]/gamma;
+}
+
+
+/**
+ * Exception thrown if guiding-centre equations of motion are evaluated where there is no magnetic field
+ */
+class TZeroFieldError: public std::runtime_error{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+
+/**
+ * Construct orthonormal basis perpendicular to magnetic field, in which the gyration phase is measured
+ *
+ * @param b Unit vector along magnetic field
+ * @param e1 Returns first unit vector perpendicular to b
+ * @param e2 Returns second unit vector perpendicular to b, b x e1
+ */
+static void GyrationBasis(const double b[3], double e1[3], double e2[3]){
+	double a[3] = {0, 0, 0};
+	a[std::abs(b[0]) < 0.6 ? 0 : 1] = 1; // any axis not parallel to b
+	double ab = a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+	for (int i = 0; i < 3; ++i)
+		e1[i] = a[i] - ab*b[i];
+	double e1abs = std::sqrt(e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2]);
+	for (int i = 0; i < 3; ++i)
+		e1[i] /= e1abs;
+	e2[0] = b[1]*e1[2] - b[2]*e1[1];
+	e2[1] = b[2]*e1[0] - b[0]*e1[2];
+	e2[2] = b[0]*e1[1] - b[1]*e1[0];
+}
+
+
+TGuidingCentreStepper::TGuidingCentreStepper(const double aq, const double amass, const value_type abserr, const value_type relerr, const double amaxadiabaticity,
+											std::unique_ptr<TStepper> aorbitstepper, const force_type &aforce)
+		: orbitstepper(std::move(aorbitstepper)), gcstepper(boost::numeric::odeint::make_dense_output(abserr, relerr, boost::numeric::odeint::runge_kutta_dopri5<gc_state_type, value_type>())),
+		  force(aforce), q(aq), mass(amass), maxadiabaticity(amaxadiabaticity), gcmode(false), adiabaticity(0), moment(0), polarization(0){
+	if (q == 0)
+		throw std::runtime_error("Guiding-centre approximation is only applicable to charged particles!");
+	y0.fill(0);
+	y1.fill(0);
+}
+
+
+double TGuidingCentreStepper::Adiabaticity(const state_type &y, const value_type x) const{
+	double B[3], dBidxj[3][3], F[3];
+	force(y, x, B, dBidxj, F);
+	double Babs = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	if (Babs == 0)
+		return std::numeric_limits<double>::infinity();
+	double gamma = 1/std::sqrt(1 - (y[3]*y[3] + y[4]*y[4] + y[5]*y[5])/c_0/c_0);
+	return gyroadiabaticity(dBidxj[0][0], dBidxj[0][1], dBidxj[0][2], dBidxj[1][0], dBidxj[1][1], dBidxj[1][2], dBidxj[2][0], dBidxj[2][1], dBidxj[2][2],
+							Babs, gamma*mass*y[3], gamma*mass*y[4], gamma*mass*y[5], q);
+}
+
+
+double TGuidingCentreStepper::GyrationRadius(const state_type &y, const value_type x, double rho[3]) const{
+	double B[3], F[3];
+	force(y, x, B, nullptr, F);
+	double B2 = B[0]*B[0] + B[1]*B[1] + B[2]*B[2];
+	double gamma = 1/std::sqrt(1 - (y[3]*y[3] + y[4]*y[4] + y[5]*y[5])/c_0/c_0);
+	double f = gamma*mass/q/B2; // rho = gamma*m/q/B^2 * (B x v)
+	rho[0] = f*(B[1]*y[5] - B[2]*y[4]);
+	rho[1] = f*(B[2]*y[3] - B[0]*y[5]);
+	rho[2] = f*(B[0]*y[4] - B[1]*y[3]);
+	return std::abs(q)*std::sqrt(B2)/gamma/mass;
+}
+
+
+void TGuidingCentreStepper::ToGuidingCentre(const state_type &y, const value_type x, gc_state_type &g){
+	double B[3], F[3], b[3], e1[3], e2[3];
+	force(y, x, B, nullptr, F);
+	double Babs = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	for (int i = 0; i < 3; ++i)
+		b[i] = B[i]/Babs;
+	GyrationBasis(b, e1, e2);
+	double gamma = 1/std::sqrt(1 - (y[3]*y[3] + y[4]*y[4] + y[5]*y[5])/c_0/c_0);
+	double u[3] = {gamma*y[3], gamma*y[4], gamma*y[5]};
+	double upar = u[0]*b[0] + u[1]*b[1] + u[2]*b[2];
+	double uperp[3] = {u[0] - upar*b[0], u[1] - upar*b[1], u[2] - upar*b[2]};
+	moment = (uperp[0]*uperp[0] + uperp[1]*uperp[1] + uperp[2]*uperp[2])/2/Babs;
+	polarization = y[7];
+	g[0] = y[0];
+	g[1] = y[1];
+	g[2] = y[2];
+	g[3] = upar;
+	g[4] = y[6];
+	g[5] = y[8];
+	g[6] = std::atan2(uperp[0]*e2[0] + uperp[1]*e2[1] + uperp[2]*e2[2], uperp[0]*e1[0] + uperp[1]*e1[1] + uperp[2]*e1[2]);
+}
+
+
+void TGuidingCentreStepper::FromGuidingCentre(const gc_state_type &g, const value_type x, state_type &y) const{
+	y[0] = g[0];
+	y[1] = g[1];
+	y[2] = g[2];
+	y[6] = g[4];
+	y[7] = polarization;
+	y[8] = g[5];
+	double B[3], F[3], b[3] = {0, 0, 1}, e1[3], e2[3];
+	force(y, x, B, nullptr, F);
+	double Babs = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	if (Babs > 0){ // gyration is undefined without field, only parallel momentum is kept then
+		for (int i = 0; i < 3; ++i)
+			b[i] = B[i]/Babs;
+	}
+	GyrationBasis(b, e1, e2);
+	double uperp = std::sqrt(2*moment*Babs);
+	double u[3];
+	for (int i = 0; i < 3; ++i)
+		u[i] = g[3]*b[i] + uperp*(std::cos(g[6])*e1[i] + std::sin(g[6])*e2[i]);
+	double gamma = std::sqrt(1 + (u[0]*u[0] + u[1]*u[1] + u[2]*u[2])/c_0/c_0);
+	for (int i = 0; i < 3; ++i)
+		y[i + 3] = u[i]/gamma;
+}
+
+
+void TGuidingCentreStepper::GuidingCentreDerivs(const gc_state_type &g, gc_state_type &dgdx, const value_type x) const{
+	state_type y;
+	y.fill(0);
+	y[0] = g[0];
+	y[1] = g[1];
+	y[2] = g[2];
+	y[7] = polarization;
+	double B[3], dBidxj[3][3], F[3]; // F contains electric, gravitational, and magnetic-moment forces
+	force(y, x, B, dBidxj, F);
+	double Babs = std::sqrt(B[0]*B[0] + B[1]*B[1] + B[2]*B[2]);
+	if (Babs == 0)
+		throw TZeroFieldError("Guiding-centre approximation failed in zero magnetic field!");
+	double b[3] = {B[0]/Babs, B[1]/Babs, B[2]/Babs};
+	double gradB[3], kappa[3]; // gradient of |B| and field-line curvature (b*grad)b
+	for (int i = 0; i < 3; ++i)
+		gradB[i] = b[0]*dBidxj[0][i] + b[1]*dBidxj[1][i] + b[2]*dBidxj[2][i];
+	double bgradB = b[0]*gradB[0] + b[1]*gradB[1] + b[2]*gradB[2];
+	for (int i = 0; i < 3; ++i)
+		kappa[i] = (b[0]*dBidxj[i][0] + b[1]*dBidxj[i][1] + b[2]*dBidxj[i][2] - b[i]*bgradB)/Babs;
+
+	double upar = g[3];
+	double gamma = std::sqrt(1 + (upar*upar + 2*moment*Babs)/c_0/c_0);
+	double Fd[3]; // total force perpendicular to field, including grad-B and curvature forces
+	for (int i = 0; i < 3; ++i)
+		Fd[i] = F[i] - mass*moment/gamma*gradB[i] - mass*upar*upar/gamma*kappa[i];
+	double vd[3] = {(Fd[1]*b[2] - Fd[2]*b[1])/q/Babs, (Fd[2]*b[0] - Fd[0]*b[2])/q/Babs, (Fd[0]*b[1] - Fd[1]*b[0])/q/Babs}; // drift velocity F x B/q/B^2
+	for (int i = 0; i < 3; ++i)
+		dgdx[i] = upar/gamma*b[i] + vd[i];
+	dgdx[3] = (F[0]*b[0] + F[1]*b[1] + F[2]*b[2])/mass - moment/gamma*bgradB; // parallel force and mirror force
+	dgdx[4] = 1/gamma; // proper time
+	dgdx[5] = std::sqrt(dgdx[0]*dgdx[0] + dgdx[1]*dgdx[1] + dgdx[2]*dgdx[2]); // path length of guiding centre
+	dgdx[6] = -q*Babs/gamma/mass; // gyration phase
+}
+
+
+void TGuidingCentreStepper::Start(state_type y, const value_type x, value_type dt){
+	double rho[3];
+	if (gcmode && adiabaticity > maxadiabaticity){ // place particle back on its gyration orbit
+		double omega = GyrationRadius(y, x, rho);
+		for (int i = 0; i < 3; ++i)
+			y[i] += rho[i];
+		dt = std::min(dt, 0.1/omega); // guiding-centre steps are much too long to start full orbit integration
+		gcmode = false;
+	}
+	else if (!gcmode && adiabaticity < 0.5*maxadiabaticity){ // move particle to its guiding centre, switching back has some hysteresis to avoid frequent switching
+		GyrationRadius(y, x, rho);
+		for (int i = 0; i < 3; ++i)
+			y[i] -= rho[i];
+		gcmode = true;
+	}
+
+	if (gcmode){
+		gc_state_type g;
+		ToGuidingCentre(y, x, g);
+		gcstepper.initialize(g, x, dt);
+		FromGuidingCentre(g, x, y1);
+		y0 = y1;
+	}
+	else
+		orbitstepper->initialize(y, x, dt);
+}
+
+
+void TGuidingCentreStepper::initialize(const state_type &y, const value_type x, const value_type adt){
+	adiabaticity = Adiabaticity(y, x);
+	Start(y, x, adt);
+}
+
+
+void TGuidingCentreStepper::do_step(){
+	if ((gcmode && adiabaticity > maxadiabaticity) || (!gcmode && adiabaticity < 0.5*maxadiabaticity))
+		Start(current_state(), current_time(), current_time_step());
+
+	if (gcmode){
+		try{
+			gcstepper.do_step([this](const gc_state_type &g, gc_state_type &dgdx, const value_type x){ GuidingCentreDerivs(g, dgdx, x); });
+			y0 = y1;
+			FromGuidingCentre(gcstepper.current_state(), gcstepper.current_time(), y1);
+			adiabaticity = Adiabaticity(y1, gcstepper.current_time());
+			return;
+		}
+		catch(TZeroFieldError&){ // step ran into field-free region, repeat step with full equations of motion
+			adiabaticity = std::numeric_limits<double>::infinity();
+			Start(y1, gcstepper.current_time(), gcstepper.current_time_step());
+		}
+	}
+	orbitstepper->do_step();
+	adiabaticity = Adiabaticity(orbitstepper->current_state(), orbitstepper->current_time());
+}
+
+
+void TGuidingCentreStepper::calc_state(const value_type x, state_type &y) const{
+	if (gcmode){
+		gc_state_type g;
+		gcstepper.calc_state(x, g);
+		FromGuidingCentre(g, x, y);
+	}
+	else
+		orbitstepper->calc_state(x, y);
+}
+
+
+TBallisticStepper::TBallisticStepper(const double gravity[3], const double maxdeviation, const region_type &afieldfree, std::unique_ptr<TStepper> afieldstepper)
+	: fieldstepper(std::move(afieldstepper)), fieldfree(afieldfree), ballistic(false), fieldstarted(false), x0(0), x1(0), dt(0){
+	for (int i = 0; i < 3; ++i)
+		g[i] = gravity[i];
+	double gabs = std::sqrt(g[0]*g[0] + g[1]*g[1] + g[2]*g[2]);
+	// a parabola with sagitta s deviates up to 2*s/sqrt(3) from its chord according to the estimate in TParticle::Integrate,
+	// sagitta of 0.75*maxdeviation is reached after sqrt(6*maxdeviation/g)
+	maxstep = gabs > 0 ? std::sqrt(6*maxdeviation/gabs) : std::numeric_limits<value_type>::infinity();
+	y0.fill(0);
+	y1.fill(0);
+}
+
+
+void TBallisticStepper::ParabolaBounds(const state_type &y, const value_type h, double lower[3], double upper[3]) const{
+	for (int i = 0; i < 3; ++i){
+		double r = y[i] + y[i + 3]*h + 0.5*g[i]*h*h;
+		lower[i] = std::min(y[i], r);
+		upper[i] = std::max(y[i], r);
+		if (g[i] != 0 && -y[i + 3]/g[i] > 0 && -y[i + 3]/g[i] < h){ // apex of parabola lies within step
+			double apex = y[i] - 0.5*y[i + 3]*y[i + 3]/g[i];
+			lower[i] = std::min(lower[i], apex);
+			upper[i] = std::max(upper[i], apex);
+		}
+	}
+}
+
+
+void TBallisticStepper::Propagate(const state_type &y, const value_type h, state_type &yh) const{
+	for (int i = 0; i < 3; ++i){
+		yh[i] = y[i] + y[i + 3]*h + 0.5*g[i]*h*h;
+		yh[i + 3] = y[i + 3] + g[i]*h;
+	}
+
+	// proper time, integrand sqrt(1 - v^2/c^2) is smooth, so three-point Gauss-Legendre quadrature is exact to order h^6
+	static const double nodes[3] = {0.5 - 0.5*std::sqrt(0.6), 0.5, 0.5 + 0.5*std::sqrt(0.6)};
+	static const double weights[3] = {5./18., 8./18., 5./18.};
+	double dtau = 0;
+	for (int j = 0; j < 3; ++j){
+		double v2 = 0;
+		for (int i = 0; i < 3; ++i)
+			v2 += std::pow(y[i + 3] + g[i]*nodes[j]*h, 2);
+		dtau += weights[j]*std::sqrt(1 - v2/c_0/c_0);
+	}
+	yh[6] = y[6] + dtau*h;
+
+	yh[7] = y[7];
+
+	// path length: with u = t + v0*g/g^2 and w = |v(t)| = sqrt(g^2 u^2 + hp^2) the length is 0.5*(u*w + hp^2/|g|*asinh(|g|*u/hp)),
+	// differences are written such that they do not suffer from cancellation
+	double g2 = g[0]*g[0] + g[1]*g[1] + g[2]*g[2];
+	double w0 = std::sqrt(y[3]*y[3] + y[4]*y[4] + y[5]*y[5]);
+	double w1 = std::sqrt(yh[3]*yh[3] + yh[4]*yh[4] + yh[5]*yh[5]);
+	if (g2 == 0 || w0 + w1 == 0)
+		yh[8] = y[8] + w0*h;
+	else{
+		double gabs = std::sqrt(g2);
+		double u0 = (y[3]*g[0] + y[4]*g[1] + y[5]*g[2])/g2;
+		double u1 = u0 + h;
+		double hp2 = std::max(0., w0*w0 - u0*u0*g2); // squared velocity component perpendicular to gravity
+		double l = h*(w1 + u0*g2*(u1 + u0)/(w1 + w0)); // u1*w1 - u0*w0
+		if (hp2 > 0){
+			double hp = std::sqrt(hp2);
+			double d; // asinh(|g|*u1/hp) - asinh(|g|*u0/hp)
+			if (u0*u1 > 0)
+				d = std::asinh(gabs*h*(u1 + u0)/(u1*w0 + u0*w1));
+			else
+				d = std::asinh(gabs*u1/hp) - std::asinh(gabs*u0/hp);
+			l += hp2/gabs*d;
+		}
+		yh[8] = y[8] + 0.5*l;
+	}
+}
+
+
+void TBallisticStepper::initialize(const state_type &y, const value_type x, const value_type adt){
+	if (!ballistic) // keep step size of field stepper while particle moves ballistically
+		dt = adt;
+	y0 = y;
+	y1 = y;
+	x0 = x;
+	x1 = x;
+	ballistic = true;
+	fieldstarted = false;
+}
+
+
+void TBallisticStepper::do_step(){
+	const state_type y = current_state();
+	const value_type x = current_time();
+	double lower[3], upper[3];
+	value_type h = maxstep;
+	for (int i = 0; i < 10; ++i){ // try shorter steps if particle is close to a field
+		ParabolaBounds(y, h, lower, upper);
+		if (fieldfree(lower, upper)){
+			if (!ballistic)
+				dt = fieldstepper->current_time_step();
+			y0 = y;
+			x0 = x;
+			Propagate(y0, h, y1);
+			x1 = x0 + h;
+			ballistic = true;
+			fieldstarted = false;
+			return;
+		}
+		if (i == 0 && !fieldfree(&y[0], &y[0])) // particle is inside field
+			break;
+		h *= 0.5;
+	}
+
+	if (!fieldstarted){
+		fieldstepper->initialize(y, x, dt);
+		fieldstarted = true;
+	}
+	ballistic = false;
+	fieldstepper->do_step();
+}
+
+
+void TBallisticStepper::calc_state(const value_type x, state_type &y) const{
+	if (ballistic)
+		Propagate(y0, x - x0, y);
+	else
+		fieldstepper->calc_state(x, y);
+}
+
+
+bool TBallisticStepper::crossing_time(const double p[3], const double n[3], const value_type xa, const value_type xb, value_type &xc) const{
+	if (!ballistic)
+		return false;
+	// solve n*(r0 - p) + n*v0*t + 0.5*n*g*t^2 = 0
+	double a = 0.5*(n[0]*g[0] + n[1]*g[1] + n[2]*g[2]);
+	double b = n[0]*y0[3] + n[1]*y0[4] + n[2]*y0[5];
+	double c = n[0]*(y0[0] - p[0]) + n[1]*(y0[1] - p[1]) + n[2]*(y0[2] - p[2]);
+	double roots[2];
+	int nroots = 0;
+	if (a == 0){
+		if (b != 0)
+			roots[nroots++] = -c/b;
+	}
+	else{
+		double disc = b*b - 4*a*c;
+		if (disc < 0)
+			return false;
+		double q = -0.5*(b + std::copysign(std::sqrt(disc), b)); // numerically stable form of quadratic formula
+		roots[nroots++] = q/a;
+		if (q != 0)
+			roots[nroots++] = c/q;
+	}
+	value_type t = std::numeric_limits<value_type>::infinity();
+	for (int i = 0; i < nroots; ++i){
+		if (roots[i] >= xa - x0 && roots[i] <= xb - x0)
+			t = std::min(t, roots[i]);
+	}
+	if (std::isinf(t))
+		return false;
+	xc = x0 + t;
+	return true;
+}
+
+
+/**
+ * Butcher tableau of the Dormand-Prince 5(4) method, c and a of stages 2-7 and error coefficients (difference of fifth- and fourth-order weights)
+ */
+static const double DOPRI5_C[6] = {1./5., 3./10., 4./5., 8./9., 1., 1.};
+static const double DOPRI5_A[6][6] = {
+		{1./5., 0, 0, 0, 0, 0},
+		{3./40., 9./40., 0, 0, 0, 0},
+		{44./45., -56./15., 32./9., 0, 0, 0},
+		{19372./6561., -25360./2187., 64448./6561., -212./729., 0, 0},
+		{9017./3168., -355./33., 46732./5247., 49./176., -5103./18656., 0},
+		{35./384., 0, 500./1113., 125./192., -2187./6784., 11./84.}};
+static const double DOPRI5_DC[7] = {35./384. - 5179./57600., 0, 500./1113. - 7571./16695., 125./192. - 393./640., -2187./6784. + 92097./339200., 11./84. - 187./2100., -1./40.};
+
+
+void TBatchStepper::TLane::initialize(const state_type &y, const value_type x, const value_type dt){
+	x0 = x1 = x;
+	y0 = y1 = y;
+	for (int j = 0; j < STATE_VARIABLES; ++j)
+		batch.y[j][index] = y[j];
+	batch.x[index] = x;
+	batch.dt[index] = dt;
+	batch.status[index] = stepping;
+	batch.derivvalid[index] = false;
+	batch.fails[index] = 0;
+}
+
+
+void TBatchStepper::TLane::do_step(){
+	throw std::logic_error("Lanes of a batch stepper can only be advanced together by TBatchStepper::do_step!");
+}
+
+
+void TBatchStepper::TLane::calc_state(const value_type x, state_type &y) const{
+	// dense output of odeint's runge_kutta_dopri5
+	value_type h = x1 - x0;
+	if (h == 0){
+		y = y1;
+		return;
+	}
+	const value_type theta = (x - x0)/h;
+	const value_type X1 = 5.*(2558722523. - 31403016.*theta)/11282082432.;
+	const value_type X3 = 100.*(882725551. - 15701508.*theta)/32700410799.;
+	const value_type X4 = 25.*(443332067. - 31403016.*theta)/1880347072.;
+	const value_type X5 = 32805.*(23143187. - 3489224.*theta)/199316789632.;
+	const value_type X6 = 55.*(29972135. - 7076736.*theta)/822651844.;
+	const value_type X7 = 10.*(7414447. - 829305.*theta)/29380423.;
+	const value_type theta_m_1 = theta - 1;
+	const value_type theta_sq = theta*theta;
+	const value_type A = theta_sq*(3 - 2*theta);
+	const value_type B = theta_sq*theta_m_1;
+	const value_type C = theta_sq*theta_m_1*theta_m_1;
+	const value_type D = theta*theta_m_1*theta_m_1;
+	const value_type b[6] = {A*DOPRI5_A[5][0] - C*X1 + D, A*DOPRI5_A[5][2] + C*X3, A*DOPRI5_A[5][3] - C*X4, A*DOPRI5_A[5][4] + C*X5, A*DOPRI5_A[5][5] - C*X6, B + C*X7};
+	for (int j = 0; j < STATE_VARIABLES; ++j)
+		y[j] = y0[j] + h*(b[0]*k[0][j] + b[1]*k[1][j] + b[2]*k[2][j] + b[3]*k[3][j] + b[4]*k[4][j] + b[5]*k[5][j]);
+}
+
+
+TBatchStepper::TBatchStepper(const unsigned acapacity, const batch_system_type &asystem)
+		: system(asystem), capacity(acapacity), abserr(acapacity, 0), relerr(acapacity, 0), x(acapacity, 0), xtmp(acapacity, 0), dt(acapacity, 0),
+		  status(acapacity, idle), derivvalid(acapacity, false), fails(acapacity, 0){
+	for (int j = 0; j < STATE_VARIABLES; ++j){
+		y[j].assign(capacity, 0);
+		ytmp[j].assign(capacity, 0);
+		for (auto &ks: k)
+			ks[j].assign(capacity, 0);
+	}
+	for (unsigned i = 0; i < capacity; ++i)
+		lanes.emplace_back(new TLane(*this, i));
+	active.reserve(capacity);
+	startlanes.reserve(capacity);
+}
+
+
+void TBatchStepper::Stage(const int s, const value_type c, const value_type a[6]){
+	for (unsigned i = 0; i < capacity; ++i)
+		xtmp[i] = x[i] + c*dt[i];
+	for (int j = 0; j < STATE_VARIABLES; ++j){
+		value_type *yt = ytmp[j].data();
+		const value_type *y0 = y[j].data(), *h = dt.data();
+		for (unsigned i = 0; i < capacity; ++i){ // runs over all lanes, so the compiler can vectorize it, unoccupied lanes are ignored later
+			value_type sum = 0;
+			for (int l = 0; l < s; ++l)
+				sum += a[l]*k[l][j][i];
+			yt[i] = y0[i] + h[i]*sum;
+		}
+	}
+	system(active, xtmp, ytmp, k[s]);
+}
+
+
+void TBatchStepper::do_step(){
+	active.clear();
+	startlanes.clear();
+	for (unsigned i = 0; i < capacity; ++i){
+		if (status[i] == idle || status[i] == failed)
+			continue;
+		active.push_back(i);
+		if (!derivvalid[i])
+			startlanes.push_back(i);
+	}
+	if (active.empty())
+		return;
+	if (!startlanes.empty()){
+		system(startlanes, x, y, k[0]); // derivatives at start point of each lane, later reused from last stage of previous step (first same as last)
+		for (auto i: startlanes)
+			derivvalid[i] = true;
+	}
+
+	for (int s = 1; s < 7; ++s)
+		Stage(s, DOPRI5_C[s - 1], DOPRI5_A[s - 1]);
+
+	for (auto i: active){
+		// error estimate and step-size control like odeint's controlled_runge_kutta with default_error_checker
+		value_type h = dt[i];
+		value_type err = 0;
+		for (int j = 0; j < STATE_VARIABLES; ++j){
+			value_type xerr = 0;
+			for (int l = 0; l < 7; ++l)
+				xerr += DOPRI5_DC[l]*k[l][j][i];
+			err = std::max(err, std::abs(h*xerr)/(abserr[i] + relerr[i]*(std::abs(y[j][i]) + std::abs(h)*std::abs(k[0][j][i]))));
+		}
+		if (err > 1){
+			dt[i] = h*std::max(0.9*std::pow(err, -1./3.), 0.2);
+			status[i] = ++fails[i] >= 500 ? failed : stepping;
+			continue;
+		}
+
+		TLane &l = *lanes[i];
+		l.x0 = x[i];
+		l.x1 = x[i] + h;
+		for (int j = 0; j < STATE_VARIABLES; ++j){
+			l.y0[j] = y[j][i];
+			l.y1[j] = ytmp[j][i];
+			l.k[0][j] = k[0][j][i];
+			for (int s = 2; s < 7; ++s)
+				l.k[s - 1][j] = k[s][j][i];
+			y[j][i] = ytmp[j][i];
+			k[0][j][i] = k[6][j][i]; // last stage is derivative at new point
+		}
+		x[i] = l.x1;
+		if (err < 0.5){
+			err = std::max(std::pow(5., -5.), err);
+			dt[i] = h*0.9*std::pow(err, -1./5.);
+		}
+		fails[i] = 0;
+		status[i] = accepted;
+	}
+}
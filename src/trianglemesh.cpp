@@ -2,7 +2,21 @@
 
 #include <fstream>
 #include <random>
+#include <cstring>
+#include <set>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <unordered_map>
+#include <array>
+#include <cctype>
+#include <cmath>
 #include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <CGAL/Polygon_mesh_processing/polygon_soup_to_polygon_mesh.h>
 #include <CGAL/Polygon_mesh_processing/repair_polygon_soup.h>
 #include <CGAL/Polygon_mesh_processing/self_intersections.h>
@@ -13,73 +27,51 @@
 #include <CGAL/Polygon_mesh_processing/repair.h>
 
 
-// read triangles from STL-file
-std::string TTriangleMesh::ReadFile(const std::string &filename, const int ID){
-	std::ifstream f(filename, std::fstream::binary);
-	if (!f.is_open())
-		throw std::runtime_error( (boost::format("Could not open %1%") % filename).str() );
+static const char MESHCACHE_MAGIC[8] = {'P','T','M','E','S','H','2','\0'}; ///< identifier at beginning of mesh cache files
 
-	char header[80];
-	f.read(header, 80); // read 80-byte header
-	std::string sldname(std::move(header), 80);
-	sldname.erase(sldname.find_last_not_of(" ") + 1); // strip trailing whitespace from header
+/**
+ * Summary of mesh validation, printed after loading a mesh
+ */
+struct TMeshSummary{
+    uint64_t filefaces; ///< number of triangles in file
+    uint64_t components; ///< number of connected components
+    uint64_t affected_components; ///< number of components that are not closed, do not bound a volume, or are self-intersecting
+    double border_length; ///< total length of holes [m]
+    double self_intersecting_area; ///< total area of self-intersecting triangles [m2]
+    double area; ///< surface area [m2]
+    double volume; ///< volume [m3]
+};
 
-	unsigned int filefacecount;
-	f.read((char*)&filefacecount,4);
-	if (filefacecount == 0)
-		throw std::runtime_error( (boost::format("%1% contains no triangles") % filename).str() );
-	std::cout << "Reading '" << filename << "' containing " << filefacecount << " triangles ... ";    // print header
 
-	std::vector<CPoint> vertices;
-	std::vector<std::vector<size_t> > faces;
-	while (f){
-		f.seekg(3*4,std::fstream::cur);  // skip normal in STL-file (will be calculated from vertices)
-        std::vector<size_t> vidx;
-		for (short j = 0; j < 3; j++){
-		    float v[3];
-		    f.read((char*)v,12);
-			if (f) {
-                CPoint p(std::abs(v[0]) < REFLECT_TOLERANCE ? 0. : v[0], std::abs(v[1]) < REFLECT_TOLERANCE ? 0. : v[1], std::abs(v[2]) < REFLECT_TOLERANCE ? 0. : v[2]);
-                auto vertex = vertices.end(); //std::find_if(vertices.begin(), vertices.end(), [&p](const CPoint &p2) { return CGAL::squared_distance(p, p2) < std::pow(REFLECT_TOLERANCE, 2); });
-                vidx.push_back(std::distance(vertices.begin(), vertex));
-                if (vertex == vertices.end())
-                    vertices.push_back(p);
-            }
-		}
-		if (f) {
-            faces.push_back(vidx);
-            f.seekg(2, std::fstream::cur);    // 2 attribute bytes, not used in the STL standard (http://www.ennex.com/~fabbers/StL.asp)
-        }
-	}
-	f.close();
+// print validation summary of a mesh
+static void PrintSummary(const size_t faces, const TMeshSummary &summary, std::ostream &out, std::ostream &err){
+    auto err_precision = err.precision(3);
+    auto out_precision = out.precision(3);
+    out << "built mesh with " << faces << " triangles and " << summary.components << " components (" << summary.area*1e4 << "cm2, " << summary.volume*1e6 << "cm3)\n";
+    if (summary.affected_components > 0) {
+        err << "\nWarning: " << summary.affected_components << " of " << summary.components << " components have holes with total circumference "
+                  << summary.border_length * 1e2 << "cm and " << summary.self_intersecting_area * 1e4
+                  << "cm2 of their area is self-intersecting!\n\n";
+    }
+    out.precision(out_precision);
+    err.precision(err_precision);
+}
 
-	if (faces.size() != filefacecount)
-		throw std::runtime_error( (boost::format("%1% should contain %2% triangles but read %3%") % filename % filefacecount % faces.size()).str() );
 
+// check all components of mesh for holes and self-intersections
+static void ValidateMesh(CMesh &mesh, TMeshSummary &summary){
     namespace PMP = CGAL::Polygon_mesh_processing;
     typedef boost::graph_traits<CMesh>::face_descriptor fd;
-    auto cerr_precision = std::cerr.precision(3);
-    auto cout_precision = std::cout.precision(3);
-    PMP::repair_polygon_soup(vertices, faces/*, CGAL::parameters::require_same_orientation(true)*/);
-    PMP::orient_polygon_soup(vertices, faces);
-    std::unique_ptr<CMesh> mesh(new CMesh());
-
-    if (not PMP::is_polygon_soup_a_polygon_mesh(faces))
-        //throw(std::runtime_error("Triangles do not form a mesh"));
-        std::cerr << "Triangles do not form a mesh\n";
-    PMP::polygon_soup_to_polygon_mesh(vertices, faces, *mesh);
-//    CGAL::Polygon_mesh_processing::duplicate_non_manifold_vertices(*mesh);
-    double A = PMP::area(*mesh)*1e4;
-    double V = PMP::volume(*mesh)*1e6;
-
-    auto fccmap = mesh->add_property_map<fd, boost::graph_traits<CMesh>::faces_size_type>("f:CC").first;
-    auto num = PMP::connected_components(*mesh, fccmap);
-    std::cout << "built mesh with " << mesh->number_of_faces() << " triangles and " << num << " components (" << A << "cm2, " << V << "cm3)\n";
-    int affected_components = 0;
-    double border_length = 0.;
-    double self_intersecting_area = 0.;
-    for (size_t i = 0; i < num; ++i) {
-        CGAL::Face_filtered_graph<CMesh> ffg(*mesh, i, fccmap);
+    summary.area = PMP::area(mesh);
+    summary.volume = PMP::volume(mesh);
+
+    auto fccmap = mesh.add_property_map<fd, boost::graph_traits<CMesh>::faces_size_type>("f:CC").first;
+    summary.components = PMP::connected_components(mesh, fccmap);
+    summary.affected_components = 0;
+    summary.border_length = 0.;
+    summary.self_intersecting_area = 0.;
+    for (size_t i = 0; i < summary.components; ++i) {
+        CGAL::Face_filtered_graph<CMesh> ffg(mesh, i, fccmap);
         bool not_closed = not CGAL::is_closed(ffg);
         bool not_bounding = not PMP::does_bound_a_volume(ffg);
         bool self_intersecting = PMP::does_self_intersect(ffg);
@@ -87,7 +79,7 @@ std::string TTriangleMesh::ReadFile(const std::string &filename, const int ID){
             std::vector<boost::graph_traits<CMesh>::halfedge_descriptor> border_edges;
             PMP::border_halfedges(ffg, std::back_inserter(border_edges));
             for (auto edge: border_edges)
-                border_length += PMP::edge_length(edge, *mesh);
+                summary.border_length += PMP::edge_length(edge, mesh);
         }
         if (self_intersecting){
             std::vector<std::pair<fd, fd> > self_intersecting_face_pairs;
@@ -98,56 +90,548 @@ std::string TTriangleMesh::ReadFile(const std::string &filename, const int ID){
                 self_intersecting_faces.insert(face_pair.second);
             }
             for (auto face: self_intersecting_faces)
-                self_intersecting_area += PMP::face_area(face, *mesh);
+                summary.self_intersecting_area += PMP::face_area(face, mesh);
         }
         if (not_closed or not_bounding or self_intersecting) {
-            ++affected_components;
+            ++summary.affected_components;
         }
     }
-    if (affected_components > 0) {
-        std::cerr << "\nWarning: " << affected_components << " of " << num << " components have holes with total circumference "
-                  << border_length * 1e2 << "cm and " << self_intersecting_area * 1e4
-                  << "cm2 of their area is self-intersecting!\n\n";
+    mesh.remove_property_map(fccmap);
+}
+
+
+/**
+ * Read repaired polygon soup, validation summary and voxel classification of a mesh from a cache file
+ *
+ * @param filename Cache file
+ * @param hash Hash of mesh file and weld tolerance, cache is only used if it was created with identical hash
+ * @param sldname Returns name of solid
+ * @param vertices Returns vertices of polygon soup
+ * @param faces Returns faces of polygon soup
+ * @param summary Returns validation summary
+ * @param voxels Returns voxel classification
+ *
+ * @return Returns false if cache file does not exist or does not match STL file
+ */
+static bool ReadMeshCache(const boost::filesystem::path &filename, const uint64_t hash, std::string &sldname, std::vector<CPoint> &vertices,
+                          std::vector<std::vector<size_t> > &faces, TMeshSummary &summary, TVoxelGrid<unsigned char> &voxels){
+    if (!boost::filesystem::exists(filename) || boost::filesystem::file_size(filename) < sizeof(MESHCACHE_MAGIC)) // empty files can not be mapped
+        return false;
+    boost::interprocess::file_mapping file(filename.native().c_str(), boost::interprocess::read_only);
+    boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+    const char *data = static_cast<const char*>(region.get_address());
+    const char *end = data + region.get_size();
+    auto read = [&data, end](void *dest, const size_t size){
+        if (data + size > end)
+            return false;
+        std::memcpy(dest, data, size);
+        data += size;
+        return true;
+    };
+
+    char magic[sizeof(MESHCACHE_MAGIC)];
+    uint64_t filehash, namelength, nvertices, nfaces;
+    if (!read(magic, sizeof(magic)) || std::memcmp(magic, MESHCACHE_MAGIC, sizeof(magic)) != 0 || !read(&filehash, sizeof(filehash)) || filehash != hash)
+        return false;
+    if (!read(&namelength, sizeof(namelength)) || namelength > static_cast<uint64_t>(end - data))
+        return false;
+    sldname.assign(data, namelength);
+    data += namelength;
+    if (!read(&summary, sizeof(summary)) || !read(&nvertices, sizeof(nvertices)) || !read(&nfaces, sizeof(nfaces)))
+        return false;
+    uint64_t remaining = end - data;
+    if (nvertices > remaining/(3*sizeof(double)) || nfaces > remaining/(3*sizeof(uint32_t)) || remaining < nvertices*3*sizeof(double) + nfaces*3*sizeof(uint32_t))
+        return false;
+
+    vertices.reserve(nvertices);
+    for (uint64_t i = 0; i < nvertices; ++i){
+        double p[3];
+        read(p, sizeof(p));
+        vertices.push_back(CPoint(p[0], p[1], p[2]));
+    }
+    faces.reserve(nfaces);
+    for (uint64_t i = 0; i < nfaces; ++i){
+        uint32_t f[3];
+        read(f, sizeof(f));
+        if (f[0] >= nvertices || f[1] >= nvertices || f[2] >= nvertices)
+            return false;
+        faces.push_back({f[0], f[1], f[2]});
     }
-    std::cerr.precision(cout_precision);
-    std::cerr.precision(cerr_precision);
+
+    double origin[3], spacing;
+    unsigned dims[3];
+    if (!read(origin, sizeof(origin)) || !read(&spacing, sizeof(spacing)) || !read(dims, sizeof(dims)))
+        return false;
+    if (spacing <= 0 || static_cast<double>(dims[0])*dims[1]*dims[2] != end - data) // check size before allocating memory for voxels
+        return false;
+    voxels = TVoxelGrid<unsigned char>(origin, dims, spacing);
+    return read(voxels.data(), voxels.size()) && data == end;
+}
+
+
+/**
+ * Write repaired polygon soup, validation summary and voxel classification of a mesh to a cache file.
+ *
+ * The file is written under a temporary name first and then renamed, so jobs running in parallel never read incomplete cache files.
+ *
+ * @param filename Cache file
+ * @param hash Hash of mesh file and weld tolerance
+ * @param sldname Name of solid
+ * @param vertices Vertices of polygon soup
+ * @param faces Faces of polygon soup
+ * @param summary Validation summary
+ * @param voxels Voxel classification
+ */
+static void WriteMeshCache(const boost::filesystem::path &filename, const uint64_t hash, const std::string &sldname, const std::vector<CPoint> &vertices,
+                           const std::vector<std::vector<size_t> > &faces, const TMeshSummary &summary, const TVoxelGrid<unsigned char> &voxels){
+    boost::filesystem::path tmpfile = filename.parent_path() / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+    std::ofstream f(tmpfile.native(), std::fstream::binary);
+    if (!f.is_open())
+        throw std::runtime_error( (boost::format("Could not create %1%") % tmpfile.native()).str() );
+
+    uint64_t namelength = sldname.size(), nvertices = vertices.size(), nfaces = faces.size();
+    f.write(MESHCACHE_MAGIC, sizeof(MESHCACHE_MAGIC));
+    f.write((const char*)&hash, sizeof(hash));
+    f.write((const char*)&namelength, sizeof(namelength));
+    f.write(sldname.data(), namelength);
+    f.write((const char*)&summary, sizeof(summary));
+    f.write((const char*)&nvertices, sizeof(nvertices));
+    f.write((const char*)&nfaces, sizeof(nfaces));
+    for (auto &v: vertices){
+        double p[3] = {v.x(), v.y(), v.z()};
+        f.write((const char*)p, sizeof(p));
+    }
+    for (auto &face: faces){
+        if (face.size() != 3)
+            throw std::runtime_error("Only triangles can be written to mesh cache");
+        uint32_t idx[3] = {static_cast<uint32_t>(face[0]), static_cast<uint32_t>(face[1]), static_cast<uint32_t>(face[2])};
+        f.write((const char*)idx, sizeof(idx));
+    }
+    double spacing = voxels.Spacing();
+    unsigned dims[3] = {voxels.Dim(0), voxels.Dim(1), voxels.Dim(2)};
+    f.write((const char*)voxels.Origin(), 3*sizeof(double));
+    f.write((const char*)&spacing, sizeof(spacing));
+    f.write((const char*)dims, sizeof(dims));
+    f.write((const char*)voxels.data(), voxels.size());
+    f.close();
+    if (!f)
+        throw std::runtime_error( (boost::format("Could not write mesh cache %1%") % tmpfile.native()).str() );
+    boost::filesystem::rename(tmpfile, filename);
+}
+
+
+/**
+ * Merges vertices closer to each other than a given tolerance.
+ *
+ * Vertices are sorted into a hash grid with cell size equal to the tolerance, so only the surrounding cells have to be searched for close vertices.
+ */
+class TVertexWelder{
+private:
+    struct CellHash{
+        size_t operator()(const std::array<long long, 3> &c) const{ return (c[0]*73856093LL) ^ (c[1]*19349663LL) ^ (c[2]*83492791LL); }
+    };
+    std::vector<CPoint> &vertices; ///< list of merged vertices
+    double tolerance; ///< vertices closer than this distance are merged
+    double cellsize; ///< edge length of grid cells
+    std::unordered_map<std::array<long long, 3>, std::vector<size_t>, CellHash> cells; ///< indices of vertices in each grid cell
+public:
+    /**
+     * Constructor
+     *
+     * @param v List to which merged vertices are added
+     * @param tol Vertices closer than this distance are merged. If zero, only identical vertices are merged.
+     */
+    TVertexWelder(std::vector<CPoint> &v, const double tol): vertices(v), tolerance(tol), cellsize(tol > 0 ? tol : 1e-6){ };
+
+    /**
+     * Add vertex to list, if there is no other vertex within tolerance
+     *
+     * @param p Vertex
+     *
+     * @return Returns index of vertex p or the vertex it was merged with
+     */
+    size_t Add(const CPoint &p){
+        std::array<long long, 3> cell = {static_cast<long long>(std::floor(p.x()/cellsize)), static_cast<long long>(std::floor(p.y()/cellsize)), static_cast<long long>(std::floor(p.z()/cellsize))};
+        int range = tolerance > 0 ? 1 : 0; // identical vertices are always in the same cell
+        for (int i = -range; i <= range; ++i){
+            for (int j = -range; j <= range; ++j){
+                for (int k = -range; k <= range; ++k){
+                    auto c = cells.find({cell[0] + i, cell[1] + j, cell[2] + k});
+                    if (c == cells.end())
+                        continue;
+                    for (size_t v: c->second){
+                        if (CGAL::squared_distance(p, vertices[v]) <= tolerance*tolerance)
+                            return v;
+                    }
+                }
+            }
+        }
+        cells[cell].push_back(vertices.size());
+        vertices.push_back(p);
+        return vertices.size() - 1;
+    }
+};
+
+
+// convert coordinates read from file to point, snapping coordinates very close to zero to zero
+static CPoint MakeVertex(const double x, const double y, const double z){
+    return CPoint(std::abs(x) < REFLECT_TOLERANCE ? 0. : x, std::abs(y) < REFLECT_TOLERANCE ? 0. : y, std::abs(z) < REFLECT_TOLERANCE ? 0. : z);
+}
+
+
+/**
+ * Parse triangles from content of binary or ASCII STL file or Wavefront OBJ file.
+ *
+ * Polygons with more than three vertices in OBJ files are split into triangle fans.
+ *
+ * @param filename Name of file, used to detect OBJ files and for error messages
+ * @param buffer Content of file
+ * @param welder Vertex welder to which the vertices are added
+ * @param faces Returns vertex indices of each triangle
+ *
+ * @return Returns name of solid stored in file
+ */
+static std::string ParseMeshFile(const std::string &filename, const std::vector<char> &buffer, TVertexWelder &welder, std::vector<std::vector<size_t> > &faces){
+    std::string sldname;
+    std::string ext = boost::filesystem::path(filename).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    unsigned int filefacecount = 0;
+    if (buffer.size() >= 84)
+        std::memcpy(&filefacecount, &buffer[80], 4);
+
+    if (ext == ".obj"){
+        std::istringstream f(std::string(buffer.begin(), buffer.end()));
+        std::vector<size_t> vidx; // index of each vertex in file after welding
+        std::string line;
+        while (std::getline(f, line)){
+            std::istringstream l(line);
+            std::string key;
+            l >> key;
+            if (key == "v"){
+                double x, y, z;
+                l >> x >> y >> z;
+                if (!l)
+                    throw std::runtime_error( (boost::format("Invalid vertex '%1%' in %2%") % line % filename).str() );
+                vidx.push_back(welder.Add(MakeVertex(x, y, z)));
+            }
+            else if (key == "f"){
+                std::vector<size_t> polygon;
+                std::string vertex;
+                while (l >> vertex){
+                    long i = std::stol(vertex); // ignores texture and normal indices following a slash
+                    i = i < 0 ? static_cast<long>(vidx.size()) + i : i - 1; // negative indices count backwards from last vertex
+                    if (i < 0 || i >= static_cast<long>(vidx.size()))
+                        throw std::runtime_error( (boost::format("Invalid face '%1%' in %2%") % line % filename).str() );
+                    polygon.push_back(vidx[i]);
+                }
+                for (size_t j = 2; j < polygon.size(); ++j)
+                    faces.push_back({polygon[0], polygon[j - 1], polygon[j]});
+            }
+            else if ((key == "o" || key == "g") && sldname.empty()){
+                std::getline(l >> std::ws, sldname);
+            }
+        }
+    }
+    else if (buffer.size() >= 84 && buffer.size() == 84 + 50*static_cast<size_t>(filefacecount)){ // binary STL
+        sldname.assign(buffer.data(), 80); // 80-byte header
+        sldname.erase(sldname.find_last_not_of(" ") + 1); // strip trailing whitespace from header
+        for (const char *tri = &buffer[84]; tri < buffer.data() + buffer.size(); tri += 50){
+            // skip normal in STL-file (will be calculated from vertices), 2 attribute bytes at the end are not used in the STL standard (http://www.ennex.com/~fabbers/StL.asp)
+            std::vector<size_t> vidx;
+            for (short j = 0; j < 3; j++){
+                float v[3];
+                std::memcpy(v, tri + 12 + 12*j, 12);
+                vidx.push_back(welder.Add(MakeVertex(v[0], v[1], v[2])));
+            }
+            faces.push_back(vidx);
+        }
+    }
+    else if (buffer.size() >= 5 && std::string(buffer.data(), 5) == "solid"){ // ASCII STL
+        std::istringstream f(std::string(buffer.begin(), buffer.end()));
+        std::string key;
+        f >> key;
+        std::getline(f >> std::ws, sldname);
+        sldname.erase(sldname.find_last_not_of(" \r") + 1);
+        std::vector<size_t> vidx;
+        while (f >> key){
+            if (key == "vertex"){
+                double x, y, z;
+                f >> x >> y >> z;
+                if (!f)
+                    throw std::runtime_error( (boost::format("Invalid vertex in %1%") % filename).str() );
+                vidx.push_back(welder.Add(MakeVertex(x, y, z)));
+            }
+            else if (key == "endloop"){
+                if (vidx.size() != 3)
+                    throw std::runtime_error( (boost::format("%1% contains facet with %2% vertices") % filename % vidx.size()).str() );
+                faces.push_back(vidx);
+                vidx.clear();
+            }
+        }
+    }
+    else if (buffer.size() >= 84)
+        throw std::runtime_error( (boost::format("%1% should contain %2% triangles but has size %3%") % filename % filefacecount % buffer.size()).str() );
+    else
+        throw std::runtime_error( (boost::format("%1% is not a valid STL or OBJ file") % filename).str() );
+
+    if (faces.empty())
+        throw std::runtime_error( (boost::format("%1% contains no triangles") % filename).str() );
+    return sldname;
+}
+
+
+TTriangleMesh::CTriangleMesh TTriangleMesh::LoadMesh(const std::string &filename, const int ID, const std::string &cachedir, const double weldtolerance,
+                                                     std::string &sldname, std::ostream &out, std::ostream &err){
+	std::ifstream f(filename, std::fstream::binary);
+	if (!f.is_open())
+		throw std::runtime_error( (boost::format("Could not open %1%") % filename).str() );
+	std::vector<char> buffer((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	f.close();
+
+	std::vector<CPoint> vertices;
+	std::vector<std::vector<size_t> > faces;
+	TMeshSummary summary;
+	TVoxelGrid<unsigned char> voxels;
+	namespace PMP = CGAL::Polygon_mesh_processing;
+
+	uint64_t hash = FNV1a(&weldtolerance, sizeof(weldtolerance), FNV1a(buffer.data(), buffer.size()));
+	boost::filesystem::path cachefile;
+	if (!cachedir.empty())
+		cachefile = boost::filesystem::path(cachedir) / (boost::format("%016x.mesh") % hash).str();
+	bool cached = !cachefile.empty() && ReadMeshCache(cachefile, hash, sldname, vertices, faces, summary, voxels);
+	if (cached){
+		out << "Reading '" << filename << "' containing " << summary.filefaces << " triangles from cache ... ";
+	}
+	else{
+		vertices.clear();
+		faces.clear();
+		TVertexWelder welder(vertices, weldtolerance);
+		sldname = ParseMeshFile(filename, buffer, welder, faces);
+		summary.filefaces = faces.size();
+		out << "Reading '" << filename << "' containing " << faces.size() << " triangles ... ";
+
+		PMP::repair_polygon_soup(vertices, faces/*, CGAL::parameters::require_same_orientation(true)*/);
+		PMP::orient_polygon_soup(vertices, faces);
+	}
+	buffer.clear();
+	buffer.shrink_to_fit();
+
+	std::unique_ptr<CMesh> mesh(new CMesh());
+	if (not PMP::is_polygon_soup_a_polygon_mesh(faces))
+		//throw(std::runtime_error("Triangles do not form a mesh"));
+		err << "Triangles do not form a mesh\n";
+	PMP::polygon_soup_to_polygon_mesh(vertices, faces, *mesh);
+//    CGAL::Polygon_mesh_processing::duplicate_non_manifold_vertices(*mesh);
+
+	std::unique_ptr<CTree> tree(new CTree(mesh->faces_begin(), mesh->faces_end(), *mesh)); // search tree for distance queries is only built if needed
+
+	if (!cached){
+		ValidateMesh(*mesh, summary);
+		voxels = ClassifyVoxels(*tree);
+		if (!cachefile.empty())
+			WriteMeshCache(cachefile, hash, sldname, vertices, faces, summary, voxels);
+	}
+	PrintSummary(mesh->number_of_faces(), summary, out, err);
 
     std::vector<double> areas;
     std::transform(mesh->faces_begin(), mesh->faces_end(), std::back_inserter(areas), [&mesh](const CMesh::Face_index &fi){ return CGAL::Polygon_mesh_processing::face_area(fi, *mesh); });
     std::discrete_distribution<size_t> triangle_sampler(areas.begin(), areas.end());
 
-    std::unique_ptr<CTree> tree(new CTree(mesh->faces_begin(), mesh->faces_end(), *mesh));
-    tree->accelerate_distance_queries();
+	return {std::move(mesh), std::move(tree), ID, triangle_sampler, std::move(voxels)};
+}
+
+
+std::vector<std::string> TTriangleMesh::ReadFiles(const std::vector<std::pair<std::string, int> > &files, const std::string &cachedir, const double weldtolerance){
+	std::vector<CTriangleMesh> newmeshes(files.size());
+	std::vector<std::string> names(files.size());
+	std::vector<std::ostringstream> outs(files.size()), errs(files.size());
+	std::vector<std::exception_ptr> exceptions(files.size());
+
+	std::atomic<size_t> next(0);
+	auto loadfiles = [&](){
+		for (size_t i = next++; i < files.size(); i = next++){
+			try{
+				newmeshes[i] = LoadMesh(files[i].first, files[i].second, cachedir, weldtolerance, names[i], outs[i], errs[i]);
+			}
+			catch (...){
+				exceptions[i] = std::current_exception();
+			}
+		}
+	};
+	unsigned nthreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), files.size());
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < nthreads; ++i)
+		threads.push_back(std::thread(loadfiles));
+	loadfiles();
+	for (auto &t: threads)
+		t.join();
+
+	for (size_t i = 0; i < files.size(); ++i){ // print output and add meshes in the order in which the files were given
+		std::cout << outs[i].str();
+		std::cerr << errs[i].str();
+		if (exceptions[i])
+			std::rethrow_exception(exceptions[i]);
+		meshes.push_back(std::move(newmeshes[i]));
+	}
 
     std::vector<double> total_areas;
     std::transform(meshes.begin(), meshes.end(), std::back_inserter(total_areas), [](const CTriangleMesh &m){ return CGAL::Polygon_mesh_processing::area(*m.mesh); });
     mesh_sampler = std::discrete_distribution<size_t>(total_areas.begin(), total_areas.end());
+    std::vector<double> bvols;
+    std::transform(meshes.begin(), meshes.end(), std::back_inserter(bvols), [](const CTriangleMesh &m){ return CCuboid(m.tree->bbox()).volume(); });
+    bbox_sampler = std::alias_distribution<size_t>(bvols.begin(), bvols.end());
+	if (!volume_cells.empty())
+		BuildVolumeSampler(); // update sampler with new meshes
+
+	return names;
+}
+
+
+void TTriangleMesh::BuildVolumeSampler(){
+	volume_cells.clear();
+	for (unsigned i = 0; i < meshes.size(); ++i){
+		const CTriangleMesh &m = meshes[i];
+		std::vector<TVolumeCell> cells;
+		double boundaryvolume = 0, totalvolume = 0, cellvolume = std::pow(m.voxels.Spacing(), 3);
+		for (size_t j = 0; j < m.voxels.size(); ++j){
+			if (m.voxels[j] != OUTSIDE){
+				TVolumeCell cell;
+				double c[3];
+				m.voxels.Center(j, c);
+				for (int k = 0; k < 3; ++k)
+					cell.lower[k] = c[k] - 0.5*m.voxels.Spacing();
+				cell.size = m.voxels.Spacing();
+				cell.mesh = i;
+				cell.boundary = m.voxels[j] == BOUNDARY;
+				cells.push_back(cell);
+				totalvolume += cellvolume;
+				if (cell.boundary)
+					boundaryvolume += cellvolume;
+			}
+		}
+
+		// split boundary cells into eight until most of the volume can be sampled without rejection
+		for (unsigned level = 0; level < VOLUME_SAMPLER_LEVELS && boundaryvolume > 0.1*totalvolume; ++level){
+			size_t nboundary = std::count_if(cells.begin(), cells.end(), [](const TVolumeCell &cell){ return cell.boundary; });
+			if (cells.size() + 7*nboundary > VOLUME_SAMPLER_MAX_CELLS)
+				break;
+			std::vector<TVolumeCell> refined;
+			boundaryvolume = totalvolume = 0;
+			for (const TVolumeCell &cell: cells){
+				cellvolume = std::pow(cell.size, 3);
+				if (!cell.boundary){
+					refined.push_back(cell);
+					totalvolume += cellvolume;
+					continue;
+				}
+				cellvolume /= 8;
+				for (int octant = 0; octant < 8; ++octant){
+					TVolumeCell sub = cell;
+					sub.size = 0.5*cell.size;
+					for (int k = 0; k < 3; ++k)
+						sub.lower[k] += ((octant >> k) & 1)*sub.size;
+					sub.boundary = m.tree->do_intersect(CCuboid(CPoint(sub.lower[0], sub.lower[1], sub.lower[2]),
+																CPoint(sub.lower[0] + sub.size, sub.lower[1] + sub.size, sub.lower[2] + sub.size)));
+					if (!sub.boundary){
+						// cast ray from an off-center point, rays through cell centers often hit edges of symmetric meshes
+						CPoint c(sub.lower[0] + 0.2718281828*sub.size, sub.lower[1] + 0.6180339887*sub.size, sub.lower[2] + 0.5*sub.size);
+						if (m.tree->number_of_intersected_primitives(CKernel::Ray_3(c, CVector(0., 0., 1.))) % 2 == 0)
+							continue; // cell is completely outside
+					}
+					refined.push_back(sub);
+					totalvolume += cellvolume;
+					if (sub.boundary)
+						boundaryvolume += cellvolume;
+				}
+			}
+			cells.swap(refined);
+		}
+		volume_cells.insert(volume_cells.end(), cells.begin(), cells.end());
+	}
+
+	std::vector<double> weights;
+	std::transform(volume_cells.begin(), volume_cells.end(), std::back_inserter(weights), [](const TVolumeCell &cell){ return std::pow(cell.size, 3); });
+	volume_sampler = std::alias_distribution<size_t>(weights.begin(), weights.end());
+}
+
+
+// read triangles from STL- or OBJ-file
+std::string TTriangleMesh::ReadFile(const std::string &filename, const int ID, const std::string &cachedir, const double weldtolerance){
+	return ReadFiles({std::make_pair(filename, ID)}, cachedir, weldtolerance)[0];
+}
+
 
-    meshes.push_back({std::move(mesh), std::move(tree), ID, triangle_sampler});
+bool TTriangleMesh::UpdateCache(const CSegment &segment, TTriangleCache &cache) const{
+    CGAL::Bbox_3 sbox = segment.bbox();
+    if (cache.valid && sbox.xmin() >= cache.region.xmin() && sbox.xmax() <= cache.region.xmax() &&
+                       sbox.ymin() >= cache.region.ymin() && sbox.ymax() <= cache.region.ymax() &&
+                       sbox.zmin() >= cache.region.zmin() && sbox.zmax() <= cache.region.zmax())
+        return !cache.overflow; // segment still inside cached region
 
-	return sldname;
+    double margin = std::max(TRIANGLE_CACHE_MARGIN, 2*std::sqrt(segment.squared_length())); // extend region in all directions
+    cache.region = CGAL::Bbox_3(sbox.xmin() - margin, sbox.ymin() - margin, sbox.zmin() - margin, sbox.xmax() + margin, sbox.ymax() + margin, sbox.zmax() + margin);
+    cache.triangles.clear();
+    cache.valid = true;
+    cache.overflow = false;
+    CCuboid region(cache.region);
+    for (auto &m: meshes){
+        std::vector<CTree::Primitive_id> &faces = cache.faces;
+        faces.clear();
+        m.tree->all_intersected_primitives(region, std::back_inserter(faces));
+        if (cache.triangles.size() + faces.size() > TRIANGLE_CACHE_SIZE){
+            cache.triangles.clear();
+            cache.overflow = true;
+            return false;
+        }
+        CGAL::Triangle_from_face_descriptor_map<CMesh> trianglemap(m.mesh.get());
+        for (auto f: faces){
+            CKernel::Triangle_3 tri = get(trianglemap, f); // same vertex order as used by AABB tree
+            cache.triangles.push_back({tri, tri.bbox(), CGAL::Polygon_mesh_processing::compute_face_normal(f, *m.mesh), static_cast<unsigned>(m.ID)});
+        }
+    }
+    return true;
 }
 
 
 // test segment p1->p2 for collision with triangles and return a list of all found collisions
-std::vector<TCollision> TTriangleMesh::Collision(const std::vector<double> &p1, const std::vector<double> &p2) const{
+void TTriangleMesh::Collision(const double p1[3], const double p2[3], std::vector<TCollision> &colls, TTriangleCache *cache, const std::vector<bool> *skip) const{
 	CSegment segment(CPoint(p1[0], p1[1], p1[2]), CPoint(p2[0], p2[1], p2[2]));
-	std::vector<TCollision> colls;
-	for (auto &it: meshes) {
-        std::vector<CIntersection> out;
-        it.tree->all_intersections(segment, std::back_inserter(out)); // search intersections of segment with mesh
-        for (auto &i: out){
-            const CPoint *collp = boost::get<CPoint>(&(i->first));
-            if (collp) { // if intersection is a point
-                CVector n = CGAL::Polygon_mesh_processing::compute_face_normal(i->second, *it.mesh);
-                colls.push_back(TCollision(segment, n, *collp, it.ID)); // add collision to list
+	size_t first = colls.size();
+	auto skipped = [skip](const unsigned ID){ return skip != nullptr && ID < skip->size() && (*skip)[ID]; };
+	if (cache != nullptr && UpdateCache(segment, *cache)){ // test triangles in cache
+        CGAL::Bbox_3 sbox = segment.bbox();
+        for (auto &tri: cache->triangles){
+            if (skipped(tri.ID) || !CGAL::do_overlap(sbox, tri.bbox))
+                continue;
+            auto i = CGAL::intersection(segment, tri.triangle);
+            if (i){
+                const CPoint *collp = boost::get<CPoint>(&*i);
+                if (collp)
+                    colls.push_back(TCollision(segment, tri.normal, *collp, tri.ID)); // add collision to list
+                else
+                    throw std::runtime_error("Segment-triangle intersection happened to not be a point");
             }
-            else
-                throw std::runtime_error("Segment-triangle intersection happened to not be a point");
         }
-    }
+	}
+	else{ // traverse AABB trees
+        for (auto &it: meshes) {
+            if (skipped(it.ID))
+                continue;
+            std::vector<CIntersection> out;
+            it.tree->all_intersections(segment, std::back_inserter(out)); // search intersections of segment with mesh
+            for (auto &i: out){
+                const CPoint *collp = boost::get<CPoint>(&(i->first));
+                if (collp) { // if intersection is a point
+                    CVector n = CGAL::Polygon_mesh_processing::compute_face_normal(i->second, *it.mesh);
+                    colls.push_back(TCollision(segment, n, *collp, it.ID)); // add collision to list
+                }
+                else
+                    throw std::runtime_error("Segment-triangle intersection happened to not be a point");
+            }
+        }
+	}
 
-	std::sort(	colls.begin(),
+	std::sort(	colls.begin() + first,
 				colls.end(),
 				[](const TCollision &c1, const TCollision &c2){
 					if (c1.s == c2.s){
@@ -158,13 +642,78 @@ std::vector<TCollision> TTriangleMesh::Collision(const std::vector<double> &p1,
 						return c1.s < c2.s;
 				}
 	);
-	return colls;
+}
+
 
+TVoxelGrid<unsigned char> TTriangleMesh::ClassifyVoxels(const CTree &tree){
+    CCuboid bbox = tree.bbox();
+    double dx = bbox.xmax() - bbox.xmin(), dy = bbox.ymax() - bbox.ymin(), dz = bbox.zmax() - bbox.zmin();
+    double spacing = std::max(std::cbrt(dx*dy*dz), std::max(dx, std::max(dy, dz))/8)/INSIDE_GRID_RESOLUTION; // cubic voxels, limit number of voxels for flat meshes
+    // extend grid by half a voxel in each direction, so points on the bounding box are safely inside the grid
+    double lower[3] = {bbox.xmin() - 0.5*spacing, bbox.ymin() - 0.5*spacing, bbox.zmin() - 0.5*spacing};
+    double upper[3] = {bbox.xmax() + 0.5*spacing, bbox.ymax() + 0.5*spacing, bbox.zmax() + 0.5*spacing};
+    TVoxelGrid<unsigned char> voxels(lower, upper, spacing, OUTSIDE);
+
+    for (unsigned ix = 0; ix < voxels.Dim(0); ++ix){
+        for (unsigned iy = 0; iy < voxels.Dim(1); ++iy){
+            int inside = -1; // classification of current run of voxels not touching the surface, -1 if not determined yet
+            for (unsigned iz = 0; iz < voxels.Dim(2); ++iz){
+                double vlower[3], vupper[3];
+                voxels.Corners(ix, iy, iz, vlower, vupper);
+                size_t i = voxels.Index(ix, iy, iz);
+                if (tree.do_intersect(CCuboid(CPoint(vlower[0], vlower[1], vlower[2]), CPoint(vupper[0], vupper[1], vupper[2])))){
+                    voxels[i] = BOUNDARY;
+                    inside = -1; // next run needs a new ray cast
+                }
+                else{
+                    if (inside < 0){ // all points in a run of voxels that do not touch the surface are either inside or outside
+                        // cast ray from an off-center point, rays through voxel centers often hit edges of symmetric meshes
+                        CPoint c(vlower[0] + 0.2718281828*spacing, vlower[1] + 0.6180339887*spacing, vlower[2] + 0.5*spacing);
+                        inside = tree.number_of_intersected_primitives(CKernel::Ray_3(c, CVector(0., 0., 1.))) % 2 != 0;
+                    }
+                    voxels[i] = inside ? INSIDE : OUTSIDE;
+                }
+            }
+        }
+    }
+    return voxels;
 }
 
 
 bool TTriangleMesh::InSolid(const double x, const double y, const double z) const{
     return std::any_of(meshes.begin(), meshes.end(), [x,y,z](const CTriangleMesh &mesh){
-        return mesh.tree->number_of_intersected_primitives(CKernel::Ray_3(CPoint(x,y,z), CVector(0.,0.,1.))) % 2 != 0;
+        return mesh.Contains(x, y, z);
     });
 }
+
+
+bool TTriangleMesh::InSolid(const double p[3], const unsigned ID) const{
+    return std::any_of(meshes.begin(), meshes.end(), [p,ID](const CTriangleMesh &mesh){
+        return mesh.ID == static_cast<int>(ID) && mesh.Contains(p[0], p[1], p[2]);
+    });
+}
+
+
+double TTriangleMesh::Distance(const double x, const double y, const double z) const{
+    double d2 = std::numeric_limits<double>::infinity();
+    for (auto &m: meshes)
+        d2 = std::min(d2, m.tree->squared_distance(CPoint(x,y,z)));
+    return std::sqrt(d2);
+}
+
+
+uint64_t TTriangleMesh::Fingerprint() const{
+    uint64_t hash = 14695981039346656037ULL;
+    auto add = [&hash](const void *data, const size_t size){ hash = FNV1a(data, size, hash); };
+    for (auto &m: meshes){
+        add(&m.ID, sizeof(m.ID));
+        for (auto f: m.mesh->faces()){
+            for (auto v: m.mesh->vertices_around_face(m.mesh->halfedge(f))){
+                const CPoint &p = m.mesh->point(v);
+                double c[3] = {p.x(), p.y(), p.z()};
+                add(c, sizeof(c));
+            }
+        }
+    }
+    return hash;
+}
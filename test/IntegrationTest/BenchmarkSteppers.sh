@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Run the integration test with each trajectory stepper and print run time, energy drift and deviation from the analytic trajectory
+
+cd ../..
+for stepper in "dopri5 1e-9 1e-9" "bulirschstoer 1e-9 1e-9" "rk78 1e-9 1e-9" "boris 1e-9 1e-6"; do
+	set -- $stepper
+	outdir=test/IntegrationTest/benchmark_$1
+	mkdir -p $outdir
+	sed "s/^\[neutron\]/[neutron]\nstepper $1\nabserr $2\nrelerr $3/" test/IntegrationTest/config.in > test/IntegrationTest/config_$1.in # paths in config are relative to its location
+	start=$(date +%s.%N)
+	./PENTrack 0 test/IntegrationTest/config_$1.in $outdir > /dev/null
+	end=$(date +%s.%N)
+	# a = -g - mu*dBdz/m, see showintegrationresult.cxx
+	awk -v stepper=$1 -v start=$start -v end=$end 'NR > 1 {
+			drift = $41 - $14; if (drift < 0) drift = -drift; sumdrift += drift; if (drift > maxdrift) maxdrift = drift;
+			a = -15.5754762729; dx = $20 - $4 - $7*(-$9 - sqrt($9*$9 - 2*a*($6 - $22)))/a; if (dx < 0) dx = -dx; if (dx > maxdx) maxdx = dx;
+			steps += $39; n++ }
+		END { printf "%-14s %8.2f s %10d steps   energy drift mean %.3e eV, max %.3e eV   max. position error %.3e m\n", stepper, end - start, steps, sumdrift/n, maxdrift, maxdx }' \
+		$outdir/000000000000neutronend.out
+	rm -r $outdir test/IntegrationTest/config_$1.in
+done
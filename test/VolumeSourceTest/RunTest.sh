@@ -0,0 +1,8 @@
+#!/bin/bash
+
+cd ../..
+./PENTrack 0 test/VolumeSourceTest/config.in test/VolumeSourceTest
+cd test/VolumeSourceTest
+root -l -q -c ../../out/merge_all.c
+rm 000000000000neutronend.out
+root -l out.root -c showuniformity.cxx
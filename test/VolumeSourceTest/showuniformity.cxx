@@ -0,0 +1,46 @@
+// Compare start points of particles created in the 1mm thick shell of test/HollowUnitCube.STL with a uniform distribution.
+// The shell is divided into cells: the six slabs covering the faces of the inner unit cube are split into 10x10 patches,
+// the remaining edges and corners of the shell are counted separately. A chi-squared test compares the counts with the cell volumes.
+void showuniformity(){
+	const double d = 0.001; // shell thickness
+	const int N = 10; // patches per face edge
+	const double V = pow(1 + 2*d, 3) - 1; // shell volume
+	const int ncells = 6*N*N + 1;
+	vector<double> counts(ncells, 0), volumes(ncells, 0);
+	for (int i = 0; i < 6*N*N; ++i)
+		volumes[i] = d/N/N;
+	volumes[6*N*N] = V - 6*d; // edges and corners
+
+	double x, y, z;
+	neutronend->SetBranchAddress("xstart", &x);
+	neutronend->SetBranchAddress("ystart", &y);
+	neutronend->SetBranchAddress("zstart", &z);
+	Long64_t n = neutronend->GetEntries();
+	for (Long64_t i = 0; i < n; ++i){
+		neutronend->GetEntry(i);
+		double p[3] = {x, y, z};
+		int face = -1, u, v;
+		for (int j = 0; j < 3; ++j){
+			double a = p[(j + 1) % 3], b = p[(j + 2) % 3];
+			if ((p[j] < 0 || p[j] > 1) && a >= 0 && a < 1 && b >= 0 && b < 1){
+				face = 2*j + (p[j] > 1);
+				u = a*N;
+				v = b*N;
+			}
+		}
+		if (face < 0)
+			counts[6*N*N]++;
+		else
+			counts[(face*N + u)*N + v]++;
+	}
+
+	double chi2 = 0;
+	TH1D *h = new TH1D("pull", "Pull of cell counts;(observed - expected)/#sqrt{expected};cells", 40, -5, 5);
+	for (int i = 0; i < ncells; ++i){
+		double expected = n*volumes[i]/V;
+		chi2 += (counts[i] - expected)*(counts[i] - expected)/expected;
+		h->Fill((counts[i] - expected)/sqrt(expected));
+	}
+	h->Draw();
+	cout << "chi2/ndf = " << chi2 << "/" << ncells - 1 << ", p-value = " << TMath::Prob(chi2, ncells - 1) << "\n";
+}